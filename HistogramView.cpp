@@ -0,0 +1,81 @@
+#include "HistogramView.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <QPainter>
+#include <QPainterPath>
+
+HistogramView::HistogramView(QWidget *parent) : QWidget(parent) {
+    setMinimumHeight(80);
+}
+
+void HistogramView::set_stats(const FrameStats &stats, const std::vector<QColor> &colors) {
+    curves.resize(stats.channel.size());
+    curve_colors = colors;
+    curve_colors.resize(stats.channel.size(), QColor(200, 200, 200));
+
+    // Log counts scaled to the tallest column of all channels
+    float peak = 1.f;
+    for(size_t c = 0; c < stats.channel.size(); c++) {
+        const auto &histogram = stats.channel[c].histogram;
+        const int per_column  = std::max<int>(1, int(histogram.size()) / columns);
+
+        curves[c].assign(columns, 0.f);
+        for(size_t bin = 0; bin < histogram.size(); bin++) {
+            const int column  = std::min<int>(columns - 1, int(bin) / per_column);
+            curves[c][column] = std::max(curves[c][column], std::log1p(float(histogram[bin])));
+        }
+
+        peak = std::max(peak, *std::max_element(curves[c].begin(), curves[c].end()));
+    }
+
+    for(auto &curve : curves) {
+        for(auto &value : curve) {
+            value /= peak;
+        }
+    }
+
+    update();
+}
+
+void HistogramView::set_markers(const std::vector<float> &shadows, const std::vector<float> &midtones) {
+    shadow_markers  = shadows;
+    midtone_markers = midtones;
+
+    update();
+}
+
+void HistogramView::paintEvent(QPaintEvent *event) {
+    QPainter painter(this);
+    painter.fillRect(rect(), QColor(24, 24, 24));
+
+    const float w = float(width() - 1);
+    const float h = float(height() - 1);
+
+    painter.setRenderHint(QPainter::Antialiasing);
+    for(size_t c = 0; c < curves.size(); c++) {
+        QPainterPath path;
+        path.moveTo(0, h);
+        for(int column = 0; column < columns; column++) {
+            path.lineTo(w * column / (columns - 1), h * (1.f - curves[c][column]));
+        }
+        path.lineTo(w, h);
+
+        QColor fill = curve_colors[c];
+        fill.setAlpha(70);
+        painter.fillPath(path, fill);
+        painter.setPen(curve_colors[c]);
+        painter.drawPath(path);
+    }
+
+    painter.setRenderHint(QPainter::Antialiasing, false);
+    for(size_t c = 0; c < shadow_markers.size() && c < curve_colors.size(); c++) {
+        painter.setPen(QPen(curve_colors[c], 1, Qt::DashLine));
+        painter.drawLine(QPointF(w * shadow_markers[c], 0), QPointF(w * shadow_markers[c], h));
+    }
+    for(size_t c = 0; c < midtone_markers.size() && c < curve_colors.size(); c++) {
+        painter.setPen(QPen(curve_colors[c], 1, Qt::DotLine));
+        painter.drawLine(QPointF(w * midtone_markers[c], 0), QPointF(w * midtone_markers[c], h));
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _HistogramView_h_
+#define _HistogramView_h_
+
+#include <QColor>
+#include <QWidget>
+
+#include "statistics.h"
+
+//! Draws the per-channel histograms of the latest frame on a log scale, with the stretch shadows and midtones marked.
+class HistogramView : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit HistogramView(QWidget *parent = nullptr);
+
+	//! colors holds one colour per channel of stats.
+	void set_stats(const FrameStats &stats, const std::vector<QColor> &colors);
+	//! Shadow clip and midtone positions per channel as fractions of full scale, empty hides them.
+	void set_markers(const std::vector<float> &shadows, const std::vector<float> &midtones);
+
+	QSize sizeHint() const override { return QSize(240, 120); }
+
+protected:
+	void paintEvent(QPaintEvent *event) override;
+
+private:
+	//! Display columns, each the maximum of the bins it covers so narrow peaks survive.
+	static const int columns = 256;
+
+	std::vector<std::vector<float>> curves;
+	std::vector<QColor> curve_colors;
+	std::vector<float> shadow_markers;
+	std::vector<float> midtone_markers;
+};
+
+#endif
@@ -1,19 +1,82 @@
 #include "LiveView.h"
 
+#include <cmath>
+
+#include <glm/gtc/matrix_transform.hpp>
+
 #include <QApplication>
 #include <QScreen>
 #include <QWindow>
 
+#include "convert.h"
+#include "latency.h"
+#include "trace.h"
+
 LiveView::LiveView(QWidget *parent) :
     QOpenGLWidget(parent), display_width(0), display_height(0), ratio(0.f), camera_fov(55.f), texture_width(0),
-    texture_height(0), update_texture(false), translate(0.f, 0.f, 1.5f), show_crosshair(false) {}
+    texture_height(0), update_texture(false), translate(0.f, 0.f, 1.5f), show_crosshair(false), stream_buffers(3),
+    texture_format(0), color_order(0), cfa_pattern(0), black_point(0.f), white_point(4095.f), gamma(2.2f),
+    stretch(false), stretch_shadows(0.f), stretch_midtones(0.5f), selecting_roi(false), has_roi(false),
+    roi_start(0.f), roi_end(0.f), quad_vao(0), quad_vbo(0), overlay_vao(0), overlay_vbo(0) {}
+
+// Vertex attribute locations shared by both programs
+static const GLuint position_attribute = 0;
+static const GLuint texcoord_attribute = 1;
+static const GLuint color_attribute    = 1;
+
+LiveView::~LiveView() {
+    if(quad_vao == 0) {
+        return;
+    }
+
+    makeCurrent();
 
-LiveView::~LiveView() {}
+    glDeleteVertexArrays(1, &quad_vao);
+    glDeleteBuffers(1, &quad_vbo);
+    glDeleteVertexArrays(1, &overlay_vao);
+    glDeleteBuffers(1, &overlay_vbo);
+
+    doneCurrent();
+}
 
 void LiveView::set_texture_type(const GLenum &format) {
-    live_texture->destroy();
+    if(!live_texture || format == texture_format) {
+        return;
+    }
+
+    makeCurrent();
 
+    live_texture->destroy();
     live_texture->create(GL_TEXTURE_2D, format, false);
+
+    doneCurrent();
+
+    texture_format = format;
+}
+
+void LiveView::set_streaming(const int &buffers) {
+    stream_buffers = buffers;
+    if(!live_texture) {
+        return;
+    }
+
+    makeCurrent();
+    live_texture->set_streaming(buffers);
+    doneCurrent();
+}
+
+UploadStats LiveView::upload_stats() const {
+    if(!live_texture) {
+        return UploadStats{0, 0.0, 0.0, 0.0, 0};
+    }
+
+    return live_texture->upload_stats();
+}
+
+void LiveView::clear_roi() {
+    has_roi       = false;
+    selecting_roi = false;
+    star_markers.clear();
 }
 
 void LiveView::set_buffer(const int &width, const int &height, const int &channels, std::vector<uint8_t> buffer) {
@@ -43,6 +106,71 @@ void LiveView::set_buffer(const int &width, const int &height, const int &channe
     update_texture = true;
 }
 
+void LiveView::upload_buffer(const int &width,
+                             const int &height,
+                             const int &channels,
+                             const int &stride,
+                             const uint8_t *buffer) {
+    if(!live_texture) {
+        return;
+    }
+
+    // GL_UNPACK_ROW_LENGTH counts pixels, a stride that isn't a whole number of pixels has to be de-padded
+    const uint8_t *pixels = buffer;
+    int row_length        = stride / channels;
+    if(stride % channels != 0) {
+        texture_buffer.resize(width * height * channels);
+        copy_rows(texture_buffer.data(), width * channels, buffer, stride, width * channels, height);
+
+        pixels     = texture_buffer.data();
+        row_length = 0;
+    }
+
+    set_texture_type(channels == 3 ? GL_RGB8UI : GL_RGBA8UI);
+
+    makeCurrent();
+
+    switch(channels) {
+        case 3: {
+            live_texture->upload(pixels, width, height, GL_RGB_INTEGER, row_length);
+        } break;
+
+        case 4: {
+            live_texture->upload(pixels, width, height, GL_RGBA_INTEGER, row_length);
+        }
+    }
+    check_error();
+
+    doneCurrent();
+
+    texture_width   = width;
+    texture_height  = height;
+    texture_channel = channels;
+
+    update_texture = false;
+}
+
+void LiveView::upload_raw(const int &width, const int &height, const int &stride, const uint16_t *buffer) {
+    if(!live_texture) {
+        return;
+    }
+
+    set_texture_type(GL_R16UI);
+
+    makeCurrent();
+
+    live_texture->upload(buffer, width, height, GL_RED_INTEGER, stride / int(sizeof(uint16_t)));
+    check_error();
+
+    doneCurrent();
+
+    texture_width   = width;
+    texture_height  = height;
+    texture_channel = 1;
+
+    update_texture = false;
+}
+
 void LiveView::initializeGL() {
     auto error = glewInit();
     if(error != GLEW_OK) {
@@ -56,17 +184,88 @@ void LiveView::initializeGL() {
 
     live_texture = std::make_shared<Texture>();
     live_texture->create(GL_TEXTURE_2D, GL_RGBA8UI, false);
+    live_texture->set_streaming(stream_buffers);
+    texture_format = GL_RGBA8UI;
     check_error();
 
-    program = std::make_shared<Program>("../live2D.vert", "../live2D.frag");
-    program->create();
+    overlay_program = std::make_shared<Program>("../overlay.vert", "../overlay.frag");
+    overlay_program->bind_attribute("position", position_attribute);
+    overlay_program->bind_attribute("color", color_attribute);
+    overlay_program->create();
+    check_error();
+
+    // Triangle strip over [-1, 1], scaled to the image aspect by the model matrix
+    const float quad[] = {-1.f, -1.f, 0.f, 0.f, 1.f, -1.f, 1.f, 0.f, -1.f, 1.f, 0.f, 1.f, 1.f, 1.f, 1.f, 1.f};
+
+    glGenVertexArrays(1, &quad_vao);
+    glGenBuffers(1, &quad_vbo);
+
+    glBindVertexArray(quad_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(position_attribute);
+    glVertexAttribPointer(position_attribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(texcoord_attribute);
+    glVertexAttribPointer(
+        texcoord_attribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), reinterpret_cast<void *>(2 * sizeof(float)));
+    check_error();
+
+    glGenVertexArrays(1, &overlay_vao);
+    glGenBuffers(1, &overlay_vbo);
+
+    glBindVertexArray(overlay_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, overlay_vbo);
+    glEnableVertexAttribArray(position_attribute);
+    glVertexAttribPointer(position_attribute, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(color_attribute);
+    glVertexAttribPointer(
+        color_attribute, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), reinterpret_cast<void *>(2 * sizeof(float)));
+    check_error();
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Everything is drawn flat on z = 0, later draws go on top
+    glDisable(GL_DEPTH_TEST);
     check_error();
+}
+
+std::shared_ptr<Program> LiveView::image_program() {
+    // The channel order is resolved when the shader is compiled instead of per pixel
+    std::string variant;
+    if(texture_channel == 1) {
+        variant = "raw";
+    } else if(texture_channel == 4 && color_order == 2) {
+        variant = "abg";
+    } else if(color_order != 0) {
+        variant = "bgr";
+    } else {
+        variant = "rgb";
+    }
+
+    auto found = image_programs.find(variant);
+    if(found != image_programs.end()) {
+        return found->second;
+    }
+
+    const std::string defines = variant == "raw" ? "#define RAW\n" : "#define SWIZZLE " + variant + "\n";
 
+    auto program = std::make_shared<Program>("../live2D.vert", "../live2D.frag", defines);
+    program->bind_attribute("position", position_attribute);
+    program->bind_attribute("texcoord", texcoord_attribute);
+    program->create();
     program->bind_parameter("image", live_texture);
     check_error();
+
+    image_programs[variant] = program;
+
+    return program;
 }
 
 void LiveView::paintGL() {
+    ScopedLatency latency(LatencyStage::Paint);
+    TraceScope trace("paint");
+
     glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
     check_error();
 
@@ -77,24 +276,16 @@ void LiveView::paintGL() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     check_error();
 
-    if(texture_buffer.size() == 0) {
+    if(texture_width == 0 || texture_height == 0) {
         return;
     }
 
     float fw, fh;
     image_dimensions(fw, fh);
-    // printf("image_dimensions: %f,%f\n", fw, fh);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(camera_fov, ratio, 0.1, 5.0);
-    check_error();
-
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    // gluLookAt(0.0, 0.0, 2.25, 0.0, 0.0, 2.25 - 2.0, 0.0, 1.0, 0.0);
-    gluLookAt(translate.x, -translate.y, translate.z, translate.x, -translate.y, translate.z - 2.0, 0, 1, 0);
-    check_error();
+    const glm::mat4 projection = glm::perspective(glm::radians(camera_fov), ratio, 0.1f, 5.f);
+    const glm::vec3 eye(translate.x, -translate.y, translate.z);
+    const glm::mat4 view_projection = projection * glm::lookAt(eye, eye - glm::vec3(0.f, 0.f, 2.f), glm::vec3(0, 1, 0));
 
     if(update_texture) {
         switch(texture_channel) {
@@ -110,68 +301,82 @@ void LiveView::paintGL() {
         check_error();
     }
 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_BLEND);
-    glEnable(GL_ALPHA_TEST);
-    check_error();
+    auto program = image_program();
 
     program->bind();
     check_error();
 
-    program->set_uniform("channels", texture_channel);
-    program->set_uniform("color_order", color_order);
+    program->set_uniform("mvp", glm::scale(view_projection, glm::vec3(fw, fh, 1.f)));
+    program->set_uniform("cfa_pattern", cfa_pattern);
+    program->set_uniform("black_point", black_point);
+    program->set_uniform("white_point", white_point);
+    program->set_uniform("gamma", gamma);
+    program->set_uniform("stretch", stretch ? 1 : 0);
+    program->set_uniform("stretch_shadows", stretch_shadows);
+    program->set_uniform("stretch_midtones", stretch_midtones);
     check_error();
 
-    // Not sure if this is legacy? Displaying a black quad...
-    glColor4f(0, 0, 0, 1);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 0.0);
-    glVertex3f(-fw, -fh, 0); // -1 -1
-    glTexCoord2f(1.0, 0.0);
-    glVertex3f(fw, -fh, 0); // 1 -1
-    glTexCoord2f(1.0, 1.0);
-    glVertex3f(fw, fh, 0); // 1 1
-    glTexCoord2f(0.0, 1.0);
-    glVertex3f(-fw, fh, 0); // -1 1
-    glEnd();
+    glBindVertexArray(quad_vao);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
     check_error();
 
     program->unbind();
     check_error();
 
-    glDisable(GL_DEPTH_TEST);
-    check_error();
+    draw_overlays(view_projection, fw, fh);
+}
 
-    // Draw our region of interest on top
-    glColor4f(1, 1, 1, 1);
+void LiveView::draw_overlays(const glm::mat4 &view_projection, const float &fw, const float &fh) {
+    overlay_vertices.clear();
 
-    glBegin(GL_LINES);
-    glVertex3f(-fw, -fh, 0);
-    glVertex3f(fw, -fh, 0);
+    auto line = [this](const glm::vec2 &a, const glm::vec2 &b, const glm::vec3 &color) {
+        overlay_vertices.insert(overlay_vertices.end(), {a.x, a.y, color.r, color.g, color.b});
+        overlay_vertices.insert(overlay_vertices.end(), {b.x, b.y, color.r, color.g, color.b});
+    };
 
-    glVertex3f(fw, -fh, 0);
-    glVertex3f(fw, fh, 0);
+    auto rectangle = [&line](const glm::vec2 &a, const glm::vec2 &b, const glm::vec3 &color) {
+        line(glm::vec2(a.x, a.y), glm::vec2(b.x, a.y), color);
+        line(glm::vec2(b.x, a.y), glm::vec2(b.x, b.y), color);
+        line(glm::vec2(b.x, b.y), glm::vec2(a.x, b.y), color);
+        line(glm::vec2(a.x, b.y), glm::vec2(a.x, a.y), color);
+    };
 
-    glVertex3f(fw, fh, 0);
-    glVertex3f(-fw, fh, 0);
-
-    glVertex3f(-fw, fh, 0);
-    glVertex3f(-fw, -fh, 0);
-    glEnd();
-    check_error();
+    // Image border
+    rectangle(glm::vec2(-fw, -fh), glm::vec2(fw, fh), glm::vec3(1.f));
 
     if(show_crosshair) {
-        glColor4f(1, 0, 0, 1);
-        glBegin(GL_LINES);
-        glVertex3f(0, -fh, 0);
-        glVertex3f(0, fh, 0);
-
-        glVertex3f(-fw, 0, 0);
-        glVertex3f(fw, 0, 0);
-        glEnd();
+        line(glm::vec2(0.f, -fh), glm::vec2(0.f, fh), glm::vec3(1.f, 0.f, 0.f));
+        line(glm::vec2(-fw, 0.f), glm::vec2(fw, 0.f), glm::vec3(1.f, 0.f, 0.f));
+    }
+
+    if(has_roi || selecting_roi) {
+        rectangle(image_to_world(roi_start), image_to_world(roi_end), glm::vec3(1.f, 1.f, 0.f));
     }
 
-    glEnable(GL_DEPTH_TEST);
+    // Small crosses the size of a few image pixels
+    const float size = 4.f * (2.f * fw / std::max(texture_width, 1));
+    for(auto &marker : star_markers) {
+        auto p = image_to_world(marker);
+        line(glm::vec2(p.x - size, p.y), glm::vec2(p.x + size, p.y), glm::vec3(0.f, 1.f, 0.f));
+        line(glm::vec2(p.x, p.y - size), glm::vec2(p.x, p.y + size), glm::vec3(0.f, 1.f, 0.f));
+    }
+
+    overlay_program->bind();
+    overlay_program->set_uniform("mvp", view_projection);
+    check_error();
+
+    // Orphaned every paint so the driver never waits on last frame's lines
+    glBindBuffer(GL_ARRAY_BUFFER, overlay_vbo);
+    glBufferData(GL_ARRAY_BUFFER, overlay_vertices.size() * sizeof(float), overlay_vertices.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindVertexArray(overlay_vao);
+    glDrawArrays(GL_LINES, 0, GLsizei(overlay_vertices.size() / 5));
+    glBindVertexArray(0);
+    check_error();
+
+    overlay_program->unbind();
     check_error();
 }
 
@@ -203,6 +408,9 @@ void LiveView::mouseMoveEvent(QMouseEvent *p) {
     int y = display_height - ty;
 
     if(p->buttons() == Qt::LeftButton) {
+        if(selecting_roi) {
+            roi_end = screen_to_image(x, y);
+        }
     } else if(p->buttons() == Qt::MiddleButton) {
         trackball.update(x, y);
     } else if(p->buttons() == Qt::RightButton) {
@@ -225,6 +433,11 @@ void LiveView::mousePressEvent(QMouseEvent *p) {
 
     // left mouse button
     if(p->buttons() == Qt::LeftButton) {
+        if(texture_width > 0 && texture_height > 0) {
+            selecting_roi = true;
+            roi_start     = screen_to_image(x, y);
+            roi_end       = roi_start;
+        }
     } else if(p->buttons() == Qt::MiddleButton) {
         trackball.setManipulation(Manipulation::Manipulation_TransX, Manipulation::Manipulation_TransY);
         trackball.grab(x, y);
@@ -247,6 +460,30 @@ void LiveView::mouseReleaseEvent(QMouseEvent *p) {
     int y = display_height - ty;
 
     if(p->button() == Qt::LeftButton) {
+        if(selecting_roi) {
+            selecting_roi = false;
+            roi_end       = screen_to_image(x, y);
+
+            // Clamp to the image, a click without a drag clears the selection
+            const glm::vec2 size(texture_width, texture_height);
+
+            glm::vec2 low  = glm::clamp(glm::min(roi_start, roi_end), glm::vec2(0.f), size);
+            glm::vec2 high = glm::clamp(glm::max(roi_start, roi_end), glm::vec2(0.f), size);
+
+            roi_start = low;
+            roi_end   = high;
+
+            glm::ivec2 origin(low);
+            glm::ivec2 extent = glm::ivec2(high) - origin;
+
+            has_roi = extent.x >= 8 && extent.y >= 8;
+            if(!has_roi) {
+                star_markers.clear();
+                extent = glm::ivec2(0);
+            }
+
+            Q_EMIT roi_changed(origin.x, origin.y, extent.x, extent.y);
+        }
     } else if(p->button() == Qt::MiddleButton) {
         trackball.release();
 
@@ -272,6 +509,31 @@ void LiveView::wheelEvent(QWheelEvent *p) {
     }
 }
 
+glm::vec2 LiveView::screen_to_image(const int &x, const int &y) {
+    float fw, fh;
+    image_dimensions(fw, fh);
+
+    // Where the ray through the pixel meets the z = 0 plane the quad sits on
+    const float half_height = translate.z * std::tan(glm::radians(camera_fov) * 0.5f);
+    const float half_width  = half_height * ratio;
+
+    const float wx = translate.x + (2.f * x / std::max(display_width, 1) - 1.f) * half_width;
+    const float wy = -translate.y + (2.f * y / std::max(display_height, 1) - 1.f) * half_height;
+
+    // The vertex shader flips t, the first image row is at the top of the quad
+    const float u = (wx + fw) / (2.f * fw);
+    const float v = (wy + fh) / (2.f * fh);
+
+    return glm::vec2(u * texture_width, (1.f - v) * texture_height);
+}
+
+glm::vec2 LiveView::image_to_world(const glm::vec2 &p) {
+    float fw, fh;
+    image_dimensions(fw, fh);
+
+    return glm::vec2(p.x / texture_width * 2.f * fw - fw, (1.f - p.y / texture_height) * 2.f * fh - fh);
+}
+
 void LiveView::image_dimensions(float &fw, float &fh) {
     float largest = float(std::max(texture_width, texture_height));
 
@@ -3,6 +3,8 @@
 
 #include <GL/glew.h>
 
+#include <map>
+
 #include <QWidget>
 #include <QMouseEvent>
 #include <QOpenGLWidget>
@@ -26,9 +28,38 @@ public:
 	
 	void set_buffer(const int &width, const int &height, const int &channels, std::vector<uint8_t> buffer);
 	void set_buffer(const int &width, const int &height, const int &channels, const uint8_t *buffer);
+
+	//! Uploads a (possibly padded) frame straight to the texture, the buffer can be released once this returns.
+	void upload_buffer(const int &width, const int &height, const int &channels, const int &stride, const uint8_t *buffer);
+	//! Uploads a 16-bit Bayer frame, stride is in bytes. Demosaicing and levels are done in the shader.
+	void upload_raw(const int &width, const int &height, const int &stride, const uint16_t *buffer);
+
+	//! 0 uploads straight from client memory, 2 or 3 streams frames through that many pixel buffers.
+	void set_streaming(const int &buffers);
+	UploadStats upload_stats() const;
+	
+	//! Star positions in image pixels, drawn over the frame.
+	void set_star_markers(const std::vector<glm::vec2> &markers) { star_markers = markers; }
+	void clear_roi();
 	
 	int color_order;
 
+	//! 0 RGGB, 1 GRBG, 2 GBRG, 3 BGGR, 4 mono.
+	int cfa_pattern;
+	//! Raw preview levels in sample units.
+	float black_point;
+	float white_point;
+	float gamma;
+
+	//! Screen transfer stretch in display RGB, applied after normalization. Replaces the raw gamma when enabled.
+	bool stretch;
+	glm::vec3 stretch_shadows;
+	glm::vec3 stretch_midtones;
+
+Q_SIGNALS:
+	//! Emitted when a left drag selection finishes, in image pixels. An empty region means the selection was cleared.
+	void roi_changed(int x, int y, int width, int height);
+
 private:
 	void initializeGL();
 	void paintGL();
@@ -42,6 +73,15 @@ private:
 	
 	void image_dimensions(float &fw, float &fh);
 
+	//! The image program specialized for the current texture, compiled the first time a format is shown.
+	std::shared_ptr<Program> image_program();
+	//! Border, crosshair, region of interest and star markers as one batch of lines.
+	void draw_overlays(const glm::mat4 &view_projection, const float &fw, const float &fh);
+
+	//! Maps a framebuffer position (origin bottom left) to image pixels, and image pixels to the quad's plane.
+	glm::vec2 screen_to_image(const int &x, const int &y);
+	glm::vec2 image_to_world(const glm::vec2 &p);
+
 	glm::vec3 translate;
 	
 	int display_width;
@@ -51,14 +91,31 @@ private:
 	float camera_fov;
 
 	bool show_crosshair;
+
+	bool selecting_roi;
+	bool has_roi;
+	glm::vec2 roi_start;
+	glm::vec2 roi_end;
+	std::vector<glm::vec2> star_markers;
 	
 	bool update_texture;
+	int stream_buffers;
+	GLenum texture_format;
 	int texture_width;
 	int texture_height;
 	int texture_channel;
 	std::vector<uint8_t> texture_buffer;
 	
-	std::shared_ptr<Program> program;
+	std::map<std::string, std::shared_ptr<Program>> image_programs;
+	std::shared_ptr<Program> overlay_program;
+
+	//! Static unit quad, and a stream buffer refilled with the overlay lines every paint.
+	GLuint quad_vao;
+	GLuint quad_vbo;
+	GLuint overlay_vao;
+	GLuint overlay_vbo;
+	//! x, y, r, g, b per vertex.
+	std::vector<float> overlay_vertices;
 	std::shared_ptr<Texture> live_texture;
 
 	Trackball trackball;
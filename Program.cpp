@@ -1,12 +1,14 @@
 #include "Program.h"
 
-Program::Program(const std::string &vert, const std::string &frag) {
+Program::Program(const std::string &vert, const std::string &frag, const std::string &defines) {
     fragment_shader      = std::make_unique<FragmentShader>();
     fragment_shader_file = frag;
 
     vertex_shader      = std::make_unique<VertexShader>();
     vertex_shader_file = vert;
 
+    shader_defines = defines;
+
     program_id   = 0;
     link_program = false;
 }
@@ -16,8 +18,8 @@ void Program::create() {
         program_id = glCreateProgram();
     }
 
-    vertex_shader->load(vertex_shader_file);
-    fragment_shader->load(fragment_shader_file);
+    vertex_shader->load(vertex_shader_file, shader_defines);
+    fragment_shader->load(fragment_shader_file, shader_defines);
     check_error();
 
     vertex_shader->attach(program_id);
@@ -45,6 +47,10 @@ void Program::destroy() {
 
 void Program::bind() {
     if(!link_program) {
+        for(auto &attribute : attributes) {
+            glBindAttribLocation(program_id, attribute.location, attribute.name.c_str());
+        }
+
         glLinkProgram(program_id);
         check_error();
 
@@ -98,7 +104,30 @@ void Program::bind_parameter(const std::string &name, std::shared_ptr<Texture> t
     textures.push_back(item);
 }
 
+void Program::bind_attribute(const std::string &name, const GLuint &location) {
+    AttributeItem item;
+    item.name     = name;
+    item.location = location;
+
+    attributes.push_back(item);
+}
+
 void Program::set_uniform(const std::string &loc, const int &value) {
     GLint position = get_uniform_location(loc);
     glUniform1i(position, value);
 }
+
+void Program::set_uniform(const std::string &loc, const float &value) {
+    GLint position = get_uniform_location(loc);
+    glUniform1f(position, value);
+}
+
+void Program::set_uniform(const std::string &loc, const glm::vec3 &value) {
+    GLint position = get_uniform_location(loc);
+    glUniform3f(position, value.x, value.y, value.z);
+}
+
+void Program::set_uniform(const std::string &loc, const glm::mat4 &value) {
+    GLint position = get_uniform_location(loc);
+    glUniformMatrix4fv(position, 1, GL_FALSE, &value[0][0]);
+}
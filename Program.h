@@ -5,13 +5,16 @@
 #include <string>
 #include <vector>
 
+#include <glm/glm.hpp>
+
 #include "glcheck.h"
 #include "Shader.h"
 #include "Texture.h"
 
 class Program {
   public:
-    Program(const std::string &vertex, const std::string &fragment);
+    //! defines (e.g. "#define RAW\n") are added to both shaders.
+    Program(const std::string &vertex, const std::string &fragment, const std::string &defines = "");
 
     void create();
     void destroy();
@@ -20,8 +23,13 @@ class Program {
     void unbind();
 
     void bind_parameter(const std::string &name, std::shared_ptr<Texture> tex);
+    //! Fixes a vertex attribute location, applied when the program is linked.
+    void bind_attribute(const std::string &name, const GLuint &location);
 
     void set_uniform(const std::string &loc, const int &value);
+    void set_uniform(const std::string &loc, const float &value);
+    void set_uniform(const std::string &loc, const glm::vec3 &value);
+    void set_uniform(const std::string &loc, const glm::mat4 &value);
 
   protected:
     inline GLint get_uniform_location(const std::string &loc) { return glGetUniformLocation(program_id, loc.c_str()); }
@@ -32,6 +40,7 @@ class Program {
 
     std::string fragment_shader_file;
     std::string vertex_shader_file;
+    std::string shader_defines;
 
     GLuint program_id;
     bool link_program;
@@ -43,6 +52,13 @@ class Program {
     };
 
     std::vector<TextureItem> textures;
+
+    struct AttributeItem {
+        std::string name;
+        GLuint location;
+    };
+
+    std::vector<AttributeItem> attributes;
 };
 
 #endif
@@ -27,7 +27,7 @@ Shader::Shader(const GLenum &type) : shader_type(type) {
     shader_compiled = false;
 }
 
-void Shader::load(const std::string &file) {
+void Shader::load(const std::string &file, const std::string &defines) {
     shader_file = file;
 
     std::ifstream f(file);
@@ -36,6 +36,15 @@ void Shader::load(const std::string &file) {
 
     shader_contents = buffer.str();
 
+    if(!defines.empty()) {
+        size_t position = 0;
+        if(shader_contents.compare(0, 8, "#version") == 0) {
+            position = shader_contents.find('\n');
+            position = position == std::string::npos ? shader_contents.size() : position + 1;
+        }
+        shader_contents.insert(position, defines);
+    }
+
     shader_compiled = false;
 }
 
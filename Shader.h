@@ -20,7 +20,8 @@ class Shader {
   public:
     Shader(const GLenum &type);
 
-    void load(const std::string &file);
+    //! defines is inserted after the #version line so one source can be compiled into several variants.
+    void load(const std::string &file, const std::string &defines = "");
 
     bool compile();
     void release();
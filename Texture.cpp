@@ -1,8 +1,33 @@
 #include "Texture.h"
 
+#include <algorithm>
+#include <chrono>
+
+#include "convert.h"
+#include "latency.h"
+#include "trace.h"
+
+static int format_components(const GLenum &format) {
+    switch(format) {
+        case GL_RED:
+        case GL_RED_INTEGER:
+            return 1;
+        case GL_RG:
+        case GL_RG_INTEGER:
+            return 2;
+        case GL_RGB:
+        case GL_BGR:
+        case GL_RGB_INTEGER:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
 Texture::Texture() :
     texture_id(0), texture_target(GL_TEXTURE_2D), texture_internal_format(GL_RGBA), updated_texture(false),
-    uploaded_format(0), texture_width(0), texture_height(0) {}
+    uploaded_format(0), texture_width(0), texture_height(0), stream_buffers(0), next_buffer(0),
+    stats{0, 0.0, 0.0, 0.0, 0} {}
 
 void Texture::create(GLenum target, GLenum internal_format, const bool &normalized) {
     glGenTextures(1, &texture_id);
@@ -37,6 +62,8 @@ void Texture::destroy() {
     texture_height  = 0;
     uploaded_format = 0;
 
+    release_buffers();
+
     glDeleteTextures(1, &texture_id);
     check_error();
 }
@@ -51,13 +78,43 @@ void Texture::unbind() {
     check_error();
 }
 
-void Texture::upload(unsigned char *ptr, const int64_t &width, const int64_t &height, const GLenum &upload_format) {
+void Texture::upload(const unsigned char *ptr,
+                     const int64_t &width,
+                     const int64_t &height,
+                     const GLenum &upload_format,
+                     const int64_t &row_length) {
+    upload_pixels(ptr, width, height, upload_format, GL_UNSIGNED_BYTE, format_components(upload_format), row_length);
+}
+
+void Texture::upload(const unsigned short *ptr,
+                     const int64_t &width,
+                     const int64_t &height,
+                     const GLenum &upload_format,
+                     const int64_t &row_length) {
+    upload_pixels(ptr,
+                  width,
+                  height,
+                  upload_format,
+                  GL_UNSIGNED_SHORT,
+                  format_components(upload_format) * int(sizeof(unsigned short)),
+                  row_length);
+}
+
+void Texture::upload_pixels(const void *ptr,
+                            const int64_t &width,
+                            const int64_t &height,
+                            const GLenum &upload_format,
+                            const GLenum &type,
+                            const int &pixel_bytes,
+                            const int64_t &row_length) {
+    TraceScope trace("texture_upload");
+
+    auto start = std::chrono::steady_clock::now();
+
     bind();
 
-    if(upload_format == uploaded_format && width == texture_width && height == texture_height) {
-        glTexSubImage2D(texture_target, 0, 0, 0, GLsizei(width), GLsizei(height), upload_format, GL_UNSIGNED_BYTE, ptr);
-        check_error();
-    } else {
+    if(upload_format != uploaded_format || width != texture_width || height != texture_height) {
+        // Storage only, the pixels follow through the same path as every other frame
         glTexImage2D(texture_target,
                      0,
                      texture_internal_format,
@@ -65,9 +122,8 @@ void Texture::upload(unsigned char *ptr, const int64_t &width, const int64_t &he
                      GLsizei(height),
                      0,
                      upload_format,
-                     GL_UNSIGNED_BYTE,
-                     ptr);
-
+                     type,
+                     nullptr);
         check_error();
 
         texture_width   = width;
@@ -75,11 +131,140 @@ void Texture::upload(unsigned char *ptr, const int64_t &width, const int64_t &he
         uploaded_format = upload_format;
     }
 
+    if(stage_pixels(ptr, width, height, pixel_bytes, row_length)) {
+        // Staged rows are tightly packed, the texture reads from offset 0 of the bound buffer
+        glTexSubImage2D(texture_target, 0, 0, 0, GLsizei(width), GLsizei(height), upload_format, type, nullptr);
+        check_error();
+
+        auto &buffer = pixel_buffers[next_buffer];
+        buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        check_error();
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        next_buffer = (next_buffer + 1) % int(pixel_buffers.size());
+    } else {
+        // Lets padded camera rows go straight to the driver without de-padding them first
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, GLint(row_length));
+
+        glTexSubImage2D(texture_target, 0, 0, 0, GLsizei(width), GLsizei(height), upload_format, type, ptr);
+        check_error();
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
     unbind();
 
     updated_texture = true;
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.uploads++;
+    stats.last_ms = ms;
+    stats.max_ms  = std::max(stats.max_ms, ms);
+    stats.average_ms += (ms - stats.average_ms) / double(stats.uploads);
+
+    stage_latency(LatencyStage::TextureUpload).record_since(start);
+}
+
+bool Texture::stage_pixels(const void *ptr,
+                           const int64_t &width,
+                           const int64_t &height,
+                           const int &pixel_bytes,
+                           const int64_t &row_length) {
+    if(stream_buffers == 0 || !GLEW_ARB_pixel_buffer_object || !GLEW_ARB_map_buffer_range || !GLEW_ARB_sync) {
+        return false;
+    }
+
+    if(pixel_buffers.empty()) {
+        pixel_buffers.resize(stream_buffers, PixelBuffer{0, 0, nullptr});
+        for(auto &buffer : pixel_buffers) {
+            glGenBuffers(1, &buffer.id);
+        }
+        check_error();
+
+        next_buffer = 0;
+    }
+
+    auto &buffer = pixel_buffers[next_buffer];
+
+    const size_t row_bytes = size_t(width) * pixel_bytes;
+    const size_t src_pitch = row_length > 0 ? size_t(row_length) * pixel_bytes : row_bytes;
+    const size_t size      = row_bytes * size_t(height);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.id);
+    check_error();
+
+    // A buffer the GPU is still reading from gets fresh storage instead of a wait, the driver frees the old one later
+    bool orphan = buffer.size != size;
+    if(buffer.fence) {
+        if(glClientWaitSync(buffer.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            orphan = true;
+            stats.orphaned++;
+        }
+
+        glDeleteSync(buffer.fence);
+        buffer.fence = nullptr;
+    }
+
+    if(orphan) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(size), nullptr, GL_STREAM_DRAW);
+        check_error();
+
+        buffer.size = size;
+    }
+
+    void *mapped = glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(size), GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if(mapped == nullptr) {
+        check_error();
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+    }
+
+    // De-padded on the way in, so the driver moves only the pixels
+    copy_rows(static_cast<uint8_t *>(mapped),
+              row_bytes,
+              static_cast<const uint8_t *>(ptr),
+              src_pitch,
+              row_bytes,
+              int(height));
+
+    if(!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+        // The contents were lost (e.g. a mode switch), skip this frame's streaming and upload directly
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+    }
+
+    return true;
+}
+
+void Texture::set_streaming(const int &buffers) {
+    const int count = buffers <= 0 ? 0 : std::clamp(buffers, 2, 3);
+    if(count == stream_buffers) {
+        return;
+    }
+
+    release_buffers();
+    stream_buffers = count;
+
+    reset_upload_stats();
+}
+
+void Texture::release_buffers() {
+    for(auto &buffer : pixel_buffers) {
+        if(buffer.fence) {
+            glDeleteSync(buffer.fence);
+        }
+        glDeleteBuffers(1, &buffer.id);
+    }
+    check_error();
+
+    pixel_buffers.clear();
+    next_buffer = 0;
 }
 
+void Texture::reset_upload_stats() { stats = UploadStats{0, 0.0, 0.0, 0.0, 0}; }
+
 bool Texture::updated() const { return updated_texture; }
 
 void Texture::set_updated(const bool &updated) { updated_texture = updated; }
@@ -3,8 +3,22 @@
 
 #include <GL/glew.h>
 
+#include <cstdint>
+#include <vector>
+
 #include "glcheck.h"
 
+//! Time spent inside upload, on the calling thread.
+struct UploadStats {
+    int64_t uploads;
+    double last_ms;
+    double average_ms;
+    double max_ms;
+
+    //! Streaming uploads that found their pixel buffer still in use and had to orphan it.
+    int64_t orphaned;
+};
+
 class Texture {
   public:
     Texture();
@@ -16,9 +30,27 @@ class Texture {
     void bind();
     void unbind();
 
-    void upload(unsigned char *ptr, const int64_t &width, const int64_t &height, const GLenum &upload_format);
-    void upload(unsigned short *ptr, const int64_t &width, const int64_t &height, const GLenum &upload_format);
-    void upload(float *ptr, const int64_t &width, const int64_t &height, const GLenum &upload_format);
+    //! row_length is the source row pitch in pixels, 0 for tightly packed rows.
+    void upload(const unsigned char *ptr,
+                const int64_t &width,
+                const int64_t &height,
+                const GLenum &upload_format,
+                const int64_t &row_length = 0);
+    void upload(const unsigned short *ptr,
+                const int64_t &width,
+                const int64_t &height,
+                const GLenum &upload_format,
+                const int64_t &row_length = 0);
+    void upload(const float *ptr, const int64_t &width, const int64_t &height, const GLenum &upload_format);
+
+    //! Uploads through a ring of 2 or 3 pixel buffer objects, 0 goes back to uploading from client memory. Each
+    //! upload is copied into a mapped buffer while the GPU is still reading the previous one, fences tell when a
+    //! buffer is free again.
+    void set_streaming(const int &buffers);
+    int streaming() const { return stream_buffers; }
+
+    UploadStats upload_stats() const { return stats; }
+    void reset_upload_stats();
 
     bool updated() const;
     void set_updated(const bool &updated);
@@ -28,6 +60,21 @@ class Texture {
     unsigned int get_texture_id() const;
 
   protected:
+    void upload_pixels(const void *ptr,
+                       const int64_t &width,
+                       const int64_t &height,
+                       const GLenum &upload_format,
+                       const GLenum &type,
+                       const int &pixel_bytes,
+                       const int64_t &row_length);
+    //! Copies into the next free pixel buffer and leaves it bound to GL_PIXEL_UNPACK_BUFFER, false if unavailable.
+    bool stage_pixels(const void *ptr,
+                      const int64_t &width,
+                      const int64_t &height,
+                      const int &pixel_bytes,
+                      const int64_t &row_length);
+    void release_buffers();
+
     GLuint texture_id;
 
     GLenum texture_target;
@@ -39,6 +86,18 @@ class Texture {
     int texture_height;
 
     bool updated_texture;
+
+    struct PixelBuffer {
+        GLuint id;
+        size_t size;
+        GLsync fence;
+    };
+
+    int stream_buffers;
+    int next_buffer;
+    std::vector<PixelBuffer> pixel_buffers;
+
+    UploadStats stats;
 };
 
 #endif
@@ -0,0 +1,513 @@
+// TeleZeroBench times the frame hot paths at every size the camera offers (full, 1/2, 1/4 and 1/8 of the sensor) on
+// a synthetic star field. Results go to stdout as CSV, one row per kernel and size:
+//
+//   kernel,variant,width,height,bytes,output_bytes,iterations,median_ms,min_ms,ns_per_pixel,gb_per_s
+//
+// bytes is the size of the frame the kernel reads and output_bytes what it leaves behind where that varies (the
+// compressed TIFF size), ns/pixel and GB/s come from the median iteration. Anything the kernels print goes to stderr
+// so the output stays parseable. Given --baseline, a previous run is compared against and the exit status is 1 when
+// a kernel got slower than --threshold times its baseline.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "convert.h"
+#include "stacker.h"
+#include "statistics.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+#include "tiff.h"
+#include "unpack.h"
+#include "util.h"
+
+namespace {
+const std::vector<std::pair<int, int>> sizes = {{4056, 3040}, {2028, 1520}, {1014, 760}, {507, 380}};
+
+struct BenchOptions {
+    //! Timed iterations per kernel, fewer when a kernel has used up max_seconds (never less than 3).
+    int iterations;
+    double max_seconds;
+
+    //! Only kernels whose kernel/variant/WxH name contains this run.
+    std::string filter;
+    //! Where the TIFF kernels write their files.
+    std::string directory;
+
+    std::string baseline;
+    double threshold;
+};
+
+struct BenchResult {
+    std::string kernel;
+    std::string variant;
+    int width;
+    int height;
+    size_t bytes;
+    size_t output_bytes;
+    int iterations;
+    double median_ms;
+    double min_ms;
+
+    std::string key() const { return format("%s/%s/%ix%i", kernel.c_str(), variant.c_str(), width, height); }
+    double ns_per_pixel() const { return median_ms * 1e6 / (double(width) * height); }
+    double gb_per_s() const { return double(bytes) / (median_ms * 1e6); }
+};
+
+//! One synthetic frame in a camera format, rows padded out to 64 bytes the way the ISP aligns its strides.
+struct BenchFrame {
+    int width;
+    int height;
+    int channels;
+    int stride;
+    int bit_depth;
+    bool packed;
+    std::vector<uint8_t> pixels;
+
+    FrameView view() const {
+        return FrameView{pixels.data(),
+                         pixels.size(),
+                         width,
+                         height,
+                         channels,
+                         stride,
+                         bit_depth,
+                         packed,
+                         0,
+                         0,
+                         0.f,
+                         0,
+                         -1,
+                         nullptr};
+    }
+};
+
+bool render_frame(const std::string &pixel_format, const int &width, const int &height, BenchFrame &frame) {
+    SyntheticSource source;
+    source.connect_camera("Synthetic");
+
+    auto settings       = default_synthetic_settings();
+    settings.width      = width;
+    settings.height     = height;
+    settings.format     = pixel_format;
+    settings.frame_rate = 0;
+    if(!source.configure(settings)) {
+        return false;
+    }
+
+    settings.padding = (64 - source.stride % 64) % 64;
+    if(settings.padding != 0 && !source.configure(settings)) {
+        return false;
+    }
+
+    source.start_camera();
+
+    FrameView view;
+    while(!source.next_frame(view)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    frame.width     = view.width;
+    frame.height    = view.height;
+    frame.channels  = view.channels;
+    frame.stride    = view.stride;
+    frame.bit_depth = view.bit_depth;
+    frame.packed    = view.packed;
+    frame.pixels.assign(view.data, view.data + size_t(view.stride) * view.height);
+
+    source.release_frame(view);
+    source.stop_camera();
+
+    return true;
+}
+
+class Bench {
+  public:
+    explicit Bench(const BenchOptions &options) : options(options) {}
+
+    //! Times fn after one untimed run that warms caches, allocations and the thread pool. fn returns the bytes it
+    //! produced, or 0 when that isn't interesting.
+    void run(const std::string &kernel,
+             const std::string &variant,
+             const int &width,
+             const int &height,
+             const size_t &bytes,
+             const std::function<size_t()> &fn) {
+        BenchResult result{kernel, variant, width, height, bytes, 0, 0, 0.0, 0.0};
+        if(!options.filter.empty() && result.key().find(options.filter) == std::string::npos) {
+            return;
+        }
+
+        result.output_bytes = fn();
+
+        std::vector<double> times;
+        const auto begin = std::chrono::steady_clock::now();
+        while(int(times.size()) < options.iterations) {
+            const auto start = std::chrono::steady_clock::now();
+            fn();
+            const auto end = std::chrono::steady_clock::now();
+
+            times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            if(times.size() >= 3 && std::chrono::duration<double>(end - begin).count() > options.max_seconds) {
+                break;
+            }
+        }
+
+        std::sort(times.begin(), times.end());
+        result.iterations = int(times.size());
+        result.median_ms  = times[times.size() / 2];
+        result.min_ms     = times.front();
+
+        fprintf(stderr,
+                "%-40s %8.3f ms %7.3f ns/px %7.2f GB/s\n",
+                result.key().c_str(),
+                result.median_ms,
+                result.ns_per_pixel(),
+                result.gb_per_s());
+
+        results.push_back(result);
+    }
+
+    const std::vector<BenchResult> &get_results() const { return results; }
+
+  private:
+    BenchOptions options;
+    std::vector<BenchResult> results;
+};
+
+void bench_stack(Bench &bench, const std::string &name, const FrameView &view) {
+    const std::vector<std::pair<std::string, StackMode>> modes
+        = {{"mean", StackMode::Mean}, {"kappa_sigma", StackMode::KappaSigma}};
+
+    for(const auto &mode : modes) {
+        LiveStacker stacker;
+        stacker.start(StackSettings{mode.second, 2.5f, 3});
+
+        // Staging copy on the calling thread plus the accumulate on the stacker's worker
+        bench.run("stack", name + "_" + mode.first, view.width, view.height, view.size, [&]() {
+            const int64_t stacked = stacker.stats().stacked_frames;
+            stacker.process_frame(view);
+            while(stacker.stats().stacked_frames == stacked) {
+                std::this_thread::yield();
+            }
+            return size_t(0);
+        });
+
+        stacker.stop();
+    }
+}
+
+void bench_tiff(Bench &bench,
+                const BenchOptions &options,
+                const std::string &name,
+                const int &width,
+                const int &height,
+                const size_t &bytes,
+                const std::function<bool(const std::string &, const TiffSettings &)> &write) {
+    const std::string file = format("%s/bench_%s_%ix%i.tif", options.directory.c_str(), name.c_str(), width, height);
+
+    for(const auto predictor : {TiffPredictor::None, TiffPredictor::Horizontal}) {
+        for(const int level : {1, 3, 6, 9}) {
+            auto settings      = default_tiff_settings();
+            settings.predictor = predictor;
+            settings.level     = level;
+
+            const std::string variant
+                = format("%s_%s_l%i", name.c_str(), predictor == TiffPredictor::None ? "none" : "horizontal", level);
+            bench.run("write_tiff", variant, width, height, bytes, [&]() {
+                return write(file, settings) ? size_t(std::filesystem::file_size(file)) : size_t(0);
+            });
+        }
+    }
+
+    // Playback reads what capture writes by default
+    if(!write(file, default_tiff_settings())) {
+        return;
+    }
+
+    int read_width, read_height, channels, bit_depth;
+    std::string cfa_pattern;
+    std::vector<uint8_t> buffer;
+    bench.run("read_tiff", name, width, height, std::filesystem::file_size(file), [&]() {
+        read_tiff(file, read_width, read_height, channels, bit_depth, cfa_pattern, buffer);
+        return buffer.size();
+    });
+
+    std::filesystem::remove(file);
+}
+
+void bench_rgb(Bench &bench, const BenchOptions &options, const int &width, const int &height) {
+    BenchFrame frame;
+    if(!render_frame("XRGB8888", width, height, frame)) {
+        return;
+    }
+
+    const size_t frame_bytes = frame.pixels.size();
+    const size_t row_bytes   = size_t(width) * frame.channels;
+    std::vector<uint8_t> packed(row_bytes * height);
+
+    // Camera::get_image before and after: a byte loop per row, then copy_rows
+    bench.run("depad", "bytes_loop", width, height, frame_bytes, [&]() {
+        const uint8_t *src = frame.pixels.data();
+        uint8_t *dst       = packed.data();
+        for(int y = 0; y < height; y++) {
+            for(size_t i = 0; i < row_bytes; i++) {
+                dst[i] = src[i];
+            }
+            src += frame.stride;
+            dst += row_bytes;
+        }
+        return size_t(0);
+    });
+
+    bench.run("depad", "copy_rows", width, height, frame_bytes, [&]() {
+        copy_rows(packed.data(), row_bytes, frame.pixels.data(), frame.stride, row_bytes, height);
+        return size_t(0);
+    });
+
+    // The swap capture used to do on de-padded frames, against the fused conversion that replaced both
+    bench.run("color_swap", "swap_loop", width, height, packed.size(), [&]() {
+        for(int64_t y = 0; y < height; y++) {
+            for(int64_t x = 0; x < width; x++) {
+                const int64_t idx = (y * width + x) * frame.channels;
+                std::swap(packed[idx + 0], packed[idx + 2]);
+            }
+        }
+        return size_t(0);
+    });
+
+    const std::vector<std::pair<std::string, StoreFormat>> stores = {{"rgb8", StoreFormat::RGB8},
+                                                                     {"rgbx8", StoreFormat::RGBX8},
+                                                                     {"rgb16", StoreFormat::RGB16},
+                                                                     {"rgbx16", StoreFormat::RGBX16}};
+    std::vector<uint8_t> converted;
+    for(const auto &store : stores) {
+        const size_t dst_stride = size_t(width) * store_bytes(store.second);
+        converted.resize(dst_stride * height);
+
+        bench.run("convert", store.first, width, height, frame_bytes, [&]() {
+            convert_rows(converted.data(),
+                         dst_stride,
+                         frame.pixels.data(),
+                         frame.stride,
+                         width,
+                         height,
+                         PixelOrder::XRGB8888,
+                         store.second);
+            return size_t(0);
+        });
+    }
+
+    // Texture::stage_pixels de-padding into a mapped pixel buffer, here plain memory
+    std::vector<uint8_t> staging(row_bytes * height);
+    bench.run("upload", "rgb_stage", width, height, frame_bytes, [&]() {
+        copy_rows(staging.data(), row_bytes, frame.pixels.data(), frame.stride, row_bytes, height);
+        return size_t(0);
+    });
+
+    const FrameView view = frame.view();
+    FrameStats stats;
+    for(const int step : {1, 4}) {
+        bench.run("statistics", format("rgb_step%i", step), width, height, frame_bytes, [&]() {
+            compute_frame_stats(view, step, stats);
+            return size_t(0);
+        });
+    }
+
+    bench_stack(bench, "rgb", view);
+
+    // Captures store red first 8-bit RGB
+    std::vector<uint8_t> rgb(size_t(width) * height * 3);
+    convert_rows(rgb.data(),
+                 size_t(width) * 3,
+                 frame.pixels.data(),
+                 frame.stride,
+                 width,
+                 height,
+                 PixelOrder::XRGB8888,
+                 StoreFormat::RGB8);
+
+    bench_tiff(bench, options, "rgb", width, height, rgb.size(), [&](const std::string &file, const TiffSettings &s) {
+        return write_tiff(file, width, height, 3, rgb, s);
+    });
+}
+
+void bench_raw(Bench &bench, const BenchOptions &options, const int &width, const int &height) {
+    for(const std::string pixel_format : {"SRGGB10_CSI2P", "SRGGB12_CSI2P", "SRGGB12"}) {
+        BenchFrame frame;
+        if(!render_frame(pixel_format, width, height, frame)) {
+            continue;
+        }
+
+        const std::string variant = format("%i%s", frame.bit_depth, frame.packed ? "_csi2p" : "");
+        std::vector<uint16_t> samples(size_t(width) * height);
+
+        // Also the raw preview MainWindow makes before uploading
+        bench.run("unpack", variant, width, height, frame.pixels.size(), [&]() {
+            unpack_raw(samples.data(), frame.pixels.data(), width, height, frame.stride, frame.bit_depth, frame.packed);
+            return size_t(0);
+        });
+
+        if(frame.bit_depth != 12 || !frame.packed) {
+            continue;
+        }
+
+        // The remaining kernels see unpacked samples whatever the sensor format, one packed format covers them
+        const size_t row_bytes = size_t(width) * sizeof(uint16_t);
+        std::vector<uint8_t> staging(row_bytes * height);
+        bench.run("upload", "raw_stage", width, height, staging.size(), [&]() {
+            const auto *src = reinterpret_cast<const uint8_t *>(samples.data());
+            copy_rows(staging.data(), row_bytes, src, row_bytes, row_bytes, height);
+            return size_t(0);
+        });
+
+        const FrameView view = frame.view();
+        FrameStats stats;
+        bench.run("statistics", "raw_step1", width, height, frame.pixels.size(), [&]() {
+            compute_frame_stats(view, 1, stats);
+            return size_t(0);
+        });
+
+        bench_stack(bench, "raw", view);
+
+        auto write = [&](const std::string &file, const TiffSettings &s) {
+            return write_raw_tiff(file, width, height, samples.data(), frame.bit_depth, "RGGB", s);
+        };
+        bench_tiff(bench, options, "raw", width, height, row_bytes * height, write);
+    }
+}
+} // namespace
+
+//! Previous results by key, for spotting regressions.
+std::map<std::string, double> read_baseline(const std::string &filename) {
+    std::map<std::string, double> baseline;
+
+    std::ifstream file(filename);
+    std::string line;
+    while(std::getline(file, line)) {
+        char kernel[64], variant[64];
+        int width, height;
+        double ns_per_pixel;
+        if(sscanf(line.c_str(),
+                  "%63[^,],%63[^,],%d,%d,%*u,%*u,%*d,%*f,%*f,%lf",
+                  kernel,
+                  variant,
+                  &width,
+                  &height,
+                  &ns_per_pixel)
+           == 5) {
+            baseline[format("%s/%s/%ix%i", kernel, variant, width, height)] = ns_per_pixel;
+        }
+    }
+
+    return baseline;
+}
+
+void print_usage() {
+    fprintf(stderr,
+            "TeleZeroBench [--iterations N] [--seconds S] [--filter TEXT] [--dir PATH] [--baseline CSV] "
+            "[--threshold RATIO]\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    options.iterations  = 20;
+    options.max_seconds = 2.0;
+    options.directory   = std::filesystem::temp_directory_path().string();
+    options.threshold   = 1.10;
+
+    for(int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if(i + 1 >= argc) {
+            print_usage();
+            return 2;
+        }
+
+        if(arg == "--iterations") {
+            options.iterations = std::max(1, atoi(argv[++i]));
+        } else if(arg == "--seconds") {
+            options.max_seconds = atof(argv[++i]);
+        } else if(arg == "--filter") {
+            options.filter = argv[++i];
+        } else if(arg == "--dir") {
+            options.directory = argv[++i];
+        } else if(arg == "--baseline") {
+            options.baseline = argv[++i];
+        } else if(arg == "--threshold") {
+            options.threshold = atof(argv[++i]);
+        } else {
+            print_usage();
+            return 2;
+        }
+    }
+
+    // Results keep stdout to themselves, whatever the kernels print lands on stderr
+    FILE *output = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    fprintf(stderr, "%i threads in the shared pool\n", shared_thread_pool().size() + 1);
+
+    Bench bench(options);
+    for(const auto &size : sizes) {
+        bench_rgb(bench, options, size.first, size.second);
+        bench_raw(bench, options, size.first, size.second);
+    }
+
+    fprintf(output,
+            "kernel,variant,width,height,bytes,output_bytes,iterations,median_ms,min_ms,ns_per_pixel,gb_per_s\n");
+    for(const auto &r : bench.get_results()) {
+        fprintf(output,
+                "%s,%s,%i,%i,%zu,%zu,%i,%.4f,%.4f,%.4f,%.3f\n",
+                r.kernel.c_str(),
+                r.variant.c_str(),
+                r.width,
+                r.height,
+                r.bytes,
+                r.output_bytes,
+                r.iterations,
+                r.median_ms,
+                r.min_ms,
+                r.ns_per_pixel(),
+                r.gb_per_s());
+    }
+    fclose(output);
+
+    if(options.baseline.empty()) {
+        return 0;
+    }
+
+    const auto baseline = read_baseline(options.baseline);
+
+    int regressions = 0;
+    for(const auto &r : bench.get_results()) {
+        auto previous = baseline.find(r.key());
+        if(previous == baseline.end() || previous->second <= 0) {
+            continue;
+        }
+
+        const double ratio = r.ns_per_pixel() / previous->second;
+        if(ratio > options.threshold) {
+            fprintf(stderr,
+                    "Regression %s: %.3f ns/px, was %.3f (x%.2f)\n",
+                    r.key().c_str(),
+                    r.ns_per_pixel(),
+                    previous->second,
+                    ratio);
+            regressions++;
+        }
+    }
+
+    fprintf(stderr, "%i regressions against %s\n", regressions, options.baseline.c_str());
+    return regressions > 0 ? 1 : 0;
+}
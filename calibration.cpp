@@ -0,0 +1,515 @@
+#include "calibration.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+
+#include <tiffio.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+#include "tiff.h"
+#include "unpack.h"
+#include "util.h"
+
+// Rows of every frame held in memory at once while combining, keeps masters of long sessions within budget
+static const size_t combine_band_bytes = 64 << 20;
+
+static const char *master_names[3] = {"bias", "dark", "flat"};
+
+//! Reads session frames a scanline at a time as float samples.
+struct FrameReader {
+    TIFF *tif;
+
+    int width;
+    int height;
+    int channels;
+    int bits;
+
+    std::vector<uint8_t> scanline;
+
+    FrameReader() : tif(nullptr), width(0), height(0), channels(0), bits(0) {}
+    ~FrameReader() {
+        if(tif) {
+            TIFFClose(tif);
+        }
+    }
+
+    bool open(const std::string &filename) {
+        tif = TIFFOpen(filename.c_str(), "r");
+        if(!tif) {
+            printf("Unable to open tiff file for reading (%s)\n", filename.c_str());
+            return false;
+        }
+
+        uint32_t w = 0, h = 0;
+        uint16_t b = 0, samples = 1;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+        TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &b);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+
+        if(b != 8 && b != 16) {
+            printf("Unsupported bits per sample %i (%s)\n", b, filename.c_str());
+            return false;
+        }
+
+        width    = int(w);
+        height   = int(h);
+        channels = int(samples);
+        bits     = int(b);
+
+        scanline.resize(TIFFScanlineSize(tif));
+
+        return true;
+    }
+
+    bool read_row(const int &y, float *dst, const PixelOrder &order) {
+        if(TIFFReadScanline(tif, scanline.data(), uint32_t(y), 0) == -1) {
+            printf("Unable to read scanline for tiff\n");
+            return false;
+        }
+
+        const int samples = width * channels;
+        if(bits == 16) {
+            const uint16_t *src = reinterpret_cast<const uint16_t *>(scanline.data());
+            std::copy(src, src + samples, dst);
+        } else {
+            std::copy(scanline.data(), scanline.data() + samples, dst);
+        }
+
+        // Back from red first to the camera's byte order
+        const PixelTraits traits = pixel_traits(order);
+        if(bits == 8 && traits.bytes == channels) {
+            for(int i = 0; i < samples; i += channels) {
+                const float pixel[4] = {dst[i + 0], dst[i + 1], dst[i + 2], channels == 4 ? dst[i + 3] : 0.f};
+
+                dst[i + traits.red]   = pixel[0];
+                dst[i + traits.green] = pixel[1];
+                dst[i + traits.blue]  = pixel[2];
+                if(traits.alpha >= 0) {
+                    dst[i + traits.alpha] = pixel[3];
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+static float combine_median(float *values, const int &n) {
+    const int middle = n / 2;
+    std::nth_element(values, values + middle, values + n);
+
+    if(n % 2 == 1) {
+        return values[middle];
+    }
+
+    // nth_element leaves the lower half in front of the middle
+    return (values[middle] + *std::max_element(values, values + middle)) * 0.5f;
+}
+
+static float combine_sigma_clip(float *values, int n, const float &kappa, const int &iterations) {
+    float mean = 0.f;
+
+    for(int iteration = 0; iteration <= iterations; iteration++) {
+        double sum = 0, sum2 = 0;
+        for(int i = 0; i < n; i++) {
+            sum += values[i];
+            sum2 += double(values[i]) * values[i];
+        }
+
+        mean              = float(sum / n);
+        const float sigma = float(std::sqrt(std::max(sum2 / n - double(mean) * mean, 0.0)));
+        if(iteration == iterations || sigma == 0.f) {
+            break;
+        }
+
+        // Compact the survivors to the front
+        int kept = 0;
+        for(int i = 0; i < n; i++) {
+            if(std::fabs(values[i] - mean) <= kappa * sigma) {
+                values[kept++] = values[i];
+            }
+        }
+
+        if(kept == n || kept == 0) {
+            break;
+        }
+        n = kept;
+    }
+
+    return mean;
+}
+
+template <bool has_offset, bool has_gain>
+static void calibrate_row(float *x, const float *offset, const float *gain, const int &n, const float &maximum) {
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.f);
+    const float32x4_t top  = vdupq_n_f32(maximum);
+
+    for(; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(x + i);
+        if(has_offset) {
+            v = vsubq_f32(v, vld1q_f32(offset + i));
+        }
+        if(has_gain) {
+            v = vmulq_f32(v, vld1q_f32(gain + i));
+        }
+        vst1q_f32(x + i, vminq_f32(vmaxq_f32(v, zero), top));
+    }
+#endif
+
+    for(; i < n; i++) {
+        float v = x[i];
+        if(has_offset) {
+            v -= offset[i];
+        }
+        if(has_gain) {
+            v *= gain[i];
+        }
+        x[i] = std::min(std::max(v, 0.f), maximum);
+    }
+}
+
+std::vector<std::string> list_session_frames(const std::string &session_path) {
+    std::vector<std::string> frames;
+
+    std::error_code error;
+    for(auto &entry : std::filesystem::directory_iterator(session_path, error)) {
+        auto name = entry.path().filename().string();
+        if(entry.is_regular_file() && name.rfind("image_", 0) == 0 && entry.path().extension() == ".tif") {
+            frames.push_back(entry.path().string());
+        }
+    }
+
+    // image_NNNN names sort in capture order
+    std::sort(frames.begin(), frames.end());
+
+    return frames;
+}
+
+std::string master_filename(const std::string &session_path, const MasterType &type) {
+    return format("%s/master_%s.tif", session_path.c_str(), master_names[int(type)]);
+}
+
+Calibration::Calibration() : enabled(false) {}
+
+bool Calibration::build_master(const std::vector<std::string> &frames,
+                               const MasterType &type,
+                               const CombineSettings &settings,
+                               const std::string &output) {
+    const int count = int(frames.size());
+    if(count == 0) {
+        printf("No frames to build master %s\n", master_names[int(type)]);
+        return false;
+    }
+
+    std::vector<std::unique_ptr<FrameReader>> readers;
+    for(auto &frame : frames) {
+        readers.push_back(std::make_unique<FrameReader>());
+        if(!readers.back()->open(frame)) {
+            return false;
+        }
+
+        if(readers.back()->width != readers[0]->width || readers.back()->height != readers[0]->height
+           || readers.back()->channels != readers[0]->channels) {
+            printf("Frame size doesn't match the rest of the session (%s)\n", frame.c_str());
+            return false;
+        }
+    }
+
+    const int width       = readers[0]->width;
+    const int height      = readers[0]->height;
+    const int channels    = readers[0]->channels;
+    const int row_samples = width * channels;
+
+    // Flats are corrected for bias before combining
+    std::shared_ptr<Master> bias;
+    if(type == MasterType::Flat) {
+        std::lock_guard<std::mutex> lock(master_mutex);
+        bias = masters[int(MasterType::Bias)];
+        if(bias && (bias->width != width || bias->height != height || bias->channels != channels)) {
+            printf("Master bias doesn't match the flats, ignoring it\n");
+            bias.reset();
+        }
+    }
+
+    auto master      = std::make_shared<Master>();
+    master->width    = width;
+    master->height   = height;
+    master->channels = channels;
+    master->samples.resize(size_t(row_samples) * height);
+
+    const int band_rows = int(std::max<size_t>(1, combine_band_bytes / (size_t(count) * row_samples * sizeof(float))));
+    std::vector<float> band(size_t(count) * band_rows * row_samples);
+
+    bool ok = true;
+    for(int band_begin = 0; band_begin < height && ok; band_begin += band_rows) {
+        const int rows = std::min(band_rows, height - band_begin);
+
+        // Each frame decodes its own rows, frames are independent so they're read in parallel
+        std::vector<char> read_ok(count, 1);
+        shared_thread_pool().parallel_for(count, [&](const int64_t &begin, const int64_t &end) {
+            for(int64_t f = begin; f < end; f++) {
+                float *dst = band.data() + size_t(f) * band_rows * row_samples;
+                for(int y = 0; y < rows; y++) {
+                    if(!readers[f]->read_row(band_begin + y, dst + size_t(y) * row_samples, settings.pixel_order)) {
+                        read_ok[f] = 0;
+                        break;
+                    }
+                }
+            }
+        });
+
+        if(std::find(read_ok.begin(), read_ok.end(), 0) != read_ok.end()) {
+            ok = false;
+            break;
+        }
+
+        shared_thread_pool().parallel_for(rows, [&](const int64_t &begin, const int64_t &end) {
+            std::vector<float> values(count);
+
+            for(int64_t y = begin; y < end; y++) {
+                const size_t row_offset = size_t(band_begin + y) * row_samples;
+                float *dst              = master->samples.data() + row_offset;
+
+                for(int x = 0; x < row_samples; x++) {
+                    for(int f = 0; f < count; f++) {
+                        values[f] = band[(size_t(f) * band_rows + y) * row_samples + x];
+                    }
+
+                    if(bias) {
+                        for(int f = 0; f < count; f++) {
+                            values[f] -= bias->samples[row_offset + x];
+                        }
+                    }
+
+                    if(settings.method == CombineMethod::Median) {
+                        dst[x] = combine_median(values.data(), count);
+                    } else {
+                        dst[x] = combine_sigma_clip(values.data(), count, settings.kappa, settings.iterations);
+                    }
+                }
+            }
+        });
+    }
+
+    if(!ok) {
+        return false;
+    }
+
+    if(type == MasterType::Flat) {
+        // Normalize each channel, or each site of the 2x2 Bayer tile, so the flat doesn't shift the colour balance
+        const int sites = channels > 1 ? channels : 4;
+        std::vector<double> sums(sites, 0.0);
+        std::vector<int64_t> counts(sites, 0);
+
+        for(int y = 0; y < height; y++) {
+            const float *row = master->samples.data() + size_t(y) * row_samples;
+            for(int x = 0; x < row_samples; x++) {
+                const int site = channels > 1 ? x % channels : ((y & 1) << 1) | (x & 1);
+                sums[site] += row[x];
+                counts[site]++;
+            }
+        }
+
+        for(int y = 0; y < height; y++) {
+            float *row = master->samples.data() + size_t(y) * row_samples;
+            for(int x = 0; x < row_samples; x++) {
+                const int site   = channels > 1 ? x % channels : ((y & 1) << 1) | (x & 1);
+                const double avg = counts[site] > 0 ? sums[site] / counts[site] : 0.0;
+                row[x]           = avg > 0 ? float(row[x] / avg) : 1.f;
+            }
+        }
+    }
+
+    if(!write_float_tiff(output, width, height, channels, master->samples.data())) {
+        return false;
+    }
+
+    printf("Master %s built from %i frames (%s)\n", master_names[int(type)], count, output.c_str());
+
+    {
+        std::lock_guard<std::mutex> lock(master_mutex);
+        masters[int(type)] = master;
+        update_correction();
+    }
+
+    return true;
+}
+
+bool Calibration::load_master(const MasterType &type, const std::string &filename) {
+    auto master = std::make_shared<Master>();
+    if(!read_float_tiff(filename, master->width, master->height, master->channels, master->samples)) {
+        return false;
+    }
+
+    printf("Loaded master %s %ix%ix%i (%s)\n",
+           master_names[int(type)],
+           master->width,
+           master->height,
+           master->channels,
+           filename.c_str());
+
+    std::lock_guard<std::mutex> lock(master_mutex);
+    masters[int(type)] = master;
+    update_correction();
+
+    return true;
+}
+
+void Calibration::clear_masters() {
+    std::lock_guard<std::mutex> lock(master_mutex);
+    for(auto &master : masters) {
+        master.reset();
+    }
+    update_correction();
+}
+
+int Calibration::load_session_masters(const std::string &session_path) {
+    int loaded = 0;
+    for(auto type : {MasterType::Bias, MasterType::Dark, MasterType::Flat}) {
+        auto filename = master_filename(session_path, type);
+        if(std::filesystem::exists(filename) && load_master(type, filename)) {
+            loaded++;
+        }
+    }
+
+    return loaded;
+}
+
+void Calibration::set_enabled(const bool &enabled) {
+    std::lock_guard<std::mutex> lock(master_mutex);
+    this->enabled = enabled;
+}
+
+bool Calibration::is_enabled() {
+    std::lock_guard<std::mutex> lock(master_mutex);
+    return enabled;
+}
+
+bool Calibration::has_master(const MasterType &type) {
+    std::lock_guard<std::mutex> lock(master_mutex);
+    return masters[int(type)] != nullptr;
+}
+
+bool Calibration::apply(const FrameView &view, std::vector<uint8_t> &buffer, FrameView &calibrated) {
+    std::shared_ptr<const Correction> current;
+    {
+        std::lock_guard<std::mutex> lock(master_mutex);
+        if(!enabled) {
+            return false;
+        }
+        current = correction;
+    }
+
+    if(!current || current->width != view.width || current->height != view.height
+       || current->channels != view.channels) {
+        return false;
+    }
+
+    const bool raw          = view.bit_depth > 8;
+    const int row_samples   = view.width * view.channels;
+    const size_t out_stride = size_t(row_samples) * (raw ? sizeof(uint16_t) : 1);
+    const float maximum     = float((1 << view.bit_depth) - 1);
+
+    buffer.resize(out_stride * view.height);
+
+    const float *offset = current->offset.empty() ? nullptr : current->offset.data();
+    const float *gain   = current->gain.empty() ? nullptr : current->gain.data();
+
+    shared_thread_pool().parallel_for(
+        view.height,
+        [&](const int64_t &begin, const int64_t &end) {
+            std::vector<float> row(row_samples);
+            std::vector<uint16_t> unpacked(raw ? row_samples : 0);
+
+            for(int64_t y = begin; y < end; y++) {
+                const uint8_t *src = view.data + y * view.stride;
+                uint8_t *dst       = buffer.data() + y * out_stride;
+
+                if(raw) {
+                    unpack_raw_row(unpacked.data(), src, view.width, view.bit_depth, view.packed);
+                    std::copy(unpacked.begin(), unpacked.end(), row.begin());
+                } else {
+                    std::copy(src, src + row_samples, row.begin());
+                }
+
+                const size_t o = size_t(y) * row_samples;
+                if(offset && gain) {
+                    calibrate_row<true, true>(row.data(), offset + o, gain + o, row_samples, maximum);
+                } else if(offset) {
+                    calibrate_row<true, false>(row.data(), offset + o, nullptr, row_samples, maximum);
+                } else {
+                    calibrate_row<false, true>(row.data(), nullptr, gain + o, row_samples, maximum);
+                }
+
+                if(raw) {
+                    uint16_t *out = reinterpret_cast<uint16_t *>(dst);
+                    for(int x = 0; x < row_samples; x++) {
+                        out[x] = uint16_t(row[x] + 0.5f);
+                    }
+                } else {
+                    for(int x = 0; x < row_samples; x++) {
+                        dst[x] = uint8_t(row[x] + 0.5f);
+                    }
+                }
+            }
+        },
+        std::max(1, (128 << 10) / std::max(view.stride, 1)));
+
+    calibrated        = view;
+    calibrated.data   = buffer.data();
+    calibrated.size   = buffer.size();
+    calibrated.stride = int(out_stride);
+    calibrated.packed = false;
+
+    return true;
+}
+
+void Calibration::update_correction() {
+    auto &bias = masters[int(MasterType::Bias)];
+    auto &dark = masters[int(MasterType::Dark)];
+    auto &flat = masters[int(MasterType::Flat)];
+
+    // Darks are taken at the light exposure so they already hold the bias, bias alone is the fallback
+    auto subtract = dark ? dark : bias;
+
+    if(!subtract && !flat) {
+        correction.reset();
+        return;
+    }
+
+    auto reference = subtract ? subtract : flat;
+    if(subtract && flat
+       && (flat->width != subtract->width || flat->height != subtract->height
+           || flat->channels != subtract->channels)) {
+        printf("Master flat doesn't match the master %s, calibration disabled\n", dark ? "dark" : "bias");
+        correction.reset();
+        return;
+    }
+
+    auto next      = std::make_shared<Correction>();
+    next->width    = reference->width;
+    next->height   = reference->height;
+    next->channels = reference->channels;
+
+    if(subtract) {
+        next->offset = subtract->samples;
+    }
+
+    if(flat) {
+        next->gain.resize(flat->samples.size());
+        for(size_t i = 0; i < flat->samples.size(); i++) {
+            next->gain[i] = flat->samples[i] > 1e-3f ? 1.f / flat->samples[i] : 1.f;
+        }
+    }
+
+    correction = next;
+}
@@ -0,0 +1,86 @@
+#ifndef _calibration_h_
+#define _calibration_h_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+
+enum class MasterType { Bias = 0, Dark, Flat };
+
+enum class CombineMethod { Median = 0, SigmaClip };
+
+struct CombineSettings {
+    CombineMethod method;
+
+    //! Sigma clip rejects samples further than kappa standard deviations from the mean of what's left.
+    float kappa;
+    int iterations;
+
+    //! Camera order of the session, frames are stored red first and masters are kept in camera sample order.
+    PixelOrder pixel_order;
+};
+
+//! Frames of a capture session (image_NNNN.tif) in capture order.
+std::vector<std::string> list_session_frames(const std::string &session_path);
+
+//! Master file name for a type inside a session directory, e.g. master_dark.tif.
+std::string master_filename(const std::string &session_path, const MasterType &type);
+
+//! Dark subtraction and flat division applied to frames in camera format. Masters can be swapped while frames are
+//! being calibrated on the camera thread.
+class Calibration {
+  public:
+    Calibration();
+
+    //! Combines the frames into a float master and writes it to output. Flats have the loaded bias taken off each
+    //! frame and are normalized to a mean of 1 per channel (or per Bayer site for single channel frames).
+    bool build_master(const std::vector<std::string> &frames,
+                      const MasterType &type,
+                      const CombineSettings &settings,
+                      const std::string &output);
+
+    bool load_master(const MasterType &type, const std::string &filename);
+    void clear_masters();
+
+    //! Loads whichever of master_bias/dark/flat.tif exist in the directory.
+    int load_session_masters(const std::string &session_path);
+
+    void set_enabled(const bool &enabled);
+    bool is_enabled();
+
+    bool has_master(const MasterType &type);
+
+    //! Writes (frame - dark) / flat into buffer in the frame's format and points calibrated at it. Packed raw frames
+    //! come out unpacked. Returns false and leaves calibrated alone if disabled or no masters match the frame.
+    bool apply(const FrameView &view, std::vector<uint8_t> &buffer, FrameView &calibrated);
+
+  private:
+    struct Master {
+        int width;
+        int height;
+        int channels;
+        std::vector<float> samples;
+    };
+
+    //! Precomputed out = (x - offset) * gain for the loaded masters.
+    struct Correction {
+        int width;
+        int height;
+        int channels;
+        std::vector<float> offset;
+        std::vector<float> gain;
+    };
+
+    void update_correction();
+
+    std::mutex master_mutex;
+
+    bool enabled;
+    std::shared_ptr<Master> masters[3];
+    std::shared_ptr<const Correction> correction;
+};
+
+#endif
@@ -1,17 +1,23 @@
 #include "camera.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <math.h>
 #include <sys/ioctl.h>
 
 #include <linux/dma-buf.h>
 
+#include "convert.h"
+#include "latency.h"
+#include "trace.h"
 #include "tiff.h"
 
 static const std::map<int, std::string> cfa_map = {
     {libcamera::properties::draft::ColorFilterArrangementEnum::RGGB, "RGGB"},
     {libcamera::properties::draft::ColorFilterArrangementEnum::GRBG, "GRBG"},
     {libcamera::properties::draft::ColorFilterArrangementEnum::GBRG, "GBRG"},
+    {libcamera::properties::draft::ColorFilterArrangementEnum::BGGR, "BGGR"},
     {libcamera::properties::draft::ColorFilterArrangementEnum::RGB, "RGB"},
     {libcamera::properties::draft::ColorFilterArrangementEnum::MONO, "MONO"},
 };
@@ -37,9 +43,8 @@ static const std::map<libcamera::PixelFormat, unsigned int> bayer_formats = {
 };
 
 Camera::Camera() :
-    has_camera(false), camera_started(false), stream(nullptr), camera(nullptr), camera_manager(nullptr),
-    exposure_time(12000), analogue_gain(1), brightness(0.f), contrast(1.f), saturation(1.f), lens_position(0.f),
-    temperature(0.f), lines_per_row(0), padding(0) {
+    lines_per_row(0), padding(0), has_camera(false), camera_started(false), stream(nullptr), camera(nullptr),
+    camera_manager(nullptr), consumer_frames(0) {
     supported_formats.push_back(libcamera::formats::XRGB8888);
     // supported_formats.push_back(libcamera::formats::XBGR8888);
     supported_formats.push_back(libcamera::formats::RGBA8888);
@@ -131,6 +136,27 @@ bool Camera::connect_camera(const std::string &camera_name) {
         pixel_format_sizes[format].push_back(area / 8);
     }
 
+    // Raw sensor modes come from the Raw role, only the ones we know how to unpack are offered
+    auto raw_config = camera->generateConfiguration({libcamera::StreamRole::Raw});
+    if(raw_config) {
+        const auto &raw_formats = raw_config->at(0).formats();
+        for(const auto &format : raw_formats.pixelformats()) {
+            if(bayer_formats.find(format) == bayer_formats.end()) {
+                continue;
+            }
+
+            pixel_formats.push_back(format);
+            pixel_format_sizes[format] = raw_formats.sizes(format);
+        }
+    }
+
+    auto cfa = properties.get(libcamera::properties::draft::ColorFilterArrangement);
+    if(cfa && cfa_map.find(*cfa) != cfa_map.end()) {
+        cfa_pattern = cfa_map.at(*cfa);
+    }
+    sensor_cfa = cfa_pattern;
+    printf("Sensor CFA: %s\n", cfa_pattern.c_str());
+
     // Raspberry pi zero 2 w
     // 15 AwbEnable libcamera - [false..true]
     // 18 ColourGains libcamera - [0.000000..32.000000]
@@ -251,25 +277,42 @@ bool Camera::configure_camera(const int &format_index, const int &size_index) {
     /// base/soc/i2c0mux/i2c@1/imx477@1a - Selected sensor format: 2028x1520-SBGGR12_1X12 - Selected unicam format:
     // 2028x1520-pBCC
 
-    auto &stream_config = config->at(0);
-
     auto pixel_format      = pixel_formats[format_index];
     auto pixel_format_size = pixel_format_sizes[pixel_format][size_index];
 
+    // Bayer formats need the raw stream straight from the sensor, everything else goes through the ISP
+    auto bayer = bayer_formats.find(pixel_format);
+    raw_mode   = bayer != bayer_formats.end();
+    bit_depth  = raw_mode ? int(bayer->second) : 8;
+    packed     = raw_mode && bit_depth < 16;
+
+    config = camera->generateConfiguration(
+        {raw_mode ? libcamera::StreamRole::Raw : libcamera::StreamRole::StillCapture});
+
+    auto &stream_config = config->at(0);
+
     width    = pixel_format_size.width;
     height   = pixel_format_size.height;
-    channels = get_channels(pixel_format);
+    channels    = get_channels(pixel_format);
+    pixel_order = get_pixel_order(pixel_format);
     printf("Configured to use: %s  %i x %i [%i]\n", pixel_format.toString().c_str(), width, height, channels);
 
     config->at(0).size        = pixel_format_size;
     config->at(0).pixelFormat = pixel_format;
-    config->at(0).bufferCount = 1;
+    config->at(0).bufferCount = std::clamp(buffer_count, 2, 8);
 
     if(config->validate() == libcamera::CameraConfiguration::Invalid) {
         printf("Invalid camera configuration\n");
         return false;
     }
 
+    // validate may have moved us to the nearest size the pipeline supports
+    width  = config->at(0).size.width;
+    height = config->at(0).size.height;
+
+    // Worked out again on every configure, a mono format must not stick to the Bayer ones configured after it
+    cfa_pattern = get_cfa_pattern(config->at(0).pixelFormat);
+
     printf("frameSize: %i [%i] [%i] %i\n",
            config->at(0).frameSize,
            width * height * 3,
@@ -277,7 +320,7 @@ bool Camera::configure_camera(const int &format_index, const int &size_index) {
            config->at(0).stride);
 
     // computing the aligned dimensions:
-    int stride    = config->at(0).stride;
+    stride        = config->at(0).stride;
     lines_per_row = stride / width;
     padding       = stride - lines_per_row * width;
 
@@ -303,23 +346,19 @@ bool Camera::configure_camera(const int &format_index, const int &size_index) {
         printf("Allocated %lld buffers for stream\n", allocated);
     }
 
-    printf("createRequest\n");
-    auto request = camera->createRequest();
-    if(!request) {
-        printf("Can't create request\n");
-        return false;
-    }
-
-    printf("requests.push_back(std::move(request))\n");
-    requests.push_back(std::move(request));
-
     libcamera::Stream *stream = stream_config.stream();
 
     printf("allocator->buffers(stream)\n");
     const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers = allocator->buffers(stream);
 
+    // Buffers stay mapped until stop_camera, so completed requests don't need any mmap/munmap
+    if(!map_buffers(buffers)) {
+        return false;
+    }
+
     for(unsigned int i = 0; i < buffers.size(); i++) {
-        auto request = camera->createRequest();
+        // The cookie indexes request_controls
+        auto request = camera->createRequest(i);
         if(!request) {
             printf("Can't create request\n");
             return false;
@@ -335,6 +374,10 @@ bool Camera::configure_camera(const int &format_index, const int &size_index) {
         requests.push_back(std::move(request));
     }
 
+    // Every buffer can be sitting in the completed queue at once
+    completed_requests.reset(requests.size());
+    request_controls.assign(requests.size(), ControlRequest{0, ControlValues(), -1});
+
     return true;
 }
 
@@ -342,27 +385,36 @@ bool Camera::start_camera() {
     printf("camera->requestCompleted.connect()\n");
     camera->requestCompleted.connect(this, &Camera::request_complete);
 
+    // Everything starts out applied, requests only carry what changes after this
+    ControlValues values;
+    controls.take_changes(values);
+    controls.reset_lag();
+    consumer_frames = 0;
+    gain_waits.clear();
+    exposure_waits.clear();
+
     // Initial startup values
     // (https://github.com/libcamera-org/libcamera/blob/master/src/libcamera/control_ids_core.yaml)
+    libcamera::ControlList cam_controls;
     cam_controls.set(libcamera::controls::AeEnable, false);
     // cam_controls.set(libcamera::controls::AeExposureMode, 2);
-    //  cam_controls.set(libcamera::controls::AwbEnable, false);
+    cam_controls.set(libcamera::controls::AwbEnable, false);
     // cam_controls.set(libcamera::controls::AfMode, 0);
 
-    cam_controls.set(libcamera::controls::AnalogueGain, analogue_gain);
-    cam_controls.set(libcamera::controls::ExposureTime, exposure_time);
-    cam_controls.set(libcamera::controls::Brightness, brightness);
-    cam_controls.set(libcamera::controls::Contrast, contrast);
-    cam_controls.set(libcamera::controls::Saturation, saturation);
+    cam_controls.set(libcamera::controls::AnalogueGain, values.analogue_gain);
+    cam_controls.set(libcamera::controls::ExposureTime, values.exposure_time);
+    cam_controls.set(libcamera::controls::Brightness, values.brightness);
+    cam_controls.set(libcamera::controls::Contrast, values.contrast);
+    cam_controls.set(libcamera::controls::Saturation, values.saturation);
     // cam_controls.set(libcamera::controls::Sharpness, sharpness);
     // cam_controls.set(libcamera::controls::LensPosition, 0);
 
-    printf("Initial controls:   a:%0.2f  e:%microseconds b:%0.2f c:%0.2f s:%0.2f\n",
-           analogue_gain,
-           exposure_time,
-           brightness,
-           contrast,
-           saturation);
+    printf("Initial controls:   a:%0.2f  e:%i microseconds b:%0.2f c:%0.2f s:%0.2f\n",
+           values.analogue_gain,
+           values.exposure_time,
+           values.brightness,
+           values.contrast,
+           values.saturation);
 
     cam_controls.set(libcamera::controls::draft::NoiseReductionMode, libcamera::controls::draft::NoiseReductionModeOff);
 
@@ -375,6 +427,7 @@ bool Camera::start_camera() {
 
     printf("camera->queueRequest()\n");
     for(std::unique_ptr<libcamera::Request> &request : requests) {
+        attach_controls(request.get());
         camera->queueRequest(request.get());
     }
 
@@ -400,9 +453,9 @@ bool Camera::stop_camera() {
         }
         camera->requestCompleted.disconnect(this, &Camera::request_complete);
     }
-    while(!request_queue.empty()) {
+    libcamera::Request *request = nullptr;
+    while(completed_requests.pop(request)) {
         printf("emptying queue\n");
-        request_queue.pop();
     }
 
     for(auto &itr : mapped_buffers) {
@@ -413,7 +466,6 @@ bool Camera::stop_camera() {
     mapped_buffers.clear();
     requests.clear();
     allocator.reset();
-    cam_controls.clear();
 
     printf("Camera stopped\n");
 
@@ -423,32 +475,119 @@ bool Camera::stop_camera() {
 bool Camera::get_image(std::vector<uint8_t> &frame_buffer) {
     // printf("Camera::get_image()\n");
 
-    std::vector<uint8_t> aligned_buffer;
-    {
-        std::lock_guard<std::mutex> lock(free_requests_mutex);
-        aligned_buffer.resize(image_buffer.size());
-        memcpy(aligned_buffer.data(), image_buffer.data(), image_buffer.size());
+    FrameView view;
+    if(!acquire_frame(view)) {
+        return false;
     }
 
     frame_buffer.resize(width * height * channels);
 
-    int src_idx  = 0;
-    int dst_idx  = 0;
-    uint8_t *src = aligned_buffer.data();
-    uint8_t *dst = frame_buffer.data();
-    while(src_idx < aligned_buffer.size()) {
-        for(auto i = 0; i < lines_per_row * width; i++) {
-            dst[dst_idx + i] = src[src_idx + i];
-        }
-        dst_idx += lines_per_row * width;
-        src_idx += lines_per_row * width + padding;
+    copy_rows(frame_buffer.data(), width * channels, view.data, view.stride, width * channels, height);
+
+    release_frame(view);
+
+    return true;
+}
+
+bool Camera::acquire_frame(FrameView &view) {
+    libcamera::Request *request = nullptr;
+    if(!completed_requests.pop(request)) {
+        return false;
+    }
+
+    // Only the newest frame is wanted, everything older goes straight back to the camera
+    libcamera::Request *newer = nullptr;
+    while(completed_requests.pop(newer)) {
+        consumer_frames.fetch_sub(1, std::memory_order_acq_rel);
+        recycle_request(request);
+        request = newer;
+    }
+
+    if(!view_request(request, view)) {
+        consumer_frames.fetch_sub(1, std::memory_order_acq_rel);
+        return false;
+    }
+
+    return true;
+}
+
+bool Camera::next_frame(FrameView &view) {
+    libcamera::Request *request = nullptr;
+    if(!completed_requests.pop(request)) {
+        return false;
     }
 
-    // printf("idx: %i %i lpr:%i pad:%i\n", src_idx, dst_idx, lines_per_row, padding);
+    if(!view_request(request, view)) {
+        consumer_frames.fetch_sub(1, std::memory_order_acq_rel);
+        return false;
+    }
 
     return true;
 }
 
+void Camera::release_frame(FrameView &view) {
+    auto request = static_cast<libcamera::Request *>(view.handle);
+    if(request == nullptr) {
+        return;
+    }
+
+    sync_buffer(request->buffers().begin()->second, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    consumer_frames.fetch_sub(1, std::memory_order_acq_rel);
+    recycle_request(request);
+
+    view.data   = nullptr;
+    view.handle = nullptr;
+}
+
+bool Camera::view_request(libcamera::Request *request, FrameView &view) {
+    libcamera::FrameBuffer *buffer = request->buffers().begin()->second;
+    const auto &plane              = buffer->planes()[0];
+
+    auto itr = mapped_buffers.find(plane.fd.get());
+    if(itr == mapped_buffers.end()) {
+        printf("Buffer %i was never mapped\n", plane.fd.get());
+        recycle_request(request);
+        return false;
+    }
+
+    sync_buffer(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+    view.data      = static_cast<const uint8_t *>(itr->second.first) + plane.offset;
+    view.size      = plane.length;
+    view.width     = width;
+    view.height    = height;
+    view.channels  = channels;
+    view.stride    = stride;
+    view.bit_depth = bit_depth;
+    view.packed    = packed;
+    view.sequence  = request->sequence();
+    view.timestamp = 0;
+    view.handle    = request;
+
+    view.analogue_gain = 0.f;
+    view.exposure_time = 0;
+    view.control_step  = request_controls[request->cookie()].step;
+
+    const auto &metadata = request->metadata();
+    if(metadata.contains(libcamera::controls::SENSOR_TIMESTAMP)) {
+        view.timestamp = metadata.get(libcamera::controls::SENSOR_TIMESTAMP).get<int64_t>();
+    }
+    if(metadata.contains(libcamera::controls::ANALOGUE_GAIN)) {
+        view.analogue_gain = metadata.get(libcamera::controls::ANALOGUE_GAIN).get<float>();
+    }
+    if(metadata.contains(libcamera::controls::EXPOSURE_TIME)) {
+        view.exposure_time = metadata.get(libcamera::controls::EXPOSURE_TIME).get<int32_t>();
+    }
+
+    return true;
+}
+
+void Camera::recycle_request(libcamera::Request *request) {
+    request->reuse(libcamera::Request::ReuseBuffers);
+    queue_request(request);
+}
+
 std::vector<std::string> Camera::get_pixel_formats() const {
     std::vector<std::string> formats;
     for(const auto &format : pixel_formats) {
@@ -475,6 +614,10 @@ std::vector<std::string> Camera::get_pixel_format_sizes(const std::string &forma
 }
 
 int Camera::get_channels(const libcamera::PixelFormat &format) {
+    if(bayer_formats.find(format) != bayer_formats.end()) {
+        return 1;
+    }
+
     switch(format) {
         case libcamera::formats::XRGB8888:
         case libcamera::formats::XBGR8888:
@@ -492,96 +635,176 @@ int Camera::get_channels(const libcamera::PixelFormat &format) {
     return -1;
 }
 
+std::string Camera::get_cfa_pattern(const libcamera::PixelFormat &format) {
+    if(format == libcamera::formats::R10_CSI2P) {
+        return "MONO";
+    }
+
+    // Bayer formats carry their order in the name (SRGGB12_CSI2P), which already accounts for any sensor flip
+    const std::string name = format.toString();
+    if(bayer_formats.find(format) != bayer_formats.end() && name.size() > 5 && name[0] == 'S') {
+        return name.substr(1, 4);
+    }
+
+    return sensor_cfa;
+}
+
+PixelOrder Camera::get_pixel_order(const libcamera::PixelFormat &format) {
+    switch(format) {
+        case libcamera::formats::XBGR8888: {
+            return PixelOrder::XBGR8888;
+        } break;
+
+        case libcamera::formats::RGBA8888: {
+            return PixelOrder::RGBA8888;
+        } break;
+
+        case libcamera::formats::BGRA8888: {
+            return PixelOrder::BGRA8888;
+        } break;
+
+        case libcamera::formats::BGR888: {
+            return PixelOrder::BGR888;
+        } break;
+
+        case libcamera::formats::RGB888: {
+            return PixelOrder::RGB888;
+        }
+    }
+
+    return PixelOrder::XRGB8888;
+}
+
 int Camera::queue_request(libcamera::Request *request) {
+    TraceScope trace("queue_request", request->sequence());
+
     std::lock_guard<std::mutex> stop_lock(camera_stop_mutex);
-    {
-        std::lock_guard<std::mutex> lock(control_mutex);
-        request->controls() = std::move(cam_controls);
+    if(!camera_started) {
+        return -1;
     }
 
+    attach_controls(request);
+
     // printf("camera->queueRequest(request)\n");
     return camera->queueRequest(request);
 }
 
-void Camera::process_request(libcamera::Request *request) {
-    std::lock_guard<std::mutex> lock(free_requests_mutex);
+void Camera::attach_controls(libcamera::Request *request) {
+    // Only what changed since the last request goes out, the pipeline holds every other control where it was; a
+    // running schedule adds its step's controls to every request. Callers are serialized (start_camera, then the
+    // stop lock), so this is the mailbox's single taker and schedule steps follow queue order.
+    const ControlRequest carried = controls.next_request();
 
-    if(request->status() == libcamera::Request::Status::RequestCancelled) {
-        printf("status: Cancelled\n");
-        return;
+    libcamera::ControlList &request_list = request->controls();
+    if(carried.mask & control_bit(Control::AnalogueGain)) {
+        request_list.set(libcamera::controls::AnalogueGain, carried.values.analogue_gain);
     }
+    if(carried.mask & control_bit(Control::ExposureTime)) {
+        request_list.set(libcamera::controls::ExposureTime, carried.values.exposure_time);
+    }
+    if(carried.mask & control_bit(Control::Brightness)) {
+        request_list.set(libcamera::controls::Brightness, carried.values.brightness);
+    }
+    if(carried.mask & control_bit(Control::Contrast)) {
+        request_list.set(libcamera::controls::Contrast, carried.values.contrast);
+    }
+    if(carried.mask & control_bit(Control::Saturation)) {
+        request_list.set(libcamera::controls::Saturation, carried.values.saturation);
+    }
+
+    request_controls[request->cookie()] = carried;
+}
 
-    const libcamera::Request::BufferMap &buffers = request->buffers();
-    for(auto bufferPair : buffers) {
-        // (Unused) Stream *stream = bufferPair.first;
-        libcamera::FrameBuffer *buffer           = bufferPair.second;
-        const libcamera::FrameMetadata &metadata = buffer->metadata();
+bool Camera::map_buffers(const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers) {
+    // Planes of one buffer may share a dma-buf at different offsets, map each fd once over its full extent
+    std::map<int, unsigned int> extents;
+    for(const auto &buffer : buffers) {
+        for(const auto &plane : buffer->planes()) {
+            auto &extent = extents[plane.fd.get()];
+            extent       = std::max(extent, plane.offset + plane.length);
+        }
+    }
 
-        auto plane = buffer->planes()[0];
+    for(const auto &itr : extents) {
+        if(mapped_buffers.find(itr.first) != mapped_buffers.end()) {
+            continue;
+        }
 
-        // printf("nplane: %i\n", nplane);
-        auto *addr = mmap(nullptr, plane.length, PROT_READ, MAP_PRIVATE, plane.fd.get(), plane.offset);
+        auto *addr = mmap(nullptr, itr.second, PROT_READ, MAP_SHARED, itr.first, 0);
         if(addr == MAP_FAILED) {
-            printf("Unable to map plane %i size %i\n", plane.fd.get(), plane.length);
+            printf("Unable to map buffer %i size %i\n", itr.first, itr.second);
+            return false;
         }
 
-        image_buffer.resize(plane.length);
-        memcpy(image_buffer.data(), addr, plane.length);
-        if(munmap(addr, plane.length) != 0) {
-            printf("Unable to unmap plane\n");
+        mapped_buffers[itr.first] = std::make_pair(addr, itr.second);
+    }
+
+    printf("Mapped %zu buffers\n", mapped_buffers.size());
+
+    return true;
+}
+
+void Camera::sync_buffer(libcamera::FrameBuffer *buffer, const uint64_t &flags) {
+    // Brackets CPU access so the cache is coherent with what the ISP wrote
+    dma_buf_sync sync;
+    sync.flags = flags;
+
+    int last_fd = -1;
+    for(const auto &plane : buffer->planes()) {
+        int fd = plane.fd.get();
+        if(fd == last_fd) {
+            continue;
         }
+        last_fd = fd;
 
-        sequence = request->sequence();
-        // printf("sequence: %i\n", request->sequence());
-        auto &read_controls = request->metadata();
-        // for(auto itr = read_controls.begin(); itr != read_controls.end(); itr++) {
-        //	printf("control: %i, %s\n", itr->first, itr->second.toString().c_str());
-        // }
-        // if(read_controls.contains(8)) {
-        //	printf("Used controls:   a:%0.2f\n", read_controls.get(8).get<float>());
-        // }
-        // if(read_controls.contains(7)) {
-        //	printf("                 e:%i microseconds\n", read_controls.get(7).get<int>());
-        // }
-        // if(read_controls.contains(12)) {
-        //	printf("                 b:%0.2f\n", read_controls.get(12).get<float>());
-        // }
-        // if(read_controls.contains(13)) {
-        //	printf("                 c:%0.2f\n", read_controls.get(13).get<float>());
-        // }
-        // if(read_controls.contains(20)) {
-        //	printf("                 s:%0.2f\n", read_controls.get(20).get<float>());
-        // }
-
-        if(read_controls.contains(29)) {
-            // temperature = read_controls.get(32).get<float>();
-            temperature = read_controls.get(libcamera::controls::SENSOR_TEMPERATURE).get<float>();
+        if(ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+            printf("DMA_BUF_IOCTL_SYNC failed on %i\n", fd);
         }
     }
+}
 
-    request->reuse(libcamera::Request::ReuseBuffers);
+void Camera::process_request(libcamera::Request *request) {
+    if(request->status() == libcamera::Request::Status::RequestCancelled) {
+        printf("status: Cancelled\n");
+        return;
+    }
 
-    // Updating our request values, these are applied in queue_request
-    // libcamera::ControlList &controls = request->controls();
+    sequence = request->sequence();
+    // printf("sequence: %i\n", request->sequence());
+    auto &read_controls = request->metadata();
+    // for(auto itr = read_controls.begin(); itr != read_controls.end(); itr++) {
+    //	printf("control: %i, %s\n", itr->first, itr->second.toString().c_str());
+    // }
 
-    cam_controls.set(libcamera::controls::AeEnable, false);
-    // cam_controls.set(libcamera::controls::AeExposureMode, 2);
-    cam_controls.set(libcamera::controls::AwbEnable, false);
-    // cam_controls.set(libcamera::controls::AfMode, 0);
+    if(read_controls.contains(29)) {
+        // temperature = read_controls.get(32).get<float>();
+        temperature = read_controls.get(libcamera::controls::SENSOR_TEMPERATURE).get<float>();
+    }
 
-    cam_controls.set(libcamera::controls::AnalogueGain, analogue_gain);
-    cam_controls.set(libcamera::controls::ExposureTime, exposure_time);
-    cam_controls.set(libcamera::controls::Brightness, brightness);
-    cam_controls.set(libcamera::controls::Contrast, contrast);
-    cam_controls.set(libcamera::controls::Saturation, saturation);
-    // cam_controls.set(libcamera::controls::Sharpness, sharpness);
-    // cam_controls.set(libcamera::controls::LensPosition, lens_position);
+    if(frame_callback) {
+        // view_request hands the request back itself if the buffer can't be viewed
+        FrameView view;
+        if(!view_request(request, view)) {
+            return;
+        }
 
-    // printf("Updated controls:   a:%0.2f  e:%imicroseconds b:%0.2f c:%0.2f s:%0.2f\n", analogue_gain, exposure_time,
-    // brightness, contrast, saturation);
+        frame_callback(view);
+        sync_buffer(request->buffers().begin()->second, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
 
-    queue_request(request);
-    // camera->queueRequest(request);
+        // Capture and stacking copied what they keep, the sensor never waits on the view's timer for this buffer
+        if(consumer_frames.load(std::memory_order_acquire) >= 1) {
+            recycle_request(request);
+            return;
+        }
+    }
+
+    // Hand the frame to the consumer, if it has fallen so far behind that the queue is full the frame is dropped
+    consumer_frames.fetch_add(1, std::memory_order_acq_rel);
+    if(!completed_requests.push(request)) {
+        printf("Completed queue full, dropping frame %u\n", request->sequence());
+        consumer_frames.fetch_sub(1, std::memory_order_acq_rel);
+        recycle_request(request);
+    }
 
     // printf("Request completed %s\n", request->toString().c_str());
 }
@@ -591,6 +814,77 @@ void Camera::request_complete(libcamera::Request *request) {
         return;
     }
 
+    TraceScope trace("request_complete", request->sequence());
+
+    const auto &metadata = request->metadata();
+    if(metadata.contains(libcamera::controls::SENSOR_TIMESTAMP)) {
+        const int64_t timestamp = metadata.get(libcamera::controls::SENSOR_TIMESTAMP).get<int64_t>();
+        const int64_t age       = boottime_ns() - timestamp;
+        stage_latency(LatencyStage::SensorToComplete).record(age);
+
+        // Start of exposure to completion, moved over to the trace clock
+        const int64_t now = trace_now();
+        trace_frame("sensor", request->sequence(), now - age, now);
+    }
+
+    // Before process_request, which may requeue the request and overwrite what it carried
+    track_controls(request);
+
     // printf("Request completed %s\n", request->toString().c_str());
     process_request(request);
 }
+
+void Camera::track_controls(libcamera::Request *request) {
+    const int64_t sequence = request->sequence();
+
+    // Changes queue up in request order, a schedule can have several on their way at once. Only controls the
+    // pipeline reports back can be measured.
+    const ControlRequest &carried = request_controls[request->cookie()];
+    const auto &metadata          = request->metadata();
+
+    // Gain snaps to the sensor's gain steps and exposure to whole lines, so near the target counts as applied
+    if(metadata.contains(libcamera::controls::ANALOGUE_GAIN)) {
+        if(carried.mask & control_bit(Control::AnalogueGain)) {
+            gain_waits.push_back(ControlWait{carried.values.analogue_gain, sequence});
+        }
+
+        const float gain = metadata.get(libcamera::controls::ANALOGUE_GAIN).get<float>();
+        check_applied(Control::AnalogueGain, gain_waits, gain, 0.f, sequence);
+    }
+    if(metadata.contains(libcamera::controls::EXPOSURE_TIME)) {
+        if(carried.mask & control_bit(Control::ExposureTime)) {
+            exposure_waits.push_back(ControlWait{float(carried.values.exposure_time), sequence});
+        }
+
+        const float exposure = float(metadata.get(libcamera::controls::EXPOSURE_TIME).get<int32_t>());
+        check_applied(Control::ExposureTime, exposure_waits, exposure, 100.f, sequence);
+    }
+}
+
+void Camera::check_applied(const Control &control,
+                           std::deque<ControlWait> &waits,
+                           const float &value,
+                           const float &floor,
+                           const int64_t &sequence) {
+    // Pipelines apply controls a few frames late, anything past this never got there (usually out of range)
+    const int max_wait = 16;
+
+    // The oldest matching change is the one that landed, anything queued before it was overtaken
+    for(size_t i = 0; i < waits.size(); i++) {
+        if(std::fabs(value - waits[i].target) <= std::max(0.02f * waits[i].target, floor)) {
+            controls.record_lag(control, int(sequence - waits[i].sequence));
+            waits.erase(waits.begin(), waits.begin() + i + 1);
+            return;
+        }
+    }
+
+    while(!waits.empty() && sequence - waits.front().sequence > max_wait) {
+        printf("%s %0.2f not applied after %i frames (sensor reports %0.2f)\n",
+               control_name(control),
+               waits.front().target,
+               max_wait,
+               value);
+        controls.record_missed(control);
+        waits.pop_front();
+    }
+}
@@ -6,69 +6,94 @@
 #undef emit
 #undef foreach
 
+#include <atomic>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <sstream>
 #include <sys/mman.h>
 
 #include <libcamera/libcamera.h>
 #include <libcamera/formats.h>
 
-class Camera {
+#include "frame_source.h"
+#include "spsc_queue.h"
+
+//! The libcamera backed source, frames stay in the camera's mapped dma-bufs until they are released.
+class Camera : public FrameSource {
   public:
     Camera();
     ~Camera();
 
-    bool initialize();
-    bool uninitialize();
+    bool initialize() override;
+    bool uninitialize() override;
 
-    std::vector<std::string> get_cameras() const;
-    bool connect_camera(const std::string &camera_name);
-    bool disconnect_camera();
+    std::vector<std::string> get_cameras() const override;
+    bool connect_camera(const std::string &camera_name) override;
+    bool disconnect_camera() override;
 
-    bool configure_camera(const int &format_index, const int &size_index);
+    bool configure_camera(const int &format_index, const int &size_index) override;
 
-    bool start_camera();
-    bool stop_camera();
+    bool start_camera() override;
+    bool stop_camera() override;
 
-    bool is_connected() const { return has_camera; }
+    bool is_connected() const override { return has_camera; }
 
     bool get_image(std::vector<uint8_t> &frame_buffer);
 
-    std::vector<std::string> get_pixel_formats() const;
-    std::vector<std::string> get_pixel_format_sizes(const std::string &format);
+    bool acquire_frame(FrameView &view) override;
+    bool next_frame(FrameView &view) override;
+    void release_frame(FrameView &view) override;
+
+    size_t pending_frames() const override { return completed_requests.size(); }
 
-    int width;
-    int height;
-    int channels;
+    std::vector<std::string> get_pixel_formats() const override;
+    std::vector<std::string> get_pixel_format_sizes(const std::string &format) override;
 
     int lines_per_row;
     int padding;
 
-    int64_t sequence;
-
-    float analogue_gain;
-    int32_t exposure_time;
-
-    float brightness;
-    float contrast;
-    float saturation;
-    float lens_position;
-    float temperature;
-
   private:
     int get_channels(const libcamera::PixelFormat &format);
+    PixelOrder get_pixel_order(const libcamera::PixelFormat &format);
+    //! CFA of a configured format, the sensor's own for formats that went through the ISP.
+    std::string get_cfa_pattern(const libcamera::PixelFormat &format);
     int queue_request(libcamera::Request *request);
+    //! Puts the mailbox's changes and the schedule's next step on a request about to be queued.
+    void attach_controls(libcamera::Request *request);
     void process_request(libcamera::Request *request);
     void request_complete(libcamera::Request *request);
 
+    //! A gain or exposure change on its way to the sensor.
+    struct ControlWait {
+        float target;
+        //! Frame of the request that carried it.
+        int64_t sequence;
+    };
+
+    //! Measures how many frames each carried gain and exposure change takes to show up in the metadata.
+    void track_controls(libcamera::Request *request);
+    //! Matches value against the waiting changes, within 2% of the target or floor, whichever is larger.
+    void check_applied(const Control &control,
+                       std::deque<ControlWait> &waits,
+                       const float &value,
+                       const float &floor,
+                       const int64_t &sequence);
+
+    bool map_buffers(const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers);
+    void sync_buffer(libcamera::FrameBuffer *buffer, const uint64_t &flags);
+    bool view_request(libcamera::Request *request, FrameView &view);
+    void recycle_request(libcamera::Request *request);
+
     bool has_camera;
     bool camera_started;
 
     std::vector<libcamera::PixelFormat> pixel_formats;
     std::map<libcamera::PixelFormat, std::vector<libcamera::Size>> pixel_format_sizes;
+    //! As the sensor reports it at connect, cfa_pattern follows the configured format.
+    std::string sensor_cfa;
 
     libcamera::Stream *stream;
 
@@ -80,16 +105,22 @@ class Camera {
     std::vector<std::unique_ptr<libcamera::Request>> requests;
     std::map<int, std::pair<void *, unsigned int>> mapped_buffers;
 
-    std::queue<libcamera::Request *> request_queue;
+    SPSCQueue<libcamera::Request *> completed_requests;
+    //! Requests handed to the consumer and not yet released. With a frame callback the consumer only previews, so it
+    //! is lent one buffer at a time and the rest go straight back to the sensor.
+    std::atomic<int> consumer_frames;
 
     std::vector<libcamera::PixelFormat> supported_formats;
 
-    libcamera::ControlList cam_controls;
-    std::mutex control_mutex;
-    std::mutex camera_stop_mutex;
-    std::mutex free_requests_mutex;
+    //! What each queued request carried, indexed by request cookie. Written before the request is queued and read
+    //! when it completes, so the request itself orders the accesses.
+    std::vector<ControlRequest> request_controls;
 
-    std::vector<uint8_t> image_buffer;
+    // Camera thread only
+    std::deque<ControlWait> gain_waits;
+    std::deque<ControlWait> exposure_waits;
+
+    std::mutex camera_stop_mutex;
 
     libcamera::StreamConfiguration stream_config;
 };
@@ -0,0 +1,341 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+#include "convert.h"
+#include "latency.h"
+#include "trace.h"
+#include "tiff.h"
+#include "unpack.h"
+#include "util.h"
+
+CaptureSession::CaptureSession(WriterPool &writer) :
+    writer(writer), active(false), saved_frames(0), skipped_frames(0), rejected_frames(0), first_sequence(-1),
+    last_index(-1), ser_frames(0), first_timestamp(0), log_file(nullptr),
+    frames_file(nullptr) {}
+
+CaptureSession::~CaptureSession() { cancel(); }
+
+bool CaptureSession::begin(const CaptureSettings &settings) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if(active) {
+        finish("restarted");
+    }
+
+    auto log_name = format("%s/session.log", settings.session_path.c_str());
+    log_file      = fopen(log_name.c_str(), "a");
+    if(!log_file) {
+        printf("Unable to open session log (%s)\n", log_name.c_str());
+    }
+
+    // Exposure and gain as the sensor reported them, so bracketed frames can be sorted by what they really got
+    auto frames_name = format("%s/frames.csv", settings.session_path.c_str());
+    frames_file      = fopen(frames_name.c_str(), "w");
+    if(frames_file) {
+        fprintf(frames_file, "index,sequence,timestamp_ns,exposure_us,analogue_gain,control_step\n");
+    } else {
+        printf("Unable to open frame list (%s)\n", frames_name.c_str());
+    }
+
+    this->settings = settings;
+
+    first_sequence  = -1;
+    last_index      = -1;
+    ser_frames      = 0;
+    saved_frames    = 0;
+    skipped_frames  = 0;
+    rejected_frames = 0;
+
+    active = true;
+
+    log(format("capture begin: %s toss:%i images:%i format:%s",
+               settings.session_path.c_str(),
+               settings.toss_frames,
+               settings.total_images,
+               settings.format == CaptureFormat::Ser ? "ser" : "tiff"));
+
+    return true;
+}
+
+void CaptureSession::cancel() {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if(active) {
+        finish("cancelled");
+    }
+}
+
+void CaptureSession::process_frame(const FrameView &view) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if(!active) {
+        return;
+    }
+
+    if(first_sequence < 0) {
+        first_sequence  = view.sequence;
+        first_timestamp = view.timestamp;
+        first_time      = std::chrono::system_clock::now();
+    }
+
+    const int64_t index = view.sequence - first_sequence;
+    const int64_t end   = settings.toss_frames + settings.total_images;
+
+    // Anything the camera skipped between the last frame and this one, limited to the frames we meant to keep
+    const int64_t missing_begin = std::max<int64_t>(last_index + 1, settings.toss_frames);
+    const int64_t missing_end   = std::min<int64_t>(index, end);
+    if(missing_end > missing_begin) {
+        skipped_frames += missing_end - missing_begin;
+        log(format("skipped sequence %lld-%lld",
+                   (long long)(first_sequence + missing_begin),
+                   (long long)(first_sequence + missing_end - 1)));
+    }
+    last_index = std::max(last_index, index);
+
+    if(index >= settings.toss_frames && index < end) {
+        if(settings.format == CaptureFormat::Ser) {
+            // Video frames are numbered as they are accepted, a skipped or rejected frame leaves no gap in the file
+            if(submit_ser(view, ser_frames)) {
+                record_frame(view, ser_frames);
+                ser_frames++;
+            }
+        } else if(submit_tiff(view, index)) {
+            record_frame(view, index);
+        }
+    }
+
+    if(active && index >= end - 1) {
+        finish("complete");
+    }
+}
+
+namespace {
+//! The frame as the camera left it, padding included, so the buffer can go straight back to the camera.
+void copy_frame(const FrameView &view, std::vector<uint8_t> &buffer) {
+    buffer.resize(std::min(view.size, size_t(view.stride) * view.height));
+    memcpy(buffer.data(), view.data, buffer.size());
+}
+
+//! Per writer thread scratch for the converted frame.
+std::vector<uint8_t> &convert_buffer(const size_t &size) {
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(size);
+    return buffer;
+}
+} // namespace
+
+bool CaptureSession::submit_tiff(const FrameView &view, const int64_t &index) {
+    WriteJob job;
+    job.sequence = view.sequence;
+
+    auto file = format("%s/image_%0.4i.tif", settings.session_path.c_str(), int(index));
+
+    // Only the copy happens on the camera thread, unpacking and reordering run on the writer
+    copy_frame(view, job.buffer);
+
+    if(view.bit_depth > 8) {
+        job.write = [file,
+                     sequence  = view.sequence,
+                     width     = view.width,
+                     height    = view.height,
+                     stride    = view.stride,
+                     bit_depth = view.bit_depth,
+                     packed    = view.packed,
+                     cfa       = settings.cfa_pattern,
+                     tiff      = settings.tiff](const std::vector<uint8_t> &buffer) {
+            auto &samples = convert_buffer(size_t(width) * height * sizeof(uint16_t));
+            {
+                TraceScope trace("capture_convert", sequence);
+                ScopedLatency latency(LatencyStage::CaptureConvert);
+                unpack_raw(reinterpret_cast<uint16_t *>(samples.data()),
+                           buffer.data(),
+                           width,
+                           height,
+                           stride,
+                           bit_depth,
+                           packed);
+            }
+
+            return write_raw_tiff(
+                file, width, height, reinterpret_cast<const uint16_t *>(samples.data()), bit_depth, cfa, tiff);
+        };
+    } else {
+        job.write = [file,
+                     sequence    = view.sequence,
+                     width       = view.width,
+                     height      = view.height,
+                     stride      = view.stride,
+                     channels    = view.channels,
+                     pixel_order = settings.pixel_order,
+                     tiff        = settings.tiff](const std::vector<uint8_t> &buffer) {
+            const int row_bytes = width * channels;
+
+            // Reordered while dropping the padding, the frame is only walked once
+            auto &pixels = convert_buffer(size_t(row_bytes) * height);
+            {
+                TraceScope trace("capture_convert", sequence);
+                ScopedLatency latency(LatencyStage::CaptureConvert);
+                convert_rows(pixels.data(),
+                             row_bytes,
+                             buffer.data(),
+                             stride,
+                             width,
+                             height,
+                             pixel_order,
+                             channels == 4 ? StoreFormat::RGBX8 : StoreFormat::RGB8);
+            }
+
+            return write_tiff(file, width, height, channels, pixels, tiff);
+        };
+    }
+
+    return submit(std::move(job));
+}
+
+bool CaptureSession::submit_ser(const FrameView &view, const int64_t &slot) {
+    const bool raw = view.bit_depth > 8;
+
+    // Opened on the first kept frame, the frame size isn't known before then
+    if(!ser) {
+        auto file = format("%s/capture.ser", settings.session_path.c_str());
+
+        ser = std::make_shared<SerWriter>();
+        if(!ser->open(file,
+                      view.width,
+                      view.height,
+                      raw ? ser_color(settings.cfa_pattern) : SerColor::RGB,
+                      raw ? view.bit_depth : 8,
+                      settings.total_images)) {
+            finish("failed");
+            return false;
+        }
+
+        log(format("ser: %s %ix%i %i-bit", file.c_str(), view.width, view.height, raw ? view.bit_depth : 8));
+    }
+
+    WriteJob job;
+    job.sequence = view.sequence;
+
+    copy_frame(view, job.buffer);
+
+    // Sensor time keeps the spacing between frames exact, the wall clock only anchors the first one
+    int64_t timestamp = ser_ticks(std::chrono::system_clock::now());
+    if(view.timestamp != 0 && first_timestamp != 0) {
+        timestamp = ser_ticks(first_time) + (view.timestamp - first_timestamp) / 100;
+    }
+
+    // The slot follows arrival on the camera thread, not the order writers finish in, so frames.csv matches the file
+    job.write = [ser         = ser,
+                 slot,
+                 timestamp,
+                 raw,
+                 sequence    = view.sequence,
+                 width       = view.width,
+                 height      = view.height,
+                 stride      = view.stride,
+                 bit_depth   = view.bit_depth,
+                 packed      = view.packed,
+                 pixel_order = settings.pixel_order](const std::vector<uint8_t> &buffer) {
+        auto &frame = convert_buffer(ser->frame_bytes());
+        {
+            TraceScope trace("capture_convert", sequence);
+            ScopedLatency latency(LatencyStage::CaptureConvert);
+            if(raw) {
+                unpack_raw(reinterpret_cast<uint16_t *>(frame.data()),
+                           buffer.data(),
+                           width,
+                           height,
+                           stride,
+                           bit_depth,
+                           packed);
+            } else {
+                convert_rows(
+                    frame.data(), width * 3, buffer.data(), stride, width, height, pixel_order, StoreFormat::RGB8);
+            }
+        }
+
+        return ser->write_frame(frame.data(), slot, timestamp);
+    };
+
+    return submit(std::move(job));
+}
+
+bool CaptureSession::submit(WriteJob job) {
+    const int64_t sequence = job.sequence;
+
+    // Never waits, this runs on the camera thread and a full queue rejects the frame whatever the policy
+    TraceScope trace("capture_submit", sequence);
+    if(writer.submit(std::move(job), false)) {
+        saved_frames++;
+        return true;
+    }
+
+    rejected_frames++;
+    log(format("writer rejected sequence %lld", (long long)sequence));
+    return false;
+}
+
+void CaptureSession::record_frame(const FrameView &view, const int64_t &index) {
+    if(!frames_file) {
+        return;
+    }
+
+    fprintf(frames_file,
+            "%lld,%lld,%lld,%i,%0.3f,%i\n",
+            (long long)index,
+            (long long)view.sequence,
+            (long long)view.timestamp,
+            view.exposure_time,
+            view.analogue_gain,
+            view.control_step);
+}
+
+bool CaptureSession::is_active() { return active; }
+
+CaptureStats CaptureSession::stats() {
+    CaptureStats s;
+    s.active          = active;
+    s.total_images    = settings.total_images;
+    s.saved_frames    = saved_frames;
+    s.skipped_frames  = skipped_frames;
+    s.rejected_frames = rejected_frames;
+
+    return s;
+}
+
+void CaptureSession::finish(const char *reason) {
+    printf("capture %s\n", reason);
+
+    log(format("capture %s: saved:%lld skipped:%lld rejected:%lld",
+               reason,
+               (long long)saved_frames.load(),
+               (long long)skipped_frames.load(),
+               (long long)rejected_frames.load()));
+
+    // Jobs still queued hold their own reference, the video is completed after the last one is written
+    ser.reset();
+
+    if(log_file) {
+        fclose(log_file);
+        log_file = nullptr;
+    }
+
+    if(frames_file) {
+        fclose(frames_file);
+        frames_file = nullptr;
+    }
+
+    active = false;
+}
+
+void CaptureSession::log(const std::string &message) {
+    if(!log_file) {
+        return;
+    }
+
+    const std::time_t now = std::time(nullptr);
+    auto tm               = std::localtime(&now);
+
+    fprintf(log_file, "%02i:%02i:%02i %s\n", tm->tm_hour, tm->tm_min, tm->tm_sec, message.c_str());
+    fflush(log_file);
+}
@@ -0,0 +1,100 @@
+#ifndef _capture_h_
+#define _capture_h_
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "frame_source.h"
+#include "ser.h"
+#include "tiff.h"
+#include "writer_pool.h"
+
+//! Tiff writes one file per frame, Ser appends every frame of the session to one uncompressed video.
+enum class CaptureFormat { Tiff = 0, Ser };
+
+struct CaptureSettings {
+    std::string session_path;
+    CaptureFormat format;
+
+    int toss_frames;
+    int total_images;
+
+    //! 8-bit frames are stored red first whatever the camera order, 4 byte pixels keep their fourth byte.
+    PixelOrder pixel_order;
+    //! Written alongside raw frames.
+    std::string cfa_pattern;
+
+    TiffSettings tiff;
+};
+
+struct CaptureStats {
+    bool active;
+
+    int total_images;
+    int64_t saved_frames;
+    //! Sequence numbers inside the capture window that never arrived from the camera.
+    int64_t skipped_frames;
+    //! Frames the writer pool refused to queue.
+    int64_t rejected_frames;
+};
+
+//! Persists frames [toss_frames, toss_frames + total_images) of a session, counted by sequence number from the first
+//! frame seen after begin.
+class CaptureSession {
+  public:
+    explicit CaptureSession(WriterPool &writer);
+    ~CaptureSession();
+
+    bool begin(const CaptureSettings &settings);
+    void cancel();
+
+    //! Called from the camera thread for every completed frame.
+    void process_frame(const FrameView &view);
+
+    bool is_active();
+    CaptureStats stats();
+
+  private:
+    bool submit_tiff(const FrameView &view, const int64_t &index);
+    bool submit_ser(const FrameView &view, const int64_t &slot);
+    //! Returns false if the writer refused the frame.
+    bool submit(WriteJob job);
+    //! One frames.csv row per stored frame with the controls it was taken with, index is the TIFF's number or the
+    //! frame within capture.ser.
+    void record_frame(const FrameView &view, const int64_t &index);
+
+    void finish(const char *reason);
+    void log(const std::string &message);
+
+    WriterPool &writer;
+
+    std::mutex session_mutex;
+
+    // Read by the GUI without the session lock, the camera thread may be sitting in a blocked writer
+    std::atomic<bool> active;
+    std::atomic<int64_t> saved_frames;
+    std::atomic<int64_t> skipped_frames;
+    std::atomic<int64_t> rejected_frames;
+
+    CaptureSettings settings;
+
+    int64_t first_sequence;
+    int64_t last_index;
+    //! Frames the writer accepted into the video, the next one's slot.
+    int64_t ser_frames;
+
+    //! Shared with the queued write jobs, the video is closed once the last of them has run.
+    std::shared_ptr<SerWriter> ser;
+    //! Sensor and wall clock time of the first frame, frame times are offsets from these.
+    int64_t first_timestamp;
+    std::chrono::system_clock::time_point first_time;
+
+    FILE *log_file;
+    FILE *frames_file;
+};
+
+#endif
@@ -0,0 +1,359 @@
+// telezero-cli captures a session without the GUI: connect, configure, capture N frames to a directory and exit.
+// Built only on the core library, so it starts without Qt or a display and is what runs on an unattended Pi.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "frame_source.h"
+#include "latency.h"
+#include "trace.h"
+#include "util.h"
+#include "writer_pool.h"
+
+namespace {
+struct CliOptions {
+    std::string source;
+    std::string camera;
+    std::string pixel_format;
+    std::string size;
+
+    std::string session_path;
+    CaptureFormat format;
+    int frames;
+    int toss_frames;
+
+    float gain;
+    //! Milliseconds, like the GUI.
+    float exposure_ms;
+    int buffers;
+
+    //! Per-frame exposure or gain steps repeated for the whole capture, empty for none.
+    ControlSchedule schedule;
+
+    int writer_threads;
+    int queue_mb;
+    TiffSettings tiff;
+
+    std::string trace;
+    //! Seconds without a frame before giving up.
+    double frame_timeout;
+};
+
+std::atomic<bool> interrupted(false);
+
+void print_usage() {
+    printf("telezero-cli --path DIR [options]\n"
+           "  --path DIR             session directory, created if missing\n"
+           "  --frames N             frames to keep (10)\n"
+           "  --toss N               frames to skip first (0)\n"
+           "  --capture-format F     tiff or ser (tiff)\n"
+           "  --source S             camera, synthetic or replay:<path> (camera)\n"
+           "  --camera NAME          camera to connect, the first one otherwise\n"
+           "  --format NAME          pixel format, e.g. XRGB8888 or SRGGB12_CSI2P (the first advertised)\n"
+           "  --size WxH             frame size (the first advertised)\n"
+           "  --gain G               analogue gain (1.0)\n"
+           "  --exposure MS          exposure time in milliseconds (12)\n"
+           "  --bracket-exposure L   exposures in milliseconds stepped through frame by frame, e.g. 1,8,64\n"
+           "  --bracket-gain L       analogue gains stepped through frame by frame, e.g. 1,2,4,8\n"
+           "  --buffers N            camera buffers, 2-8 (3)\n"
+           "  --writers N            writer threads (2)\n"
+           "  --queue-mb N           writer queue limit in MB, frames arriving at a full queue are rejected (256)\n"
+           "  --tiff-level N         deflate level 1-9 (3)\n"
+           "  --no-predictor         store TIFF samples without horizontal differencing\n"
+           "  --timeout S            seconds without a frame before giving up (10)\n"
+           "  --trace FILE           write a Chrome trace of the session\n");
+}
+
+bool parse_options(int argc, char *argv[], CliOptions &options) {
+    options.source         = "camera";
+    options.format         = CaptureFormat::Tiff;
+    options.frames         = 10;
+    options.toss_frames    = 0;
+    options.gain           = 1.f;
+    options.exposure_ms    = 12.f;
+    options.buffers        = 3;
+    options.writer_threads = 2;
+    options.queue_mb       = 256;
+    options.tiff           = default_tiff_settings();
+    options.frame_timeout  = 10.0;
+    options.schedule       = ControlSchedule{{}, true};
+
+    for(int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if(arg == "--help" || arg == "-h") {
+            return false;
+        }
+
+        if(arg == "--no-predictor") {
+            options.tiff.predictor = TiffPredictor::None;
+            continue;
+        }
+
+        if(i + 1 >= argc) {
+            printf("Missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        const std::string value = argv[++i];
+        if(arg == "--path") {
+            options.session_path = value;
+        } else if(arg == "--frames") {
+            options.frames = atoi(value.c_str());
+        } else if(arg == "--toss") {
+            options.toss_frames = atoi(value.c_str());
+        } else if(arg == "--capture-format") {
+            if(value != "tiff" && value != "ser") {
+                printf("Unknown capture format %s\n", value.c_str());
+                return false;
+            }
+            options.format = value == "ser" ? CaptureFormat::Ser : CaptureFormat::Tiff;
+        } else if(arg == "--source") {
+            options.source = value;
+        } else if(arg == "--camera") {
+            options.camera = value;
+        } else if(arg == "--format") {
+            options.pixel_format = value;
+        } else if(arg == "--size") {
+            options.size = value;
+        } else if(arg == "--gain") {
+            options.gain = float(atof(value.c_str()));
+        } else if(arg == "--exposure") {
+            options.exposure_ms = float(atof(value.c_str()));
+        } else if(arg == "--bracket-exposure" || arg == "--bracket-gain") {
+            const Control control = arg == "--bracket-gain" ? Control::AnalogueGain : Control::ExposureTime;
+            if(!options.schedule.steps.empty() || !parse_control_schedule(control, value, options.schedule)) {
+                printf("Bad %s list %s, one bracket per capture\n", arg.c_str(), value.c_str());
+                return false;
+            }
+        } else if(arg == "--buffers") {
+            options.buffers = atoi(value.c_str());
+        } else if(arg == "--writers") {
+            options.writer_threads = atoi(value.c_str());
+        } else if(arg == "--queue-mb") {
+            options.queue_mb = atoi(value.c_str());
+        } else if(arg == "--tiff-level") {
+            options.tiff.level = atoi(value.c_str());
+        } else if(arg == "--timeout") {
+            options.frame_timeout = atof(value.c_str());
+        } else if(arg == "--trace") {
+            options.trace = value;
+        } else {
+            printf("Unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if(options.session_path.empty() || options.frames <= 0) {
+        printf("A session path and a positive frame count are required\n");
+        return false;
+    }
+
+    return true;
+}
+
+//! Index of value in list, the first entry when value is empty, -1 if it isn't there.
+int find_index(const std::vector<std::string> &list, const std::string &value, const char *what) {
+    if(list.empty()) {
+        printf("No %s available\n", what);
+        return -1;
+    }
+
+    if(value.empty()) {
+        return 0;
+    }
+
+    for(size_t i = 0; i < list.size(); i++) {
+        if(list[i] == value) {
+            return int(i);
+        }
+    }
+
+    printf("No %s %s, available:", what, value.c_str());
+    for(const auto &item : list) {
+        printf(" %s", item.c_str());
+    }
+    printf("\n");
+
+    return -1;
+}
+
+bool setup_source(FrameSource &source, const CliOptions &options) {
+    if(!source.initialize()) {
+        return false;
+    }
+
+    auto cameras = source.get_cameras();
+    const int camera_index = find_index(cameras, options.camera, "camera");
+    if(camera_index < 0 || !source.connect_camera(cameras[camera_index])) {
+        return false;
+    }
+
+    auto formats = source.get_pixel_formats();
+    const int format_index = find_index(formats, options.pixel_format, "pixel format");
+    if(format_index < 0) {
+        return false;
+    }
+
+    auto sizes = source.get_pixel_format_sizes(formats[format_index]);
+    const int size_index = find_index(sizes, options.size, "size");
+    if(size_index < 0) {
+        return false;
+    }
+
+    source.buffer_count = options.buffers;
+    source.controls.set_analogue_gain(options.gain);
+    source.controls.set_exposure_time(int32_t(options.exposure_ms * 1000));
+    if(!options.schedule.steps.empty()) {
+        source.controls.set_schedule(options.schedule);
+        printf("Bracketing %zu steps per cycle\n", options.schedule.steps.size());
+    }
+
+    if(!source.configure_camera(format_index, size_index)) {
+        printf("Unable to configure %s %s\n", formats[format_index].c_str(), sizes[size_index].c_str());
+        return false;
+    }
+
+    printf("%s: %s %s, gain %0.2f, exposure %0.2f ms\n",
+           cameras[camera_index].c_str(),
+           formats[format_index].c_str(),
+           sizes[size_index].c_str(),
+           options.gain,
+           options.exposure_ms);
+
+    return true;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    CliOptions options;
+    if(!parse_options(argc, argv, options)) {
+        print_usage();
+        return 2;
+    }
+
+    // Ctrl-C and SIGTERM end the capture early, frames already taken are still written
+    std::signal(SIGINT, [](int) { interrupted = true; });
+    std::signal(SIGTERM, [](int) { interrupted = true; });
+
+    if(!options.trace.empty()) {
+        start_tracing();
+    }
+
+    auto source = create_frame_source(options.source);
+    if(!source || !setup_source(*source, options)) {
+        return 1;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(options.session_path, error);
+    if(error) {
+        printf("Unable to create %s (%s)\n", options.session_path.c_str(), error.message().c_str());
+        return 1;
+    }
+
+    WriterPool writer_pool;
+    writer_pool.start(options.writer_threads, size_t(options.queue_mb) << 20, QueueFullPolicy::DropNewest);
+
+    CaptureSession capture_session(writer_pool);
+
+    CaptureSettings settings;
+    settings.session_path = options.session_path;
+    settings.format       = options.format;
+    settings.toss_frames  = options.toss_frames;
+    settings.total_images = options.frames;
+    settings.pixel_order  = source->pixel_order;
+    settings.cfa_pattern  = source->cfa_pattern;
+    settings.tiff         = options.tiff;
+
+    reset_stage_latency();
+    capture_session.begin(settings);
+
+    source->set_frame_callback([&](const FrameView &view) {
+        ScopedLatency latency(LatencyStage::FrameCallback);
+        TraceScope trace("frame_callback", view.sequence);
+
+        capture_session.process_frame(view);
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    source->start_camera();
+
+    // Frames are written from the callback, the queue only needs draining so the buffers go back to the source
+    auto last_frame    = std::chrono::steady_clock::now();
+    auto last_report   = last_frame;
+    int64_t last_saved = -1;
+    while(capture_session.is_active()) {
+        FrameView view;
+        while(source->next_frame(view)) {
+            source->release_frame(view);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        auto stats     = capture_session.stats();
+        if(stats.saved_frames != last_saved) {
+            last_saved = stats.saved_frames;
+            last_frame = now;
+        }
+
+        if(now - last_report >= std::chrono::seconds(1)) {
+            printf("%lld/%i frames\n", (long long)stats.saved_frames, stats.total_images);
+            last_report = now;
+        }
+
+        if(interrupted) {
+            capture_session.cancel();
+        } else if(std::chrono::duration<double>(now - last_frame).count() > options.frame_timeout) {
+            printf("No frames for %0.0f seconds\n", options.frame_timeout);
+            capture_session.cancel();
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    source->stop_camera();
+    source->set_frame_callback(nullptr);
+
+    // Everything queued is written before the numbers are final
+    writer_pool.stop();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto capture         = capture_session.stats();
+    auto writer          = writer_pool.stats();
+
+    printf("%lld frames saved in %0.1f s, %lld skipped, %lld rejected, %lld failed\n",
+           (long long)capture.saved_frames,
+           seconds,
+           (long long)capture.skipped_frames,
+           (long long)capture.rejected_frames,
+           (long long)writer.failed_frames);
+
+    for(const Control &control : {Control::ExposureTime, Control::AnalogueGain}) {
+        auto lag = source->controls.lag(control);
+        if(lag.count > 0 || lag.missed > 0) {
+            printf("%s applied after %0.1f frames (max %i), %lld missed\n",
+                   control_name(control),
+                   lag.mean_frames,
+                   lag.max_frames,
+                   (long long)lag.missed);
+        }
+    }
+
+    write_latency_csv(format("%s/latency.csv", options.session_path.c_str()));
+    if(!options.trace.empty()) {
+        write_trace(options.trace);
+    }
+
+    source->disconnect_camera();
+    source->uninitialize();
+
+    const bool complete = capture.saved_frames == options.frames && writer.failed_frames == 0;
+    return complete && !interrupted ? 0 : 1;
+}
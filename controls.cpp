@@ -0,0 +1,192 @@
+#include "controls.h"
+
+#include <cstdlib>
+#include <sstream>
+
+namespace {
+const char *control_names[] = {"AnalogueGain", "ExposureTime", "Brightness", "Contrast", "Saturation"};
+} // namespace
+
+const char *control_name(const Control &control) { return control_names[int(control)]; }
+
+void overlay_controls(ControlValues &dst, const ControlValues &src, const uint32_t &mask) {
+    if(mask & control_bit(Control::AnalogueGain)) {
+        dst.analogue_gain = src.analogue_gain;
+    }
+    if(mask & control_bit(Control::ExposureTime)) {
+        dst.exposure_time = src.exposure_time;
+    }
+    if(mask & control_bit(Control::Brightness)) {
+        dst.brightness = src.brightness;
+    }
+    if(mask & control_bit(Control::Contrast)) {
+        dst.contrast = src.contrast;
+    }
+    if(mask & control_bit(Control::Saturation)) {
+        dst.saturation = src.saturation;
+    }
+}
+
+bool parse_control_schedule(const Control &control, const std::string &list, ControlSchedule &schedule) {
+    schedule.steps.clear();
+
+    std::stringstream stream(list);
+    std::string item;
+    while(std::getline(stream, item, ',')) {
+        char *end         = nullptr;
+        const float value = std::strtof(item.c_str(), &end);
+        if(end == item.c_str() || value <= 0.f) {
+            return false;
+        }
+
+        ControlStep step = {control_bit(control), ControlValues()};
+        if(control == Control::ExposureTime) {
+            step.values.exposure_time = int32_t(value * 1000);
+        } else if(control == Control::AnalogueGain) {
+            step.values.analogue_gain = value;
+        } else {
+            return false;
+        }
+        schedule.steps.push_back(step);
+    }
+
+    return !schedule.steps.empty();
+}
+
+ControlMailbox::ControlMailbox() :
+    analogue_gain(1.f), exposure_time(12000), brightness(0.f), contrast(1.f), saturation(1.f), dirty(0),
+    pending_schedule(nullptr), schedule_position(0), schedule_mask(0) {
+    reset_lag();
+}
+
+ControlMailbox::~ControlMailbox() { delete pending_schedule.load(); }
+
+void ControlMailbox::set_analogue_gain(const float &value) {
+    analogue_gain.store(value, std::memory_order_relaxed);
+    changed(Control::AnalogueGain);
+}
+
+void ControlMailbox::set_exposure_time(const int32_t &value) {
+    exposure_time.store(value, std::memory_order_relaxed);
+    changed(Control::ExposureTime);
+}
+
+void ControlMailbox::set_brightness(const float &value) {
+    brightness.store(value, std::memory_order_relaxed);
+    changed(Control::Brightness);
+}
+
+void ControlMailbox::set_contrast(const float &value) {
+    contrast.store(value, std::memory_order_relaxed);
+    changed(Control::Contrast);
+}
+
+void ControlMailbox::set_saturation(const float &value) {
+    saturation.store(value, std::memory_order_relaxed);
+    changed(Control::Saturation);
+}
+
+ControlValues ControlMailbox::values() const {
+    ControlValues values;
+    values.analogue_gain = analogue_gain.load(std::memory_order_relaxed);
+    values.exposure_time = exposure_time.load(std::memory_order_relaxed);
+    values.brightness    = brightness.load(std::memory_order_relaxed);
+    values.contrast      = contrast.load(std::memory_order_relaxed);
+    values.saturation    = saturation.load(std::memory_order_relaxed);
+    return values;
+}
+
+uint32_t ControlMailbox::take_changes(ControlValues &values) {
+    // Values are read after the flags are cleared, a set landing in between is seen now and flagged again for later
+    const uint32_t mask = dirty.exchange(0, std::memory_order_acquire);
+    values              = this->values();
+    return mask;
+}
+
+void ControlMailbox::set_schedule(const ControlSchedule &schedule) {
+    // A schedule the taker never picked up is simply replaced
+    delete pending_schedule.exchange(new ControlSchedule(schedule), std::memory_order_acq_rel);
+}
+
+ControlRequest ControlMailbox::next_request() {
+    ControlRequest request;
+    request.mask = take_changes(request.values);
+    request.step = -1;
+
+    // Switching schedules puts back the manual values the old one overrode, the new one then overrides its own
+    if(ControlSchedule *incoming = pending_schedule.exchange(nullptr, std::memory_order_acq_rel)) {
+        request.mask |= schedule_mask;
+
+        schedule.reset(incoming);
+        schedule_position = 0;
+        schedule_mask     = 0;
+        for(const auto &step : schedule->steps) {
+            schedule_mask |= step.mask;
+        }
+    }
+
+    if(!schedule || schedule->steps.empty()) {
+        return request;
+    }
+
+    if(schedule_position == schedule->steps.size()) {
+        if(!schedule->repeat) {
+            request.mask |= schedule_mask;
+            schedule.reset();
+            schedule_mask = 0;
+            return request;
+        }
+        schedule_position = 0;
+    }
+
+    // Scheduled controls go out with every request, each frame states its own values
+    const ControlStep &step = schedule->steps[schedule_position];
+    overlay_controls(request.values, step.values, step.mask);
+    request.mask |= step.mask;
+    request.step = int(schedule_position);
+
+    schedule_position++;
+
+    return request;
+}
+
+void ControlMailbox::changed(const Control &control) {
+    dirty.fetch_or(control_bit(control), std::memory_order_release);
+}
+
+void ControlMailbox::record_lag(const Control &control, const int &frames) {
+    LagCounters &lag = lags[int(control)];
+    lag.count.fetch_add(1, std::memory_order_relaxed);
+    lag.total.fetch_add(frames, std::memory_order_relaxed);
+    lag.last.store(frames, std::memory_order_relaxed);
+
+    int max = lag.max.load(std::memory_order_relaxed);
+    while(frames > max && !lag.max.compare_exchange_weak(max, frames, std::memory_order_relaxed)) {
+    }
+}
+
+void ControlMailbox::record_missed(const Control &control) {
+    lags[int(control)].missed.fetch_add(1, std::memory_order_relaxed);
+}
+
+ControlLag ControlMailbox::lag(const Control &control) const {
+    const LagCounters &counters = lags[int(control)];
+
+    ControlLag lag;
+    lag.count       = counters.count.load(std::memory_order_relaxed);
+    lag.missed      = counters.missed.load(std::memory_order_relaxed);
+    lag.last_frames = counters.last.load(std::memory_order_relaxed);
+    lag.max_frames  = counters.max.load(std::memory_order_relaxed);
+    lag.mean_frames = lag.count > 0 ? double(counters.total.load(std::memory_order_relaxed)) / lag.count : 0.0;
+    return lag;
+}
+
+void ControlMailbox::reset_lag() {
+    for(auto &lag : lags) {
+        lag.count  = 0;
+        lag.missed = 0;
+        lag.total  = 0;
+        lag.last   = 0;
+        lag.max    = 0;
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef _controls_h_
+#define _controls_h_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+//! Sensor controls the GUI and CLI can change while the camera runs.
+enum class Control { AnalogueGain = 0, ExposureTime, Brightness, Contrast, Saturation, Count };
+
+const char *control_name(const Control &control);
+
+inline uint32_t control_bit(const Control &control) { return 1u << int(control); }
+
+struct ControlValues {
+    float analogue_gain;
+    //! Microseconds.
+    int32_t exposure_time;
+    float brightness;
+    float contrast;
+    float saturation;
+};
+
+//! Copies the controls in mask from src.
+void overlay_controls(ControlValues &dst, const ControlValues &src, const uint32_t &mask);
+
+//! One frame's worth of a schedule, controls outside mask keep their manual values.
+struct ControlStep {
+    uint32_t mask;
+    ControlValues values;
+};
+
+//! Control sets handed to requests one per frame in queue order, e.g. exposures of 1/8/64 ms repeated.
+struct ControlSchedule {
+    std::vector<ControlStep> steps;
+    //! Starts over after the last step, otherwise the manual values return.
+    bool repeat;
+};
+
+//! Builds a schedule stepping one control through values ("1,8,64" for exposures in milliseconds, gains as is),
+//! false if the list doesn't parse.
+bool parse_control_schedule(const Control &control, const std::string &list, ControlSchedule &schedule);
+
+//! What one request carries.
+struct ControlRequest {
+    //! Controls to send, changed manual ones plus everything the schedule sets.
+    uint32_t mask;
+    //! Every control's value for this request, sent or not.
+    ControlValues values;
+    //! Index of the schedule step, -1 outside a schedule.
+    int step;
+};
+
+//! Frames between the request carrying a change and the first frame whose metadata shows it, 0 when the carrying
+//! request's own frame already had it.
+struct ControlLag {
+    int64_t count;
+    //! Changes the sensor never reported within the wait limit, usually values outside its range.
+    int64_t missed;
+
+    int last_frames;
+    int max_frames;
+    double mean_frames;
+};
+
+//! Latest requested control values, written from any thread and taken by whoever queues camera requests. Setters
+//! store the value and mark it changed, take_changes hands over only what changed since it last ran; nothing locks,
+//! so neither side ever waits on the other. A set racing a take can be handed over twice, never lost.
+class ControlMailbox {
+  public:
+    ControlMailbox();
+    ~ControlMailbox();
+
+    void set_analogue_gain(const float &value);
+    void set_exposure_time(const int32_t &value);
+    void set_brightness(const float &value);
+    void set_contrast(const float &value);
+    void set_saturation(const float &value);
+
+    ControlValues values() const;
+
+    //! Controls changed since the last take as a mask of control_bit, 0 when nothing did; values are the current ones
+    //! either way. Only one thread may take at a time.
+    uint32_t take_changes(ControlValues &values);
+
+    //! Replaces the running schedule from the next request on, an empty one stops it. Handed over like the values,
+    //! the taker picks it up on its next request.
+    void set_schedule(const ControlSchedule &schedule);
+
+    //! Taker side of the changes and the schedule together, called once per request in queue order.
+    ControlRequest next_request();
+
+    //! Apply measurements for AnalogueGain and ExposureTime, the controls the sensor reports back.
+    void record_lag(const Control &control, const int &frames);
+    void record_missed(const Control &control);
+    ControlLag lag(const Control &control) const;
+    void reset_lag();
+
+  private:
+    void changed(const Control &control);
+
+    std::atomic<float> analogue_gain;
+    std::atomic<int32_t> exposure_time;
+    std::atomic<float> brightness;
+    std::atomic<float> contrast;
+    std::atomic<float> saturation;
+
+    //! control_bit of every control set since the last take.
+    std::atomic<uint32_t> dirty;
+
+    //! Set but not yet picked up, owned by the mailbox.
+    std::atomic<ControlSchedule *> pending_schedule;
+
+    // Taker only
+    std::unique_ptr<ControlSchedule> schedule;
+    size_t schedule_position;
+    //! Controls the running schedule overrides, resent from the manual values when it ends.
+    uint32_t schedule_mask;
+
+    struct LagCounters {
+        std::atomic<int64_t> count;
+        std::atomic<int64_t> missed;
+        std::atomic<int64_t> total;
+        std::atomic<int> last;
+        std::atomic<int> max;
+    };
+    LagCounters lags[int(Control::Count)];
+};
+
+#endif
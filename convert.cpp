@@ -0,0 +1,324 @@
+#include "convert.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define CONVERT_SSSE3
+#endif
+
+#include "thread_pool.h"
+
+static void copy_row_range(uint8_t *dst,
+                           const size_t &dst_stride,
+                           const uint8_t *src,
+                           const size_t &src_stride,
+                           const size_t &row_bytes,
+                           const int64_t &begin,
+                           const int64_t &end) {
+    // Unpadded on both sides is one contiguous block
+    if(dst_stride == row_bytes && src_stride == row_bytes) {
+        memcpy(dst + begin * row_bytes, src + begin * row_bytes, (end - begin) * row_bytes);
+        return;
+    }
+
+    for(int64_t y = begin; y < end; y++) {
+        memcpy(dst + y * dst_stride, src + y * src_stride, row_bytes);
+    }
+}
+
+void copy_rows(uint8_t *dst,
+               const size_t &dst_stride,
+               const uint8_t *src,
+               const size_t &src_stride,
+               const size_t &row_bytes,
+               const int &rows,
+               const size_t &parallel_bytes) {
+    if(rows * row_bytes < parallel_bytes) {
+        copy_row_range(dst, dst_stride, src, src_stride, row_bytes, 0, rows);
+        return;
+    }
+
+    // Keep each chunk to a few hundred KB so threads aren't started for tiny slices
+    const int64_t min_rows = std::max<int64_t>(1, (256 << 10) / std::max<size_t>(row_bytes, 1));
+    shared_thread_pool().parallel_for(
+        rows,
+        [&](const int64_t &begin, const int64_t &end) {
+            copy_row_range(dst, dst_stride, src, src_stride, row_bytes, begin, end);
+        },
+        min_rows);
+}
+
+// Compile time byte positions for each camera format, matching the view's color_order for that format
+template<PixelOrder order> struct Layout;
+template<> struct Layout<PixelOrder::RGB888> {
+    static constexpr int bytes = 3, red = 0, green = 1, blue = 2, alpha = -1;
+};
+template<> struct Layout<PixelOrder::BGR888> {
+    static constexpr int bytes = 3, red = 2, green = 1, blue = 0, alpha = -1;
+};
+template<> struct Layout<PixelOrder::RGBA8888> {
+    static constexpr int bytes = 4, red = 0, green = 1, blue = 2, alpha = 3;
+};
+template<> struct Layout<PixelOrder::BGRA8888> {
+    static constexpr int bytes = 4, red = 2, green = 1, blue = 0, alpha = 3;
+};
+template<> struct Layout<PixelOrder::XRGB8888> {
+    static constexpr int bytes = 4, red = 2, green = 1, blue = 0, alpha = 3;
+};
+template<> struct Layout<PixelOrder::XBGR8888> {
+    static constexpr int bytes = 4, red = 3, green = 2, blue = 1, alpha = 0;
+};
+
+template<StoreFormat store> struct Store;
+template<> struct Store<StoreFormat::RGB8> {
+    static constexpr int channels = 3;
+    static constexpr bool wide    = false;
+};
+template<> struct Store<StoreFormat::RGBX8> {
+    static constexpr int channels = 4;
+    static constexpr bool wide    = false;
+};
+template<> struct Store<StoreFormat::RGB16> {
+    static constexpr int channels = 3;
+    static constexpr bool wide    = true;
+};
+template<> struct Store<StoreFormat::RGBX16> {
+    static constexpr int channels = 4;
+    static constexpr bool wide    = true;
+};
+
+template<class Src> static PixelTraits traits_of() { return {Src::bytes, Src::red, Src::green, Src::blue, Src::alpha}; }
+
+PixelTraits pixel_traits(const PixelOrder &order) {
+    switch(order) {
+        case PixelOrder::RGB888:
+            return traits_of<Layout<PixelOrder::RGB888>>();
+        case PixelOrder::BGR888:
+            return traits_of<Layout<PixelOrder::BGR888>>();
+        case PixelOrder::RGBA8888:
+            return traits_of<Layout<PixelOrder::RGBA8888>>();
+        case PixelOrder::BGRA8888:
+            return traits_of<Layout<PixelOrder::BGRA8888>>();
+        case PixelOrder::XRGB8888:
+            return traits_of<Layout<PixelOrder::XRGB8888>>();
+        case PixelOrder::XBGR8888:
+            return traits_of<Layout<PixelOrder::XBGR8888>>();
+    }
+    return traits_of<Layout<PixelOrder::RGB888>>();
+}
+
+int store_channels(const StoreFormat &store) {
+    return store == StoreFormat::RGB8 || store == StoreFormat::RGB16 ? 3 : 4;
+}
+
+int store_bytes(const StoreFormat &store) {
+    const bool wide = store == StoreFormat::RGB16 || store == StoreFormat::RGBX16;
+    return store_channels(store) * (wide ? 2 : 1);
+}
+
+template<class Src, class Dst>
+static void convert_scalar(uint8_t *dst, const uint8_t *src, const int &begin, const int &end) {
+    for(int x = begin; x < end; x++) {
+        const uint8_t *s = src + size_t(x) * Src::bytes;
+
+        uint8_t v[4] = {s[Src::red], s[Src::green], s[Src::blue], 255};
+        if constexpr(Src::alpha >= 0) {
+            v[3] = s[Src::alpha];
+        }
+
+        if constexpr(Dst::wide) {
+            uint16_t *d = reinterpret_cast<uint16_t *>(dst) + size_t(x) * Dst::channels;
+            for(int c = 0; c < Dst::channels; c++) {
+                d[c] = uint16_t(v[c] * 257);
+            }
+        } else {
+            uint8_t *d = dst + size_t(x) * Dst::channels;
+            for(int c = 0; c < Dst::channels; c++) {
+                d[c] = v[c];
+            }
+        }
+    }
+}
+
+#if defined(__ARM_NEON)
+// x * 257, so 255 stays full scale
+static inline uint16x8_t widen(const uint8x8_t &v) { return vorrq_u16(vshll_n_u8(v, 8), vmovl_u8(v)); }
+
+// Structured loads split the channels into registers, reordering is then just which register goes where
+template<class Src, class Dst> static int convert_neon(uint8_t *dst, const uint8_t *src, const int &width) {
+    int x = 0;
+    for(; x + 16 <= width; x += 16) {
+        uint8x16_t r, g, b, a;
+        if constexpr(Src::bytes == 4) {
+            uint8x16x4_t p = vld4q_u8(src + size_t(x) * 4);
+            r              = p.val[Src::red];
+            g              = p.val[Src::green];
+            b              = p.val[Src::blue];
+            a              = p.val[Src::alpha];
+        } else {
+            uint8x16x3_t p = vld3q_u8(src + size_t(x) * 3);
+            r              = p.val[Src::red];
+            g              = p.val[Src::green];
+            b              = p.val[Src::blue];
+            a              = vdupq_n_u8(255);
+        }
+
+        if constexpr(!Dst::wide && Dst::channels == 4) {
+            uint8x16x4_t o = {{r, g, b, a}};
+            vst4q_u8(dst + size_t(x) * 4, o);
+        } else if constexpr(!Dst::wide) {
+            uint8x16x3_t o = {{r, g, b}};
+            vst3q_u8(dst + size_t(x) * 3, o);
+        } else if constexpr(Dst::channels == 4) {
+            uint16_t *d = reinterpret_cast<uint16_t *>(dst) + size_t(x) * 4;
+
+            uint16x8x4_t low = {
+                {widen(vget_low_u8(r)), widen(vget_low_u8(g)), widen(vget_low_u8(b)), widen(vget_low_u8(a))}};
+            uint16x8x4_t high = {
+                {widen(vget_high_u8(r)), widen(vget_high_u8(g)), widen(vget_high_u8(b)), widen(vget_high_u8(a))}};
+            vst4q_u16(d, low);
+            vst4q_u16(d + 32, high);
+        } else {
+            uint16_t *d = reinterpret_cast<uint16_t *>(dst) + size_t(x) * 3;
+
+            uint16x8x3_t low  = {{widen(vget_low_u8(r)), widen(vget_low_u8(g)), widen(vget_low_u8(b))}};
+            uint16x8x3_t high = {{widen(vget_high_u8(r)), widen(vget_high_u8(g)), widen(vget_high_u8(b))}};
+            vst3q_u16(d, low);
+            vst3q_u16(d + 24, high);
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(CONVERT_SSSE3)
+static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+
+// One byte shuffle per 4 pixels for 4 byte sources, unpacking a register with itself gives the x * 257 widening
+template<class Src, class Dst>
+__attribute__((target("ssse3"))) static int convert_ssse3(uint8_t *dst, const uint8_t *src, const int &width) {
+    if constexpr(Src::bytes != 4 || (Dst::wide && Dst::channels != 4)) {
+        return 0;
+    } else {
+        // 3 channel output packs 4 pixels into 12 bytes, the last 4 are zeroed
+        const int channel[4] = {Src::red, Src::green, Src::blue, Src::alpha};
+        alignas(16) int8_t order[16];
+        for(int i = 0; i < 16; i++) {
+            const int p = i / Dst::channels;
+            order[i]    = p < 4 ? int8_t(p * 4 + channel[i % Dst::channels]) : int8_t(-128);
+        }
+        const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i *>(order));
+
+        int x = 0;
+        if constexpr(Dst::channels == 4 && !Dst::wide) {
+            for(; x + 4 <= width; x += 4) {
+                __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + size_t(x) * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + size_t(x) * 4), _mm_shuffle_epi8(p, mask));
+            }
+        } else if constexpr(Dst::channels == 4) {
+            for(; x + 4 <= width; x += 4) {
+                __m128i p  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + size_t(x) * 4));
+                __m128i *d = reinterpret_cast<__m128i *>(dst + size_t(x) * 8);
+
+                p = _mm_shuffle_epi8(p, mask);
+                _mm_storeu_si128(d, _mm_unpacklo_epi8(p, p));
+                _mm_storeu_si128(d + 1, _mm_unpackhi_epi8(p, p));
+            }
+        } else {
+            // Each store writes 16 bytes for 12, stop early enough that the overlap stays inside the row
+            for(; x + 6 <= width; x += 4) {
+                __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + size_t(x) * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + size_t(x) * 3), _mm_shuffle_epi8(p, mask));
+            }
+        }
+        return x;
+    }
+}
+#endif
+
+template<class Src, class Dst> static void convert_row(uint8_t *dst, const uint8_t *src, const int &width) {
+    int x = 0;
+#if defined(__ARM_NEON)
+    x = convert_neon<Src, Dst>(dst, src, width);
+#elif defined(CONVERT_SSSE3)
+    if(has_ssse3) {
+        x = convert_ssse3<Src, Dst>(dst, src, width);
+    }
+#endif
+    convert_scalar<Src, Dst>(dst, src, x, width);
+}
+
+using RowConverter = void (*)(uint8_t *dst, const uint8_t *src, const int &width);
+
+template<class Src> static RowConverter converter_for(const StoreFormat &store) {
+    switch(store) {
+        case StoreFormat::RGB8:
+            return convert_row<Src, Store<StoreFormat::RGB8>>;
+        case StoreFormat::RGBX8:
+            return convert_row<Src, Store<StoreFormat::RGBX8>>;
+        case StoreFormat::RGB16:
+            return convert_row<Src, Store<StoreFormat::RGB16>>;
+        case StoreFormat::RGBX16:
+            return convert_row<Src, Store<StoreFormat::RGBX16>>;
+    }
+    return nullptr;
+}
+
+static RowConverter select_converter(const PixelOrder &order, const StoreFormat &store) {
+    switch(order) {
+        case PixelOrder::RGB888:
+            return converter_for<Layout<PixelOrder::RGB888>>(store);
+        case PixelOrder::BGR888:
+            return converter_for<Layout<PixelOrder::BGR888>>(store);
+        case PixelOrder::RGBA8888:
+            return converter_for<Layout<PixelOrder::RGBA8888>>(store);
+        case PixelOrder::BGRA8888:
+            return converter_for<Layout<PixelOrder::BGRA8888>>(store);
+        case PixelOrder::XRGB8888:
+            return converter_for<Layout<PixelOrder::XRGB8888>>(store);
+        case PixelOrder::XBGR8888:
+            return converter_for<Layout<PixelOrder::XBGR8888>>(store);
+    }
+    return nullptr;
+}
+
+void convert_rows(uint8_t *dst,
+                  const size_t &dst_stride,
+                  const uint8_t *src,
+                  const size_t &src_stride,
+                  const int &width,
+                  const int &rows,
+                  const PixelOrder &order,
+                  const StoreFormat &store,
+                  const size_t &parallel_bytes) {
+    // Already in the stored layout, nothing to do but drop the padding
+    if((order == PixelOrder::RGB888 && store == StoreFormat::RGB8) ||
+       (order == PixelOrder::RGBA8888 && store == StoreFormat::RGBX8)) {
+        copy_rows(dst, dst_stride, src, src_stride, size_t(width) * store_bytes(store), rows, parallel_bytes);
+        return;
+    }
+
+    RowConverter convert = select_converter(order, store);
+    if(convert == nullptr) {
+        return;
+    }
+
+    auto convert_range = [&](const int64_t &begin, const int64_t &end) {
+        for(int64_t y = begin; y < end; y++) {
+            convert(dst + y * dst_stride, src + y * src_stride, width);
+        }
+    };
+
+    const size_t row_bytes = size_t(width) * store_bytes(store);
+    if(rows * row_bytes < parallel_bytes) {
+        convert_range(0, rows);
+        return;
+    }
+
+    const int64_t min_rows = std::max<int64_t>(1, (256 << 10) / std::max<size_t>(row_bytes, 1));
+    shared_thread_pool().parallel_for(rows, convert_range, min_rows);
+}
@@ -0,0 +1,50 @@
+#ifndef _convert_h_
+#define _convert_h_
+
+#include <cstddef>
+#include <cstdint>
+
+//! Copies rows of row_bytes between buffers with different strides, dropping any padding. Frames larger than
+//! parallel_bytes are split across the shared thread pool.
+void copy_rows(uint8_t *dst,
+               const size_t &dst_stride,
+               const uint8_t *src,
+               const size_t &src_stride,
+               const size_t &row_bytes,
+               const int &rows,
+               const size_t &parallel_bytes = 4 << 20);
+
+//! The 8-bit camera formats, named after their libcamera formats.
+enum class PixelOrder { RGB888 = 0, BGR888, RGBA8888, BGRA8888, XRGB8888, XBGR8888 };
+
+//! Byte positions of each channel inside a pixel, alpha is the fourth byte (alpha or padding) or -1 for 3 byte pixels.
+struct PixelTraits {
+    int bytes;
+    int red;
+    int green;
+    int blue;
+    int alpha;
+};
+
+PixelTraits pixel_traits(const PixelOrder &order);
+
+//! Layouts frames are stored in, red first. The X variants keep the camera's fourth byte (255 for 3 byte pixels).
+enum class StoreFormat { RGB8 = 0, RGBX8, RGB16, RGBX16 };
+
+int store_channels(const StoreFormat &store);
+int store_bytes(const StoreFormat &store);
+
+//! Converts rows of width pixels from a camera format to a store format in a single pass: channels are reordered,
+//! the fourth byte kept or dropped, 8-bit samples widened to 16 (x * 257) and padding removed. Uses NEON on ARM and
+//! SSSE3 when the CPU has it, frames larger than parallel_bytes are split across the shared thread pool.
+void convert_rows(uint8_t *dst,
+                  const size_t &dst_stride,
+                  const uint8_t *src,
+                  const size_t &src_stride,
+                  const int &width,
+                  const int &rows,
+                  const PixelOrder &order,
+                  const StoreFormat &store,
+                  const size_t &parallel_bytes = 4 << 20);
+
+#endif
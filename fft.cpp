@@ -0,0 +1,101 @@
+#include "fft.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "thread_pool.h"
+
+FFT::FFT(const int &size) : n(size) {
+    int bits = 0;
+    while((1 << bits) < n) {
+        bits++;
+    }
+
+    bit_reverse.resize(n);
+    for(int i = 0; i < n; i++) {
+        int r = 0;
+        for(int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bit_reverse[i] = r;
+    }
+
+    twiddles.resize(n / 2);
+    for(int i = 0; i < n / 2; i++) {
+        const double angle = -2.0 * M_PI * i / n;
+        twiddles[i]        = std::complex<float>(float(std::cos(angle)), float(std::sin(angle)));
+    }
+}
+
+void FFT::transform(std::complex<float> *data, const bool &inverse) const {
+    for(int i = 0; i < n; i++) {
+        if(i < bit_reverse[i]) {
+            std::swap(data[i], data[bit_reverse[i]]);
+        }
+    }
+
+    for(int length = 2; length <= n; length <<= 1) {
+        const int half = length >> 1;
+        const int step = n / length;
+
+        for(int i = 0; i < n; i += length) {
+            for(int j = 0; j < half; j++) {
+                const std::complex<float> w = inverse ? std::conj(twiddles[j * step]) : twiddles[j * step];
+
+                const std::complex<float> u = data[i + j];
+                const std::complex<float> v = data[i + j + half] * w;
+
+                data[i + j]        = u + v;
+                data[i + j + half] = u - v;
+            }
+        }
+    }
+}
+
+// Blocked so both sides of the transpose stay in cache
+static void transpose(std::complex<float> *dst, const std::complex<float> *src, const int &n) {
+    const int block = 32;
+
+    shared_thread_pool().parallel_for(
+        (n + block - 1) / block,
+        [&](const int64_t &begin, const int64_t &end) {
+            for(int64_t by = begin * block; by < std::min<int64_t>(end * block, n); by += block) {
+                for(int bx = 0; bx < n; bx += block) {
+                    for(int y = int(by); y < std::min<int64_t>(by + block, n); y++) {
+                        for(int x = bx; x < std::min(bx + block, n); x++) {
+                            dst[size_t(x) * n + y] = src[size_t(y) * n + x];
+                        }
+                    }
+                }
+            }
+        });
+}
+
+void FFT::transform_2d(std::complex<float> *data,
+                       const bool &inverse,
+                       std::vector<std::complex<float>> &scratch) const {
+    scratch.resize(size_t(n) * n);
+
+    auto rows = [&](std::complex<float> *image) {
+        shared_thread_pool().parallel_for(
+            n,
+            [&](const int64_t &begin, const int64_t &end) {
+                for(int64_t y = begin; y < end; y++) {
+                    transform(image + y * n, inverse);
+                }
+            },
+            16);
+    };
+
+    rows(data);
+    transpose(scratch.data(), data, n);
+    rows(scratch.data());
+    transpose(data, scratch.data(), n);
+
+    if(inverse) {
+        const float scale = 1.f / (float(n) * float(n));
+        for(size_t i = 0; i < size_t(n) * n; i++) {
+            data[i] *= scale;
+        }
+    }
+}
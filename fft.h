@@ -0,0 +1,31 @@
+#ifndef _fft_h_
+#define _fft_h_
+
+#include <complex>
+#include <vector>
+
+//! Radix-2 complex FFT plan. Twiddles and the bit reversal table are built once and reused for every transform.
+class FFT {
+  public:
+    //! size must be a power of two.
+    explicit FFT(const int &size);
+
+    int size() const { return n; }
+
+    //! In place transform of size samples, the inverse is not scaled.
+    void transform(std::complex<float> *data, const bool &inverse) const;
+
+    //! In place transform of a size x size image, rows are split across the shared thread pool. scratch is resized
+    //! on first use and can be kept between calls. The inverse is scaled by 1 / (size * size).
+    void transform_2d(std::complex<float> *data,
+                      const bool &inverse,
+                      std::vector<std::complex<float>> &scratch) const;
+
+  private:
+    int n;
+
+    std::vector<int> bit_reverse;
+    std::vector<std::complex<float>> twiddles;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "frame_source.h"
+
+#include <cstdio>
+
+#include "replay_source.h"
+#include "synthetic_source.h"
+
+#ifdef TELEZERO_CAMERA
+#include "camera.h"
+#endif
+
+FrameSource::FrameSource() :
+    width(0), height(0), channels(0), pixel_order(PixelOrder::XRGB8888), stride(0), raw_mode(false), bit_depth(8),
+    packed(false), cfa_pattern("MONO"), sequence(-1), buffer_count(3), lens_position(0.f),
+    temperature(0.f) {}
+
+std::unique_ptr<FrameSource> create_frame_source(const std::string &name) {
+    if(name == "camera") {
+#ifdef TELEZERO_CAMERA
+        return std::make_unique<Camera>();
+#else
+        printf("Built without libcamera, use synthetic or replay:<path>\n");
+        return nullptr;
+#endif
+    }
+
+    if(name == "synthetic") {
+        return std::make_unique<SyntheticSource>();
+    }
+
+    const std::string replay = "replay:";
+    if(name.compare(0, replay.size(), replay) == 0) {
+        auto source = std::make_unique<ReplaySource>();
+        source->set_path(name.substr(replay.size()));
+        return source;
+    }
+
+    printf("Unknown source %s\n", name.c_str());
+    return nullptr;
+}
@@ -0,0 +1,113 @@
+#ifndef _frame_source_h_
+#define _frame_source_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "controls.h"
+#include "convert.h"
+
+//! A completed frame still owned by its source, valid until it is handed back with release_frame.
+struct FrameView {
+    const uint8_t *data;
+    size_t size;
+
+    int width;
+    int height;
+    int channels;
+    int stride;
+
+    //! 8 for processed RGB, otherwise the raw sample depth; packed raw rows use the CSI-2 layout.
+    int bit_depth;
+    bool packed;
+
+    int64_t sequence;
+    //! Sensor start of exposure in nanoseconds (CLOCK_BOOTTIME), 0 if the pipeline didn't report one.
+    int64_t timestamp;
+
+    //! Gain and exposure (microseconds) the frame was actually taken with, 0 when the source doesn't know.
+    float analogue_gain;
+    int32_t exposure_time;
+    //! Schedule step the frame's request carried, -1 outside a schedule. Pipelines apply controls a few frames late,
+    //! so the applied values above may still be an earlier step's.
+    int control_step;
+
+    //! Source specific, identifies the buffer release_frame hands back.
+    void *handle;
+};
+
+//! Anything the pipeline can take frames from: the libcamera camera, a synthetic generator or a replayed capture.
+//! Sources are driven the same way, connect, configure from the advertised formats and sizes, start, then take frames
+//! from the view timer while the frame callback sees every frame on the source's own thread.
+class FrameSource {
+  public:
+    FrameSource();
+    virtual ~FrameSource() {}
+
+    virtual bool initialize() = 0;
+    virtual bool uninitialize() = 0;
+
+    virtual std::vector<std::string> get_cameras() const = 0;
+    virtual bool connect_camera(const std::string &camera_name) = 0;
+    virtual bool disconnect_camera() = 0;
+
+    virtual bool configure_camera(const int &format_index, const int &size_index) = 0;
+
+    virtual bool start_camera() = 0;
+    virtual bool stop_camera() = 0;
+
+    virtual bool is_connected() const = 0;
+
+    //! Takes the most recent completed frame and recycles any older ones, must be handed back with release_frame.
+    virtual bool acquire_frame(FrameView &view) = 0;
+    //! Takes the oldest completed frame, for consumers that need every frame in order.
+    virtual bool next_frame(FrameView &view) = 0;
+    virtual void release_frame(FrameView &view) = 0;
+
+    //! Completed frames waiting for the consumer; acquire/next/release_frame must all be called from one thread.
+    virtual size_t pending_frames() const = 0;
+
+    //! Called on the source's thread for every completed frame before it is queued for the consumer, the view is
+    //! only valid for the duration of the call. Set before start_camera.
+    void set_frame_callback(std::function<void(const FrameView &view)> callback) { frame_callback = callback; }
+
+    virtual std::vector<std::string> get_pixel_formats() const = 0;
+    virtual std::vector<std::string> get_pixel_format_sizes(const std::string &format) = 0;
+
+    int width;
+    int height;
+    int channels;
+    //! Byte order of processed 8-bit frames, see convert.h.
+    PixelOrder pixel_order;
+
+    int stride;
+
+    //! Set when a Bayer format is configured, frames are then raw sensor data.
+    bool raw_mode;
+    int bit_depth;
+    bool packed;
+    std::string cfa_pattern;
+
+    int64_t sequence;
+
+    //! Number of frame buffers allocated at configure time (2-8).
+    int buffer_count;
+
+    //! Gain, exposure and the ISP controls, safe to set from any thread while frames are flowing.
+    ControlMailbox controls;
+
+    float lens_position;
+    float temperature;
+
+  protected:
+    std::function<void(const FrameView &view)> frame_callback;
+};
+
+//! "camera", "synthetic" or "replay:<capture directory or .ser>", nullptr for anything else.
+std::unique_ptr<FrameSource> create_frame_source(const std::string &name);
+
+#endif
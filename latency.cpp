@@ -0,0 +1,140 @@
+#include "latency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+namespace {
+const char *stage_names[] = {"sensor_to_complete",
+                             "frame_callback",
+                             "sensor_to_view",
+                             "capture_convert",
+                             "capture_write",
+                             "texture_upload",
+                             "paint"};
+
+LatencyHistogram stage_histograms[int(LatencyStage::Count)];
+} // namespace
+
+const char *latency_stage_name(const LatencyStage &stage) { return stage_names[int(stage)]; }
+
+LatencyHistogram::LatencyHistogram() { reset(); }
+
+int LatencyHistogram::bucket_of(const int64_t &ns) {
+    const uint64_t value = uint64_t(std::clamp<int64_t>(ns, 0, (int64_t(1) << max_bits) - 1));
+    if(value < (1u << sub_bits)) {
+        return int(value);
+    }
+
+    // The top sub_bits below the leading one pick the linear bucket within the power of two
+    const int msb   = 63 - __builtin_clzll(value);
+    const int shift = msb - sub_bits;
+    return ((shift + 1) << sub_bits) + int((value >> shift) & ((1u << sub_bits) - 1));
+}
+
+int64_t LatencyHistogram::bucket_upper(const int &bucket) {
+    if(bucket < (1 << sub_bits)) {
+        return bucket;
+    }
+
+    const int shift = (bucket >> sub_bits) - 1;
+    const int64_t lower = int64_t((1 << sub_bits) + (bucket & ((1 << sub_bits) - 1))) << shift;
+    return lower + (int64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(const int64_t &ns) {
+    buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+
+    int64_t current = max.load(std::memory_order_relaxed);
+    while(ns > current && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::record_since(const std::chrono::steady_clock::time_point &start) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+void LatencyHistogram::reset() {
+    for(auto &bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+LatencySummary LatencyHistogram::summary() const {
+    uint64_t counts[bucket_count];
+    uint64_t total = 0;
+    for(int i = 0; i < bucket_count; i++) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+
+    const int64_t largest = max.load(std::memory_order_relaxed);
+
+    // Bucket upper edges, never past the largest sample actually seen
+    auto percentile = [&](const double &p) {
+        const uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p * double(total))));
+
+        uint64_t seen = 0;
+        for(int i = 0; i < bucket_count; i++) {
+            seen += counts[i];
+            if(seen >= rank) {
+                return std::min(bucket_upper(i), largest);
+            }
+        }
+        return largest;
+    };
+
+    LatencySummary s;
+    s.count   = int64_t(total);
+    s.mean_ms = total > 0 ? double(sum.load(std::memory_order_relaxed)) / double(total) / 1e6 : 0.0;
+    s.p50_ms  = total > 0 ? double(percentile(0.50)) / 1e6 : 0.0;
+    s.p99_ms  = total > 0 ? double(percentile(0.99)) / 1e6 : 0.0;
+    s.max_ms  = double(largest) / 1e6;
+
+    return s;
+}
+
+LatencyHistogram &stage_latency(const LatencyStage &stage) { return stage_histograms[int(stage)]; }
+
+void reset_stage_latency() {
+    for(auto &histogram : stage_histograms) {
+        histogram.reset();
+    }
+}
+
+bool write_latency_csv(const std::string &filename) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if(!file) {
+        printf("Unable to write latency (%s)\n", filename.c_str());
+        return false;
+    }
+
+    fprintf(file, "stage,count,mean_ms,p50_ms,p99_ms,max_ms\n");
+    for(int i = 0; i < int(LatencyStage::Count); i++) {
+        auto s = stage_histograms[i].summary();
+        fprintf(file,
+                "%s,%lld,%.3f,%.3f,%.3f,%.3f\n",
+                stage_names[i],
+                (long long)s.count,
+                s.mean_ms,
+                s.p50_ms,
+                s.p99_ms,
+                s.max_ms);
+    }
+
+    fclose(file);
+    return true;
+}
+
+int64_t boottime_ns() {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
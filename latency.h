@@ -0,0 +1,82 @@
+#ifndef _latency_h_
+#define _latency_h_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+//! Points along a frame's way from the sensor to the screen and to disk. The sensor stages are ages measured against
+//! the frame's start of exposure, the others are how long the stage itself took.
+enum class LatencyStage {
+    SensorToComplete = 0,
+    FrameCallback,
+    SensorToView,
+    CaptureConvert,
+    CaptureWrite,
+    TextureUpload,
+    Paint,
+    Count
+};
+
+const char *latency_stage_name(const LatencyStage &stage);
+
+struct LatencySummary {
+    int64_t count;
+
+    double mean_ms;
+    double p50_ms;
+    double p99_ms;
+    double max_ms;
+};
+
+//! Log-linear histogram of nanosecond latencies, 16 linear buckets per power of two so percentiles come out within
+//! about 6%. Recording is a few relaxed atomic operations and never blocks, any thread may record while another
+//! summarizes; a summary taken mid-record can be off by that one sample.
+class LatencyHistogram {
+  public:
+    LatencyHistogram();
+
+    void record(const int64_t &ns);
+    void record_since(const std::chrono::steady_clock::time_point &start);
+
+    void reset();
+
+    LatencySummary summary() const;
+
+  private:
+    static const int sub_bits     = 4;
+    static const int max_bits     = 40;
+    static const int bucket_count = (max_bits - sub_bits + 1) << sub_bits;
+
+    static int bucket_of(const int64_t &ns);
+    static int64_t bucket_upper(const int &bucket);
+
+    std::atomic<uint64_t> buckets[bucket_count];
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> sum;
+    std::atomic<int64_t> max;
+};
+
+//! Process wide histogram for a stage.
+LatencyHistogram &stage_latency(const LatencyStage &stage);
+void reset_stage_latency();
+
+//! One row per stage with count, mean, p50, p99 and max in milliseconds.
+bool write_latency_csv(const std::string &filename);
+
+//! Records the lifetime of the scope into a stage.
+class ScopedLatency {
+  public:
+    explicit ScopedLatency(const LatencyStage &stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() { stage_latency(stage).record_since(start); }
+
+  private:
+    LatencyStage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+//! Now on CLOCK_BOOTTIME, the clock sensor timestamps are taken on.
+int64_t boottime_ns();
+
+#endif
@@ -1,54 +1,95 @@
 #version 130
 
+// Compiled once per pixel format. RAW frames are 16-bit Bayer mosaics, everything else is 8-bit RGB(A) with
+// SWIZZLE picking display red, green and blue out of the texel.
+in vec2 uv;
+
+out vec4 frag_color;
+
 uniform usampler2D image;
 
-uniform int channels;
-uniform int color_order;
+#ifdef RAW
+// cfa_pattern is 0 RGGB, 1 GRBG, 2 GBRG, 3 BGGR and 4 mono
+uniform int cfa_pattern;
+uniform float black_point;
+uniform float white_point;
+uniform float gamma;
+#endif
 
-void main()
+// Screen transfer stretch per display channel, shadows are clipped and midtones balanced in the normalized domain
+uniform int stretch;
+uniform vec3 stretch_shadows;
+uniform vec3 stretch_midtones;
+
+#ifdef RAW
+float sample_raw(ivec2 p)
+{
+	ivec2 size = textureSize(image, 0);
+	return float(texelFetch(image, clamp(p, ivec2(0), size - ivec2(1)), 0).r);
+}
+
+// Bilinear demosaic, each missing colour is the mean of the nearest samples of that colour
+vec3 debayer(ivec2 p)
 {
-	if(channels == 3 && color_order == 0) {
-		vec3 color = texture(image, gl_TexCoord[0].st).rgb;
-		color /= vec3(255.f);
-	
-		gl_FragColor = vec4(color, 1);
+	float c = sample_raw(p);
+	if(cfa_pattern == 4) {
+		return vec3(c);
 	}
-	
-	if(channels == 3 && color_order == 1) {
-		vec3 color = texture(image, gl_TexCoord[0].st).bgr;
-		color /= vec3(255.f);
-	
-		gl_FragColor = vec4(color, 1);
+
+	float cross = (sample_raw(p + ivec2(-1, 0)) + sample_raw(p + ivec2(1, 0)) + sample_raw(p + ivec2(0, -1)) + sample_raw(p + ivec2(0, 1))) * 0.25;
+	float diagonal = (sample_raw(p + ivec2(-1, -1)) + sample_raw(p + ivec2(1, -1)) + sample_raw(p + ivec2(-1, 1)) + sample_raw(p + ivec2(1, 1))) * 0.25;
+	float horizontal = (sample_raw(p + ivec2(-1, 0)) + sample_raw(p + ivec2(1, 0))) * 0.5;
+	float vertical = (sample_raw(p + ivec2(0, -1)) + sample_raw(p + ivec2(0, 1))) * 0.5;
+
+	// Position of the red sample inside the 2x2 tile
+	ivec2 red = ivec2(cfa_pattern == 1 || cfa_pattern == 3 ? 1 : 0, cfa_pattern >= 2 ? 1 : 0);
+	ivec2 parity = p & ivec2(1);
+
+	bool red_column = parity.x == red.x;
+	bool red_row = parity.y == red.y;
+
+	if(red_row && red_column) {
+		return vec3(c, cross, diagonal);
 	}
-	
-	if(channels == 4 && color_order == 0) {
-		vec4 color = texture(image, gl_TexCoord[0].st).rgba;
-		color /= vec4(255.f);
-	
-		gl_FragColor = color;
+
+	if(!red_row && !red_column) {
+		return vec3(diagonal, cross, c);
 	}
-	
-	if(channels == 4 && color_order == 1) {
-		vec4 color = texture(image, gl_TexCoord[0].st).rgba;
-		color = color.bgra;
-		color /= vec4(255.f);
-	
-		gl_FragColor = color;
+
+	if(red_row) {
+		return vec3(horizontal, c, vertical);
 	}
-	
-	if(channels == 4 && color_order == 2) {
-		vec4 color = texture(image, gl_TexCoord[0].st).rgba;
-		color = color.abgr;
-		color /= vec4(255.f);
-	
-		gl_FragColor = color;
+
+	return vec3(vertical, c, horizontal);
+}
+#endif
+
+vec3 screen_transfer(vec3 color)
+{
+	vec3 x = clamp((color - stretch_shadows) / max(vec3(1.0) - stretch_shadows, vec3(1e-4)), 0.0, 1.0);
+	vec3 m = stretch_midtones;
+	return (m - vec3(1.0)) * x / ((vec3(2.0) * m - vec3(1.0)) * x - m);
+}
+
+void main()
+{
+#ifdef RAW
+	ivec2 size = textureSize(image, 0);
+	ivec2 p = ivec2(uv * vec2(size));
+
+	vec3 color = debayer(p);
+	color = clamp((color - vec3(black_point)) / vec3(max(white_point - black_point, 1.0)), 0.0, 1.0);
+	if(stretch == 1) {
+		color = screen_transfer(color);
+	} else {
+		color = pow(color, vec3(1.0 / max(gamma, 0.01)));
 	}
-	
-	if(channels == 4 && color_order == 3) {
-		vec4 color = texture(image, gl_TexCoord[0].st).rgba;
-		color = color.bgra;
-		color /= vec4(255.f);
-	
-		gl_FragColor = color;
+#else
+	vec3 color = vec3(texture(image, uv).SWIZZLE) / vec3(255.0);
+	if(stretch == 1) {
+		color = screen_transfer(color);
 	}
+#endif
+
+	frag_color = vec4(color, 1.0);
 }
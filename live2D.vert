@@ -1,6 +1,14 @@
+#version 130
+
+in vec2 position;
+in vec2 texcoord;
+
+uniform mat4 mvp;
+
+out vec2 uv;
+
 void main()
 {
-	gl_TexCoord[0] = gl_TextureMatrix[0]*gl_MultiTexCoord0;
-	gl_TexCoord[0].y = 1.0 - gl_TexCoord[0].y;
-	gl_Position = ftransform();
+	uv = vec2(texcoord.x, 1.0 - texcoord.y);
+	gl_Position = mvp * vec4(position, 0.0, 1.0);
 }
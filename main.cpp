@@ -1,9 +1,12 @@
 #include "mainwindow.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QLocale>
 #include <QTranslator>
 
+#include "trace.h"
+
 int main(int argc, char *argv[]) {
     QApplication a(argc, argv);
 
@@ -16,7 +19,34 @@ int main(int argc, char *argv[]) {
             break;
         }
     }
-    MainWindow w;
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption source_option("source",
+                                     "Where frames come from: camera, synthetic or replay:<capture directory or .ser>.",
+                                     "source",
+                                     "camera");
+    parser.addOption(source_option);
+    QCommandLineOption trace_option("trace", "Trace from startup and write the trace to file on exit.", "file");
+    parser.addOption(trace_option);
+    parser.process(a);
+
+    auto source = create_frame_source(parser.value(source_option).toStdString());
+    if(!source) {
+        return 1;
+    }
+
+    if(parser.isSet(trace_option)) {
+        start_tracing();
+    }
+
+    MainWindow w(std::move(source));
     w.show();
-    return a.exec();
+    const int result = a.exec();
+
+    if(parser.isSet(trace_option)) {
+        write_trace(parser.value(trace_option).toStdString());
+    }
+
+    return result;
 }
@@ -1,12 +1,15 @@
 #include "mainwindow.h"
 #include "./ui_mainwindow.h"
 
+#include <algorithm>
 #include <filesystem>
 
-#include "camera.h"
 #include "tiff.h"
+#include "trace.h"
+#include "unpack.h"
 #include "util.h"
 
+#include <QApplication>
 #include <QFileDialog>
 #include <QMessageBox>
 
@@ -23,14 +26,77 @@ std::vector<int> get_selected_rows(QList<QTableWidgetItem *> list) {
     return results;
 }
 
-MainWindow::MainWindow(QWidget *parent) :
-    QMainWindow(parent), begin_capture(0), toss_frames(0), captured_images(0), total_images(0), current_sequence(-1) {
+MainWindow::MainWindow(std::unique_ptr<FrameSource> source, QWidget *parent) :
+    QMainWindow(parent),
+    camera(std::move(source)),
+    current_sequence(-1),
+    capture_session(writer_pool),
+    playback_shown(-1),
+    live_color_order(0),
+    latency_pending(false) {
     ui = std::make_unique<Ui::MainWindow>();
     ui->setupUi(this);
 
-    camera = std::make_unique<Camera>();
     camera->initialize();
 
+    // Capture and stacking see every completed frame on the camera thread, the view timer only ever shows the latest.
+    // Calibration and registration happen once here so both get the corrected, aligned frame.
+    camera->set_frame_callback([this](const FrameView &view) {
+        ScopedLatency latency(LatencyStage::FrameCallback);
+        TraceScope trace("frame_callback", view.sequence);
+
+        // Each frame calibrates into a buffer of its own, the view shows it later without repeating the pass
+        std::unique_ptr<CalibratedFrame> frame_buffer;
+        {
+            std::lock_guard<std::mutex> lock(calibrated_mutex);
+            if(!calibrated_spare.empty()) {
+                frame_buffer = std::move(calibrated_spare.back());
+                calibrated_spare.pop_back();
+            }
+        }
+        if(!frame_buffer) {
+            frame_buffer = std::make_unique<CalibratedFrame>();
+        }
+
+        FrameView calibrated = view;
+        bool is_calibrated   = false;
+        {
+            TraceScope trace("calibrate", view.sequence);
+            is_calibrated = calibration.apply(view, frame_buffer->pixels, calibrated);
+        }
+
+        // Published before the rest of the pipeline reads it, the view only ever reads the pixels too
+        frame_buffer->view = calibrated;
+        {
+            std::lock_guard<std::mutex> lock(calibrated_mutex);
+            if(calibrated_latest) {
+                calibrated_spare.push_back(std::move(calibrated_latest));
+            }
+            if(is_calibrated) {
+                calibrated_latest = std::move(frame_buffer);
+            } else {
+                calibrated_spare.push_back(std::move(frame_buffer));
+            }
+        }
+
+        {
+            TraceScope trace("analyze", view.sequence);
+            star_detector.process_frame(calibrated);
+            statistics.process_frame(calibrated);
+        }
+
+        FrameView frame = calibrated;
+        {
+            TraceScope trace("register", view.sequence);
+            registration.apply(calibrated, registered_frame, frame);
+        }
+
+        capture_session.process_frame(frame);
+
+        TraceScope stack_trace("stage_stack", view.sequence);
+        stacker.process_frame(frame);
+    });
+
     auto cameras = camera->get_cameras();
     for(auto s = 0; s < cameras.size(); s++) {
         printf("name: %s\n", cameras[s].c_str());
@@ -56,17 +122,75 @@ MainWindow::MainWindow(QWidget *parent) :
         ui->camera_list->setItem(idx, 0, new QTableWidgetItem(QString::fromStdString(cameras[i])));
     }
 
+    QStringList latency_header = {"Stage", "Count", "p50 ms", "p99 ms", "Max ms"};
+    ui->latency_table->setColumnCount(latency_header.size());
+    ui->latency_table->setHorizontalHeaderLabels(latency_header);
+    ui->latency_table->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeMode::ResizeToContents);
+    ui->latency_table->verticalHeader()->setVisible(false);
+    ui->latency_table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+
+    ui->latency_table->setRowCount(int(LatencyStage::Count));
+    for(int i = 0; i < int(LatencyStage::Count); i++) {
+        ui->latency_table->setItem(i, 0, new QTableWidgetItem(latency_stage_name(LatencyStage(i))));
+        for(int column = 1; column < int(latency_header.size()); column++) {
+            ui->latency_table->setItem(i, column, new QTableWidgetItem("-"));
+        }
+    }
+    ui->trace_enabled->setChecked(tracing_enabled);
+
     temperature_info = new QLabel("Sensor Temperature: ", this);
     temperature_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
 
     sequence_info = new QLabel("Sequence: 0", this);
     sequence_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
 
+    writer_info = new QLabel("Writer: idle", this);
+    writer_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+
+    capture_info = new QLabel("Capture: idle", this);
+    capture_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+
+    stack_info = new QLabel("Stack: idle", this);
+    stack_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+
+    focus_info = new QLabel("Focus: drag a region", this);
+    focus_info->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+
     statusBar()->addPermanentWidget(temperature_info, 1);
     statusBar()->addPermanentWidget(sequence_info, 1);
+    statusBar()->addPermanentWidget(writer_info, 1);
+    statusBar()->addPermanentWidget(capture_info, 1);
+    statusBar()->addPermanentWidget(stack_info, 1);
+    statusBar()->addPermanentWidget(focus_info, 1);
+
+    // Star detection runs on the selected region of every frame
+    connect(ui->view, &LiveView::roi_changed, this, [this](int x, int y, int width, int height) {
+        if(width > 0 && height > 0) {
+            star_detector.set_roi({x, y, width, height});
+        } else {
+            star_detector.clear_roi();
+            focus_info->setText("Focus: drag a region");
+        }
+    });
+
+    playback_timer.setInterval(15);
+    QObject::connect(&playback_timer, &QTimer::timeout, this, &MainWindow::update_playback);
 }
 
-MainWindow::~MainWindow() { camera->uninitialize(); }
+MainWindow::~MainWindow() {
+    // A master still being built finishes first, its completion is dropped along with the window
+    if(master_worker.joinable()) {
+        master_worker.join();
+    }
+
+    camera->set_frame_callback(nullptr);
+    playback_timer.stop();
+    playback.close();
+    capture_session.cancel();
+    stacker.stop();
+    writer_pool.stop();
+    camera->uninitialize();
+}
 
 void MainWindow::closeEvent(QCloseEvent *event) {
     // Prompt are you sure you want to continue?
@@ -141,29 +265,53 @@ void MainWindow::on_pixel_format_currentIndexChanged(int index) {
 }
 
 void MainWindow::on_camera_gain_valueChanged() {
-    camera->analogue_gain = ui->camera_gain->value();
-    printf("Analogue Gain: %0.2f\n", camera->analogue_gain);
+    const float analogue_gain = ui->camera_gain->value();
+    camera->controls.set_analogue_gain(analogue_gain);
+    printf("Analogue Gain: %0.2f\n", analogue_gain);
 }
 
 void MainWindow::on_camera_exposure_valueChanged() {
     // Converting from milliseconds to microseconds;
-    camera->exposure_time = ui->camera_exposure->value() * 1000;
-    printf("Exposure Time: %i ms\n", camera->exposure_time);
+    const int32_t exposure_time = ui->camera_exposure->value() * 1000;
+    camera->controls.set_exposure_time(exposure_time);
+    printf("Exposure Time: %i microseconds\n", exposure_time);
 }
 
 void MainWindow::on_camera_brightness_valueChanged() {
-    camera->brightness = ui->camera_brightness->value();
-    printf("Brightness: %0.2f\n", camera->brightness);
+    camera->controls.set_brightness(ui->camera_brightness->value());
+    printf("Brightness: %0.2f\n", ui->camera_brightness->value());
 }
 
 void MainWindow::on_camera_contrast_valueChanged() {
-    camera->contrast = ui->camera_contrast->value();
-    printf("Contrast: %0.2f\n", camera->contrast);
+    camera->controls.set_contrast(ui->camera_contrast->value());
+    printf("Contrast: %0.2f\n", ui->camera_contrast->value());
 }
 
 void MainWindow::on_camera_saturation_valueChanged() {
-    camera->saturation = ui->camera_saturation->value();
-    printf("Saturation: %0.2f\n", camera->saturation);
+    camera->controls.set_saturation(ui->camera_saturation->value());
+    printf("Saturation: %0.2f\n", ui->camera_saturation->value());
+}
+
+void MainWindow::on_bracket_control_currentIndexChanged(int index) { update_bracket(); }
+
+void MainWindow::on_bracket_values_editingFinished() { update_bracket(); }
+
+void MainWindow::update_bracket() {
+    ControlSchedule schedule = {{}, true};
+
+    const int mode = ui->bracket_control->currentIndex();
+    if(mode != 0) {
+        const Control control = mode == 1 ? Control::ExposureTime : Control::AnalogueGain;
+        const auto values     = ui->bracket_values->text().toStdString();
+        if(!parse_control_schedule(control, values, schedule)) {
+            // Empty or unparsable stops bracketing rather than keep running a schedule the field no longer shows
+            printf("Bracket values \"%s\" not understood, bracketing off\n", values.c_str());
+            schedule.steps.clear();
+        }
+    }
+
+    camera->controls.set_schedule(schedule);
+    printf("Bracketing %zu steps\n", schedule.steps.size());
 }
 
 void MainWindow::on_configure_camera_clicked() {
@@ -178,15 +326,20 @@ void MainWindow::on_configure_camera_clicked() {
         return;
     }
 
-    if(camera->channels == 3) {
-        ui->view->set_texture_type(GL_RGB8UI);
-    }
+    camera->buffer_count = ui->buffer_count->value();
+    camera->configure_camera(pixel_format_index, pixel_format_size_index);
 
-    if(camera->channels == 4) {
-        ui->view->set_texture_type(GL_RGBA8UI);
-    }
+    // The view picks its texture type per upload, only the raw preview needs to know about the sensor
+    if(camera->raw_mode) {
+        static const std::vector<std::string> patterns = {"RGGB", "GRBG", "GBRG", "BGGR", "MONO"};
 
-    camera->configure_camera(pixel_format_index, pixel_format_size_index);
+        auto pattern = std::find(patterns.begin(), patterns.end(), camera->cfa_pattern);
+        if(pattern != patterns.end()) {
+            ui->raw_cfa->setCurrentIndex(int(pattern - patterns.begin()));
+        }
+
+        ui->raw_white->setValue((1 << camera->bit_depth) - 1);
+    }
 }
 
 void MainWindow::on_start_camera_clicked() {
@@ -211,6 +364,24 @@ void MainWindow::on_stop_camera_clicked() {
 
 void MainWindow::on_crosshair_clicked() { ui->view->set_crosshair_visible(ui->crosshair->isChecked()); }
 
+void MainWindow::on_stream_upload_clicked() { ui->view->set_streaming(ui->stream_upload->isChecked() ? 3 : 0); }
+
+void MainWindow::on_raw_cfa_currentIndexChanged(int index) {
+    if(index < 0) {
+        return;
+    }
+
+    ui->view->cfa_pattern = index;
+}
+
+void MainWindow::on_raw_black_valueChanged() { ui->view->black_point = ui->raw_black->value(); }
+
+void MainWindow::on_raw_white_valueChanged() { ui->view->white_point = ui->raw_white->value(); }
+
+void MainWindow::on_raw_gamma_valueChanged() { ui->view->gamma = ui->raw_gamma->value(); }
+
+void MainWindow::on_stretch_auto_clicked() { ui->view->stretch = ui->stretch_auto->isChecked(); }
+
 void MainWindow::on_capture_path_clicked() {
     auto directory = QFileDialog::getExistingDirectory().toStdString();
 
@@ -225,8 +396,8 @@ void MainWindow::on_capture_begin_clicked() {
     auto storage_path = ui->storage_path->text().toStdString();
     auto session_name = ui->session_name->text().toStdString();
     auto session_id   = ui->session_id->text().toStdString();
-    total_images      = ui->image_captures->value();
-    toss_frames       = ui->toss_first_frames->value();
+    auto total_images = ui->image_captures->value();
+    auto toss_frames  = ui->toss_first_frames->value();
 
     if(session_name.compare("") == 0 || session_id.compare("") == 0) {
         printf("Please specify session name and id.\n");
@@ -247,59 +418,508 @@ void MainWindow::on_capture_begin_clicked() {
 
     std::filesystem::create_directories(session_path);
 
-    begin_capture   = 1;
-    captured_images = 0;
+    // latency.csv covers this session only
+    reset_stage_latency();
+
+    // Anything still queued from the last session is written before the new settings take effect
+    writer_pool.stop();
+    // Captures never wait on a full queue, the camera thread can't be held up by the disk
+    const auto policy =
+        ui->writer_policy->currentIndex() == 0 ? QueueFullPolicy::DropNewest : QueueFullPolicy::DropOldest;
+    writer_pool.start(ui->writer_threads->value(), size_t(ui->writer_queue_size->value()) << 20, policy);
+
+    CaptureSettings settings;
+    settings.session_path  = session_path;
+    settings.format        = CaptureFormat(ui->capture_format->currentIndex());
+    settings.toss_frames   = toss_frames;
+    settings.total_images  = total_images;
+    settings.pixel_order   = camera->pixel_order;
+    settings.cfa_pattern   = camera->cfa_pattern;
+
+    settings.tiff            = default_tiff_settings();
+    settings.tiff.strip_rows = ui->tiff_strip_rows->value();
+    settings.tiff.predictor  = ui->tiff_predictor->isChecked() ? TiffPredictor::Horizontal : TiffPredictor::None;
+    capture_session.begin(settings);
+}
+
+void MainWindow::on_capture_cancel_clicked() { capture_session.cancel(); }
+
+void MainWindow::on_stack_begin_clicked() {
+    StackSettings settings;
+    settings.mode       = StackMode(ui->stack_mode->currentIndex());
+    settings.kappa      = ui->stack_kappa->value();
+    settings.min_frames = 5;
+
+    registration.reset();
+    stacker.start(settings);
+}
+
+void MainWindow::on_stack_end_clicked() { stacker.stop(); }
+
+void MainWindow::on_stack_align_clicked() { registration.set_enabled(ui->stack_align->isChecked()); }
+
+void MainWindow::on_stack_reference_clicked() { registration.reset(); }
+
+void MainWindow::build_master(const MasterType &type) {
+    if(master_worker.joinable()) {
+        return;
+    }
+
+    auto directory = QFileDialog::getExistingDirectory(this, "Session", QString::fromStdString(session_path));
+    if(directory.isEmpty()) {
+        return;
+    }
+
+    auto path   = directory.toStdString();
+    auto frames = list_session_frames(path);
+    if(frames.empty()) {
+        QMessageBox::warning(this, "Calibration", "No image_*.tif frames in the selected session.");
+        return;
+    }
+
+    CombineSettings settings;
+    settings.method        = CombineMethod(ui->calibration_combine->currentIndex());
+    settings.kappa         = 3.f;
+    settings.iterations    = 5;
+    settings.pixel_order   = camera->pixel_order;
+
+    // Combining reads every frame of the session, the window keeps running while the worker does it
+    ui->calibration_bias->setEnabled(false);
+    ui->calibration_dark->setEnabled(false);
+    ui->calibration_flat->setEnabled(false);
+    QApplication::setOverrideCursor(Qt::BusyCursor);
+
+    master_worker = std::thread([this, frames, type, settings, output = master_filename(path, type)]() {
+        const bool ok = calibration.build_master(frames, type, settings, output);
+        QMetaObject::invokeMethod(this, [this, ok]() { master_built(ok); }, Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::master_built(const bool &ok) {
+    if(master_worker.joinable()) {
+        master_worker.join();
+    }
+
+    QApplication::restoreOverrideCursor();
+    ui->calibration_bias->setEnabled(true);
+    ui->calibration_dark->setEnabled(true);
+    ui->calibration_flat->setEnabled(true);
+
+    if(!ok) {
+        QMessageBox::warning(this, "Calibration", "Unable to build the master, see the log for details.");
+    }
+}
+
+void MainWindow::on_calibration_bias_clicked() { build_master(MasterType::Bias); }
+
+void MainWindow::on_calibration_dark_clicked() { build_master(MasterType::Dark); }
+
+void MainWindow::on_calibration_flat_clicked() { build_master(MasterType::Flat); }
+
+void MainWindow::on_calibration_load_clicked() {
+    auto directory = QFileDialog::getExistingDirectory(this, "Masters", QString::fromStdString(session_path));
+    if(directory.isEmpty()) {
+        return;
+    }
+
+    if(calibration.load_session_masters(directory.toStdString()) == 0) {
+        QMessageBox::warning(this, "Calibration", "No master_*.tif files in the selected directory.");
+    }
+}
+
+void MainWindow::on_calibration_clear_clicked() { calibration.clear_masters(); }
+
+void MainWindow::on_calibration_enabled_clicked() { calibration.set_enabled(ui->calibration_enabled->isChecked()); }
+
+void MainWindow::on_playback_open_clicked() {
+    auto file = QFileDialog::getOpenFileName(this, "Open Capture", ui->storage_path->text(), "Captures (*.ser *.tif)");
+    if(file.isEmpty()) {
+        return;
+    }
+
+    const bool was_open = playback.is_open();
+    if(!playback.open(file.toStdString())) {
+        QMessageBox::warning(this, "Playback", "No frames could be read from the selected capture.");
+        if(was_open) {
+            ui->view->color_order = live_color_order;
+        }
+        on_playback_close_clicked();
+        return;
+    }
+
+    // Played back frames are stored red first, raw ones carry their own pattern
+    if(!was_open) {
+        live_color_order = ui->view->color_order;
+    }
+    ui->view->color_order = 0;
+
+    static const std::vector<std::string> patterns = {"RGGB", "GRBG", "GBRG", "BGGR", "MONO"};
+
+    auto pattern = std::find(patterns.begin(), patterns.end(), playback.cfa_pattern());
+    if(pattern != patterns.end()) {
+        ui->raw_cfa->setCurrentIndex(int(pattern - patterns.begin()));
+    }
+
+    PlaybackFrame first;
+    if(playback.frame(0, first) && first.channels == 1) {
+        ui->raw_white->setValue((1 << first.bit_depth) - 1);
+    }
+
+    playback_shown = -1;
+    ui->playback_frame->setRange(0, int(playback.frame_count() - 1));
+    ui->playback_frame->setValue(0);
+    ui->playback_frame->setEnabled(true);
+    ui->playback_close->setEnabled(true);
+
+    playback.seek(0);
+    playback_timer.start();
 }
 
-void MainWindow::on_capture_cancel_clicked() { begin_capture = 0; }
+void MainWindow::on_playback_close_clicked() {
+    playback_timer.stop();
+
+    if(playback.is_open()) {
+        playback.close();
+        ui->view->color_order = live_color_order;
+    }
+
+    playback_shown = -1;
+    ui->playback_frame->setEnabled(false);
+    ui->playback_close->setEnabled(false);
+    ui->playback_info->setText("Playback: closed");
+}
+
+void MainWindow::on_playback_frame_valueChanged(int value) { playback.seek(value); }
+
+void MainWindow::on_latency_reset_clicked() {
+    reset_stage_latency();
+    camera->controls.reset_lag();
+    latency_updated = {};
+}
+
+void MainWindow::on_trace_enabled_clicked() {
+    if(ui->trace_enabled->isChecked()) {
+        start_tracing();
+    } else {
+        stop_tracing();
+    }
+}
+
+void MainWindow::on_trace_save_clicked() {
+    auto filename = QFileDialog::getSaveFileName(
+        this, "Trace", QString::fromStdString(format("%s/trace.json", session_path.c_str())), "Trace (*.json)");
+    if(filename.isEmpty()) {
+        return;
+    }
+
+    // Saving ends the trace, the checkbox starts a fresh one
+    write_trace(filename.toStdString());
+    ui->trace_enabled->setChecked(false);
+}
+
+void MainWindow::on_latency_save_clicked() {
+    auto filename = QFileDialog::getSaveFileName(
+        this, "Latency", QString::fromStdString(format("%s/latency.csv", session_path.c_str())), "CSV (*.csv)");
+    if(filename.isEmpty()) {
+        return;
+    }
+
+    write_latency_csv(filename.toStdString());
+}
 
 void MainWindow::update_view() {
-    if(camera->sequence == current_sequence) {
+    FrameView view;
+    if(!camera->acquire_frame(view)) {
         return;
     }
 
-    current_sequence = camera->sequence;
+    current_sequence = view.sequence;
 
-    std::vector<uint8_t> buffer;
-    camera->get_image(buffer);
+    TraceScope trace("update_view", view.sequence);
 
-    if(begin_capture) {
-        if(captured_images < total_images + toss_frames) {
-            auto duplicate_buffer = buffer;
-            if(camera->channels == 3) {
-            }
-            if(camera->channels == 4) {
-                switch(ui->view->color_order) {
-                    case 3: {
-                        for(int64_t y = 0; y < camera->height; y++) {
-                            for(int64_t x = 0; x < camera->width; x++) {
-                                int64_t idx = (y * camera->width + x) * 4;
-                                std::swap(duplicate_buffer[idx + 0], duplicate_buffer[idx + 2]);
-                            }
-                        }
-                    } break;
-                }
-            }
+    if(view.timestamp != 0) {
+        stage_latency(LatencyStage::SensorToView).record(boottime_ns() - view.timestamp);
+    }
 
-            if(captured_images >= toss_frames) {
-                auto file = format("%s/image_%0.4i.tif", session_path.c_str(), captured_images);
-                write_tiff(file, camera->width, camera->height, camera->channels, duplicate_buffer);
-            }
+    // While stacking the view shows the stack as it builds and playback has the view to itself, in both cases the
+    // live frame only needs recycling
+    const bool show_stack = stacker.is_active();
+    const bool show_live  = !show_stack && !playback.is_open();
+
+    // The callback already calibrated this frame, or a newer one, the buffer stays ours until handed back below
+    std::unique_ptr<CalibratedFrame> calibrated;
+    {
+        std::lock_guard<std::mutex> lock(calibrated_mutex);
+        calibrated = std::move(calibrated_latest);
+    }
+
+    // The padded camera buffer goes to the texture as is, raw frames are debayered by the view's shader
+    if(show_live) {
+        FrameView frame = view;
+        if(calibrated && calibrated->view.sequence >= view.sequence) {
+            frame = calibrated->view;
+        }
+
+        if(frame.bit_depth == 8) {
+            ui->view->upload_buffer(frame.width, frame.height, frame.channels, frame.stride, frame.data);
+        } else if(!frame.packed) {
+            ui->view->upload_raw(
+                frame.width, frame.height, frame.stride, reinterpret_cast<const uint16_t *>(frame.data));
+        } else {
+            raw_preview.resize(size_t(frame.width) * frame.height);
+            unpack_raw(raw_preview.data(),
+                       frame.data,
+                       frame.width,
+                       frame.height,
+                       frame.stride,
+                       frame.bit_depth,
+                       frame.packed);
+
+            ui->view->upload_raw(frame.width, frame.height, frame.width * int(sizeof(uint16_t)), raw_preview.data());
+        }
+    }
+    camera->release_frame(view);
 
-            captured_images++;
+    if(calibrated) {
+        std::lock_guard<std::mutex> lock(calibrated_mutex);
+        calibrated_spare.push_back(std::move(calibrated));
+    }
 
-            printf("captured %i of %i\n", captured_images, total_images + toss_frames);
+    if(show_stack && stacker.get_result(stack_image)) {
+        if(stack_image.bit_depth == 8) {
+            ui->view->upload_buffer(stack_image.width,
+                                    stack_image.height,
+                                    stack_image.channels,
+                                    stack_image.width * stack_image.channels,
+                                    stack_image.pixels.data());
         } else {
-            printf("capture complete\n");
-            begin_capture = 0;
+            ui->view->upload_raw(stack_image.width,
+                                 stack_image.height,
+                                 stack_image.width * int(sizeof(uint16_t)),
+                                 reinterpret_cast<const uint16_t *>(stack_image.pixels.data()));
         }
     }
 
     // Update info
     temperature_info->setText(QString::fromStdString(
         format("Sensor Temperature: %0.2fC  %0.2fF", camera->temperature, (camera->temperature * 9 / 5) + 32.f)));
-    sequence_info->setText(QString::fromStdString(format("Sequence: %lld", camera->sequence)));
+    auto upload = ui->view->upload_stats();
+    sequence_info->setText(QString::fromStdString(format("Sequence: %lld  Upload: %0.2f ms (avg %0.2f, max %0.2f)",
+                                                         camera->sequence,
+                                                         upload.last_ms,
+                                                         upload.average_ms,
+                                                         upload.max_ms)));
+
+    if(writer_pool.is_running()) {
+        auto stats = writer_pool.stats();
+        writer_info->setText(QString::fromStdString(format("Writer: %zu queued (%0.1f MB)  %0.1f MB/s  %lld dropped",
+                                                           stats.queued_frames,
+                                                           stats.queued_bytes / double(1 << 20),
+                                                           stats.mb_per_second,
+                                                           (long long)stats.dropped_frames)));
+    }
+
+    auto capture = capture_session.stats();
+    if(capture.active || capture.saved_frames > 0) {
+        capture_info->setText(QString::fromStdString(format("Capture: %lld/%i saved  %lld skipped  %lld rejected",
+                                                            (long long)capture.saved_frames,
+                                                            capture.total_images,
+                                                            (long long)capture.skipped_frames,
+                                                            (long long)capture.rejected_frames)));
+    }
+
+    auto stack = stacker.stats();
+    if(stack.active || stack.stacked_frames > 0) {
+        auto text = format("Stack: %lld frames  %0.1f ms  %lld dropped",
+                           (long long)stack.stacked_frames,
+                           stack.stack_ms,
+                           (long long)stack.dropped_frames);
+
+        if(registration.is_enabled()) {
+            auto shift = registration.stats();
+            text += format("  shift %0.2f,%0.2f (%0.2f) %0.1f ms", shift.dx, shift.dy, shift.peak, shift.register_ms);
+        }
+
+        stack_info->setText(QString::fromStdString(text));
+    }
+
+    if(star_detector.has_roi()) {
+        auto focus = star_detector.result();
+
+        std::vector<glm::vec2> markers;
+        for(auto &star : focus.stars) {
+            markers.emplace_back(star.x, star.y);
+        }
+        ui->view->set_star_markers(markers);
+
+        focus_info->setText(QString::fromStdString(format("Focus: %zu stars  HFR %0.2f  FWHM %0.2f px  %0.1f ms",
+                                                          focus.stars.size(),
+                                                          focus.median_hfr,
+                                                          focus.median_fwhm,
+                                                          focus.detect_ms)));
+    }
+
+    // Frames still queued when the capture finishes are part of the session, wait for them before saving
+    if(capture.active) {
+        latency_pending = true;
+    } else if(latency_pending && writer_pool.stats().queued_frames == 0) {
+        write_latency_csv(format("%s/latency.csv", session_path.c_str()));
+        latency_pending = false;
+    }
+
+    update_statistics();
+    update_latency();
 
-    ui->view->set_buffer(camera->width, camera->height, camera->channels, buffer);
     ui->view->repaint();
 }
+
+void MainWindow::update_playback() {
+    const int64_t index = ui->playback_frame->value();
+
+    PlaybackFrame frame;
+    if(index != playback_shown && playback.try_frame(index, frame)) {
+        if(frame.channels == 1) {
+            ui->view->upload_raw(
+                frame.width, frame.height, frame.stride, reinterpret_cast<const uint16_t *>(frame.data));
+        } else {
+            ui->view->upload_buffer(frame.width, frame.height, frame.channels, frame.stride, frame.data);
+        }
+        playback_shown = index;
+
+        ui->view->repaint();
+    }
+
+    auto stats = playback.stats();
+    auto text  = format("Frame %lld/%lld%s  decode %0.1f ms (avg %0.1f)  %zu cached",
+                       (long long)index + 1,
+                       (long long)playback.frame_count(),
+                       index == playback_shown ? "" : " (loading)",
+                       stats.decode_ms,
+                       stats.average_decode_ms,
+                       stats.cached_frames);
+    ui->playback_info->setText(QString::fromStdString(text));
+}
+
+void MainWindow::update_statistics() {
+    if(!statistics.latest(latest_stats) || latest_stats.channels == 0) {
+        return;
+    }
+
+    const bool raw = latest_stats.bit_depth > 8;
+
+    // Which stats channels feed display red, green and blue, raw greens are the two remaining sites of the tile
+    std::vector<std::vector<int>> sources(3);
+    if(raw) {
+        const int pattern = ui->view->cfa_pattern;
+        if(pattern == 4) {
+            sources = {{0, 1, 2, 3}, {0, 1, 2, 3}, {0, 1, 2, 3}};
+        } else {
+            const int red  = (pattern >= 2 ? 2 : 0) + (pattern == 1 || pattern == 3 ? 1 : 0);
+            const int blue = 3 - red;
+            for(int site = 0; site < 4; site++) {
+                sources[site == red ? 0 : site == blue ? 2 : 1].push_back(site);
+            }
+        }
+    } else {
+        const int order = ui->view->color_order;
+        if(latest_stats.channels == 4 && order == 2) {
+            sources = {{3}, {2}, {1}};
+        } else if(order != 0) {
+            sources = {{2}, {1}, {0}};
+        } else {
+            sources = {{0}, {1}, {2}};
+        }
+    }
+
+    // Stretch in the shader's normalized domain, raw samples go through the black and white points first
+    const float black = raw ? ui->view->black_point : 0.f;
+    const float range = raw ? std::max(ui->view->white_point - ui->view->black_point, 1.f) : 255.f;
+    const float full  = float((1 << latest_stats.bit_depth) - 1);
+
+    const QColor display_colors[3] = {QColor(230, 70, 70), QColor(80, 210, 80), QColor(80, 120, 240)};
+    const char *display_names[3]   = {"R", "G", "B"};
+
+    std::vector<QColor> colors(latest_stats.channels, QColor(200, 200, 200));
+    std::vector<float> shadow_markers, midtone_markers;
+    glm::vec3 shadows(0.f), midtones(0.5f);
+    std::string text;
+
+    for(int d = 0; d < 3; d++) {
+        float median = 0, mad = 0, minimum = full, maximum = 0, mean = 0;
+        int64_t low = 0, high = 0;
+        for(auto c : sources[d]) {
+            if(c >= latest_stats.channels) {
+                continue;
+            }
+
+            const auto &channel = latest_stats.channel[c];
+            median += channel.median / sources[d].size();
+            mad += channel.mad / sources[d].size();
+            mean += float(channel.mean) / sources[d].size();
+            minimum = std::min(minimum, float(channel.min));
+            maximum = std::max(maximum, float(channel.max));
+            low += channel.clipped_low;
+            high += channel.clipped_high;
+
+            colors[c] = display_colors[d];
+        }
+
+        const Stretch stretch = auto_stretch((median - black) / range, mad / range, 2.8f, 0.25f);
+        shadows[d]            = stretch.shadows;
+        midtones[d]           = stretch.midtones;
+
+        // Markers on the histogram's full scale axis, the midtones marker is the input that maps to half brightness
+        shadow_markers.push_back((black + stretch.shadows * range) / full);
+        midtone_markers.push_back((black + (stretch.shadows + stretch.midtones * (1.f - stretch.shadows)) * range) / full);
+
+        text += format("%s  min %0.0f  max %0.0f  mean %0.1f  median %0.0f  MAD %0.1f  clipped %lld/%lld\n",
+                       display_names[d],
+                       minimum,
+                       maximum,
+                       mean,
+                       median,
+                       mad,
+                       (long long)low,
+                       (long long)high);
+    }
+    text += format("%lld samples  %0.1f ms", (long long)latest_stats.samples, latest_stats.compute_ms);
+
+    ui->view->stretch_shadows  = shadows;
+    ui->view->stretch_midtones = midtones;
+
+    ui->histogram->set_stats(latest_stats, colors);
+    ui->histogram->set_markers(shadow_markers, midtone_markers);
+    ui->frame_stats->setText(QString::fromStdString(text));
+}
+
+void MainWindow::update_latency() {
+    const auto now = std::chrono::steady_clock::now();
+    if(now - latency_updated < std::chrono::milliseconds(500)) {
+        return;
+    }
+    latency_updated = now;
+
+    for(int i = 0; i < int(LatencyStage::Count); i++) {
+        auto s = stage_latency(LatencyStage(i)).summary();
+
+        const bool empty = s.count == 0;
+        ui->latency_table->item(i, 1)->setText(empty ? "-" : QString::number(s.count));
+        ui->latency_table->item(i, 2)->setText(empty ? "-" : QString::number(s.p50_ms, 'f', 2));
+        ui->latency_table->item(i, 3)->setText(empty ? "-" : QString::number(s.p99_ms, 'f', 2));
+        ui->latency_table->item(i, 4)->setText(empty ? "-" : QString::number(s.max_ms, 'f', 2));
+    }
+
+    // Frames from the request carrying a change to the first frame the sensor reports it on
+    std::string text = "Control lag:";
+    for(const Control &control : {Control::ExposureTime, Control::AnalogueGain}) {
+        auto lag = camera->controls.lag(control);
+        text += lag.count == 0 ? format("  %s -", control_name(control))
+                               : format("  %s %i frames (mean %0.1f, max %i, %lld missed)",
+                                        control_name(control),
+                                        lag.last_frames,
+                                        lag.mean_frames,
+                                        lag.max_frames,
+                                        (long long)lag.missed);
+    }
+    ui->control_lag->setText(QString::fromStdString(text));
+}
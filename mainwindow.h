@@ -6,7 +6,19 @@
 #include <QTableWidget>
 #include <QTimer>
 
-#include "camera.h"
+#include <mutex>
+#include <thread>
+
+#include "calibration.h"
+#include "capture.h"
+#include "frame_source.h"
+#include "latency.h"
+#include "playback.h"
+#include "registration.h"
+#include "stacker.h"
+#include "stars.h"
+#include "statistics.h"
+#include "writer_pool.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -20,12 +32,15 @@ class MainWindow : public QMainWindow {
     Q_OBJECT
 
   public:
-    MainWindow(QWidget *parent = nullptr);
+    //! The window drives source, the camera or a software source chosen on the command line.
+    MainWindow(std::unique_ptr<FrameSource> source, QWidget *parent = nullptr);
     ~MainWindow();
 
     void closeEvent(QCloseEvent *event);
 
     void update_view();
+    //! Shows the playback frame under the slider once the background reader has it.
+    void update_playback();
 
   private Q_SLOTS:
     void on_connect_camera_clicked();
@@ -38,6 +53,8 @@ class MainWindow : public QMainWindow {
     void on_camera_brightness_valueChanged();
     void on_camera_contrast_valueChanged();
     void on_camera_saturation_valueChanged();
+    void on_bracket_control_currentIndexChanged(int index);
+    void on_bracket_values_editingFinished();
 
     void on_configure_camera_clicked();
 
@@ -45,23 +62,102 @@ class MainWindow : public QMainWindow {
     void on_stop_camera_clicked();
 
     void on_crosshair_clicked();
+    void on_stream_upload_clicked();
+
+    void on_raw_cfa_currentIndexChanged(int index);
+    void on_raw_black_valueChanged();
+    void on_raw_white_valueChanged();
+    void on_raw_gamma_valueChanged();
+    void on_stretch_auto_clicked();
 
     void on_capture_path_clicked();
     void on_capture_begin_clicked();
     void on_capture_cancel_clicked();
 
+    void on_stack_begin_clicked();
+    void on_stack_end_clicked();
+    void on_stack_align_clicked();
+    void on_stack_reference_clicked();
+
+    void on_calibration_bias_clicked();
+    void on_calibration_dark_clicked();
+    void on_calibration_flat_clicked();
+    void on_calibration_load_clicked();
+    void on_calibration_clear_clicked();
+    void on_calibration_enabled_clicked();
+
+    void on_playback_open_clicked();
+    void on_playback_close_clicked();
+    void on_playback_frame_valueChanged(int value);
+
+    void on_latency_reset_clicked();
+    void on_latency_save_clicked();
+    void on_trace_enabled_clicked();
+    void on_trace_save_clicked();
+
   private:
+    //! Combines the session on a worker, the result is reported back on the GUI thread.
+    void build_master(const MasterType &type);
+    void master_built(const bool &ok);
+    //! Histogram, statistics text and auto stretch from the latest frame statistics.
+    void update_statistics();
+    //! Stage latency table, refreshed twice a second.
+    void update_latency();
+    //! Hands the bracket settings to the camera as a repeating schedule, or stops it.
+    void update_bracket();
+
     std::unique_ptr<Ui::MainWindow> ui;
-    std::unique_ptr<Camera> camera;
+    std::unique_ptr<FrameSource> camera;
 
-    int begin_capture;
-    int toss_frames;
-    int captured_images;
-    int total_images;
     int current_sequence;
     std::string session_path;
     QLabel *temperature_info;
     QLabel *sequence_info;
+    QLabel *writer_info;
+    QLabel *capture_info;
+    QLabel *stack_info;
+    QLabel *focus_info;
+
+    //! Packed raw frames are unpacked here before going to the view.
+    std::vector<uint16_t> raw_preview;
+
+    WriterPool writer_pool;
+    CaptureSession capture_session;
+
+    LiveStacker stacker;
+    StackImage stack_image;
+
+    Calibration calibration;
+    std::thread master_worker;
+
+    //! A frame the callback calibrated, kept so the view shows it without calibrating again.
+    struct CalibratedFrame {
+        FrameView view;
+        std::vector<uint8_t> pixels;
+    };
+    //! Calibrated buffers pass between the camera thread and the view under this lock, the pixels never do.
+    std::mutex calibrated_mutex;
+    //! Newest calibrated frame the view hasn't taken yet.
+    std::unique_ptr<CalibratedFrame> calibrated_latest;
+    std::vector<std::unique_ptr<CalibratedFrame>> calibrated_spare;
+
+    Registration registration;
+    std::vector<uint8_t> registered_frame;
+
+    StarDetector star_detector;
+
+    FrameStatistics statistics;
+    FrameStats latest_stats;
+
+    SessionPlayback playback;
+    int64_t playback_shown;
+    //! The camera's color order, put back when playback closes.
+    int live_color_order;
+    QTimer playback_timer;
+
+    std::chrono::steady_clock::time_point latency_updated;
+    //! Set while a capture runs, the session's latency.csv is written once its frames are.
+    bool latency_pending;
 
     QTimer view_idle_timer;
 };
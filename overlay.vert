@@ -0,0 +1,14 @@
+#version 130
+
+in vec2 position;
+in vec3 color;
+
+uniform mat4 mvp;
+
+flat out vec3 line_color;
+
+void main()
+{
+	line_color = color;
+	gl_Position = mvp * vec4(position, 0.0, 1.0);
+}
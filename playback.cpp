@@ -0,0 +1,405 @@
+#include "playback.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "tiff.h"
+#include "trace.h"
+
+namespace {
+// Single channel frames are shown through the raw path, which takes 16-bit samples
+void widen(std::vector<uint8_t> &buffer) {
+    std::vector<uint8_t> wide(buffer.size() * sizeof(uint16_t));
+    auto samples = reinterpret_cast<uint16_t *>(wide.data());
+    for(size_t i = 0; i < buffer.size(); i++) {
+        samples[i] = buffer[i];
+    }
+    buffer.swap(wide);
+}
+
+const char *ser_cfa(const SerColor &color) {
+    switch(color) {
+        case SerColor::BayerRGGB:
+            return "RGGB";
+        case SerColor::BayerGRBG:
+            return "GRBG";
+        case SerColor::BayerGBRG:
+            return "GBRG";
+        case SerColor::BayerBGGR:
+            return "BGGR";
+        default:
+            return "MONO";
+    }
+}
+} // namespace
+
+SessionPlayback::SessionPlayback() :
+    frame_total(0), width(0), height(0), channels(0), bit_depth(8), ser_fd(-1), mapping(nullptr), mapping_size(0),
+    direct(false), cache_frames(32), prefetch_frames(16), playhead(0), direction(1), playhead_moved(false),
+    stopping(false), decoded_frames(0), decode_ms(0), total_decode_ms(0) {}
+
+SessionPlayback::~SessionPlayback() { close(); }
+
+bool SessionPlayback::open(const std::string &path) {
+    close();
+
+    namespace fs = std::filesystem;
+
+    std::error_code error;
+    fs::path session = path;
+    if(!fs::is_directory(session, error) && session.extension() != ".ser") {
+        session = session.parent_path();
+    }
+
+    if(session.extension() == ".ser") {
+        ser_fd = ::open(session.c_str(), O_RDONLY);
+        if(ser_fd < 0) {
+            printf("Unable to open %s: %s\n", session.c_str(), strerror(errno));
+            return false;
+        }
+
+        struct stat info;
+        if(fstat(ser_fd, &info) != 0 || size_t(info.st_size) < ser_header_size) {
+            printf("Not a SER file (%s)\n", session.c_str());
+            close();
+            return false;
+        }
+
+        mapping_size = size_t(info.st_size);
+        void *map    = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, ser_fd, 0);
+        if(map == MAP_FAILED) {
+            printf("Unable to map %s: %s\n", session.c_str(), strerror(errno));
+            mapping_size = 0;
+            close();
+            return false;
+        }
+        mapping = static_cast<const uint8_t *>(map);
+
+        if(!parse_ser_header(mapping, mapping_size, ser)) {
+            printf("Not a SER file (%s)\n", session.c_str());
+            close();
+            return false;
+        }
+
+        // An interrupted capture never got its frame count, whatever made it to disk is still playable
+        const int64_t available = int64_t((mapping_size - ser_header_size) / ser_frame_bytes(ser));
+        frame_total             = ser.frames > 0 ? std::min(ser.frames, available) : available;
+
+        const bool color = ser.color == SerColor::RGB || ser.color == SerColor::BGR;
+        width            = ser.width;
+        height           = ser.height;
+        channels         = color ? 3 : 1;
+        bit_depth        = ser.bit_depth;
+        cfa              = ser_cfa(ser.color);
+        direct           = (ser.color == SerColor::RGB && ser.bit_depth <= 8) || (!color && ser.bit_depth > 8);
+    } else {
+        std::vector<std::pair<int64_t, std::string>> numbered;
+        for(const auto &entry : fs::directory_iterator(session, error)) {
+            const auto name = entry.path().filename().string();
+            if(name.size() > 10 && name.compare(0, 6, "image_") == 0 && entry.path().extension() == ".tif") {
+                numbered.emplace_back(std::atoll(name.c_str() + 6), entry.path().string());
+            }
+        }
+
+        // Numbered rather than named order, past 9999 frames the names stop sorting
+        std::sort(numbered.begin(), numbered.end());
+        for(auto &file : numbered) {
+            files.push_back(file.second);
+        }
+
+        if(files.empty()) {
+            printf("No image_*.tif frames in %s\n", session.c_str());
+            return false;
+        }
+
+        // Frame 0 sets the geometry every other frame is checked against
+        auto first = std::make_shared<std::vector<uint8_t>>();
+        if(!read_tiff(files[0], width, height, channels, bit_depth, cfa, *first)) {
+            files.clear();
+            return false;
+        }
+
+        if(channels == 1 && bit_depth <= 8) {
+            widen(*first);
+        }
+
+        frame_total = int64_t(files.size());
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        insert(0, first);
+    }
+
+    // Nothing to prefetch or seek through, an empty capture is not a playable session
+    if(frame_total <= 0) {
+        printf("No frames in %s\n", session.c_str());
+        close();
+        return false;
+    }
+
+    printf("Playback %s: %lld frames %ix%i\n", session.c_str(), (long long)frame_total, width, height);
+
+    stopping       = false;
+    playhead       = 0;
+    direction      = 1;
+    playhead_moved = true;
+    worker         = std::thread(&SessionPlayback::prefetch_loop, this);
+
+    return true;
+}
+
+void SessionPlayback::close() {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        stopping = true;
+    }
+    prefetch_cv.notify_all();
+
+    if(worker.joinable()) {
+        worker.join();
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.clear();
+    lru.clear();
+    files.clear();
+
+    if(mapping) {
+        munmap(const_cast<uint8_t *>(mapping), mapping_size);
+        mapping = nullptr;
+    }
+    mapping_size = 0;
+
+    if(ser_fd >= 0) {
+        ::close(ser_fd);
+        ser_fd = -1;
+    }
+
+    frame_total     = 0;
+    direct          = false;
+    decoded_frames  = 0;
+    decode_ms       = 0;
+    total_decode_ms = 0;
+}
+
+void SessionPlayback::set_cache(const int &frames, const int &prefetch) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_frames    = std::max(frames, 2);
+    prefetch_frames = std::clamp(prefetch, 0, cache_frames - 1);
+}
+
+void SessionPlayback::seek(const int64_t &index) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if(index != playhead) {
+            direction = index > playhead ? 1 : -1;
+        }
+        playhead       = std::clamp<int64_t>(index, 0, std::max<int64_t>(frame_total - 1, 0));
+        playhead_moved = true;
+    }
+    prefetch_cv.notify_one();
+}
+
+bool SessionPlayback::try_frame(const int64_t &index, PlaybackFrame &frame) {
+    if(index < 0 || index >= frame_total) {
+        return false;
+    }
+
+    if(direct) {
+        return mapped_frame(index, frame);
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return cached_frame(index, frame);
+}
+
+bool SessionPlayback::frame(const int64_t &index, PlaybackFrame &frame) {
+    if(try_frame(index, frame)) {
+        return true;
+    }
+
+    if(index < 0 || index >= frame_total) {
+        return false;
+    }
+
+    auto storage = decode(index);
+    if(!storage) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    insert(index, storage);
+    return cached_frame(index, frame);
+}
+
+PlaybackStats SessionPlayback::stats() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    PlaybackStats s;
+    s.cached_frames     = cache.size();
+    s.decoded_frames    = decoded_frames;
+    s.decode_ms         = decode_ms;
+    s.average_decode_ms = decoded_frames > 0 ? total_decode_ms / decoded_frames : 0;
+
+    return s;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> SessionPlayback::decode(const int64_t &index) {
+    TraceScope trace("decode", index);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    auto buffer = std::make_shared<std::vector<uint8_t>>();
+
+    if(mapping) {
+        const size_t frame_bytes = ser_frame_bytes(ser);
+        const uint8_t *src       = mapping + ser_header_size + frame_bytes * size_t(index);
+
+        if(ser.color == SerColor::BGR && ser.bit_depth <= 8) {
+            buffer->resize(frame_bytes);
+            convert_rows(
+                buffer->data(), width * 3, src, width * 3, width, height, PixelOrder::BGR888, StoreFormat::RGB8);
+        } else {
+            buffer->assign(src, src + frame_bytes);
+            if(ser.bit_depth <= 8) {
+                widen(*buffer);
+            }
+        }
+    } else {
+        int w = 0, h = 0, c = 0, depth = 0;
+        std::string pattern;
+        if(!read_tiff(files[index], w, h, c, depth, pattern, *buffer)) {
+            return nullptr;
+        }
+
+        if(w != width || h != height || c != channels) {
+            printf("Frame %s doesn't match the session (%ix%ix%i)\n", files[index].c_str(), width, height, channels);
+            return nullptr;
+        }
+
+        if(c == 1 && depth <= 8) {
+            widen(*buffer);
+        }
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    decoded_frames++;
+    decode_ms = ms;
+    total_decode_ms += ms;
+
+    return buffer;
+}
+
+bool SessionPlayback::mapped_frame(const int64_t &index, PlaybackFrame &frame) {
+    const size_t frame_bytes = ser_frame_bytes(ser);
+
+    frame.index     = index;
+    frame.width     = width;
+    frame.height    = height;
+    frame.channels  = channels;
+    frame.stride    = int(frame_bytes / height);
+    frame.bit_depth = bit_depth;
+    frame.data      = mapping + ser_header_size + frame_bytes * size_t(index);
+    frame.storage.reset();
+
+    return true;
+}
+
+bool SessionPlayback::cached_frame(const int64_t &index, PlaybackFrame &frame) {
+    auto itr = cache.find(index);
+    if(itr == cache.end()) {
+        return false;
+    }
+
+    lru.splice(lru.begin(), lru, itr->second.second);
+
+    frame.index     = index;
+    frame.width     = width;
+    frame.height    = height;
+    frame.channels  = channels;
+    frame.stride    = width * (channels == 1 ? int(sizeof(uint16_t)) : channels);
+    frame.bit_depth = bit_depth;
+    frame.storage   = itr->second.first;
+    frame.data      = frame.storage->data();
+
+    return true;
+}
+
+void SessionPlayback::insert(const int64_t &index, std::shared_ptr<const std::vector<uint8_t>> storage) {
+    if(cache.count(index)) {
+        return;
+    }
+
+    while(!lru.empty() && cache.size() >= size_t(cache_frames)) {
+        cache.erase(lru.back());
+        lru.pop_back();
+    }
+
+    lru.push_front(index);
+    cache[index] = std::make_pair(std::move(storage), lru.begin());
+}
+
+void SessionPlayback::prefetch_loop() {
+    set_thread_name("playback");
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+
+    while(true) {
+        prefetch_cv.wait(lock, [&] { return stopping || playhead_moved; });
+        if(stopping) {
+            break;
+        }
+        playhead_moved = false;
+
+        const int64_t start = playhead;
+        const int step      = direction;
+        const int ahead     = prefetch_frames;
+
+        // Mapped frames need no decoding, paging the window in keeps the UI thread off the disk
+        if(direct) {
+            const int64_t first      = std::clamp<int64_t>(step > 0 ? start : start - ahead, 0, frame_total - 1);
+            const int64_t last       = std::clamp<int64_t>(step > 0 ? start + ahead : start, 0, frame_total - 1);
+            const size_t frame_bytes = ser_frame_bytes(ser);
+            const size_t page        = size_t(sysconf(_SC_PAGESIZE));
+
+            const size_t begin = (ser_header_size + frame_bytes * size_t(first)) / page * page;
+            const size_t end   = std::min(ser_header_size + frame_bytes * size_t(last + 1), mapping_size);
+            madvise(const_cast<uint8_t *>(mapping) + begin, end - begin, MADV_WILLNEED);
+            continue;
+        }
+
+        // The playhead frame first, then ahead of it until the window is cached or the playhead moves again
+        for(int i = 0; i <= ahead && !playhead_moved && !stopping; i++) {
+            const int64_t index = start + int64_t(i) * step;
+            if(index < 0 || index >= frame_total) {
+                break;
+            }
+
+            // Frames already cached are touched so the rest of the window can't push them out
+            auto itr = cache.find(index);
+            if(itr != cache.end()) {
+                lru.splice(lru.begin(), lru, itr->second.second);
+                continue;
+            }
+
+            lock.unlock();
+            auto storage = decode(index);
+            lock.lock();
+
+            if(storage) {
+                insert(index, std::move(storage));
+            }
+        }
+    }
+}
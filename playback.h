@@ -0,0 +1,115 @@
+#ifndef _playback_h_
+#define _playback_h_
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ser.h"
+
+struct PlaybackFrame {
+    int64_t index;
+
+    int width;
+    int height;
+    //! 3 or 4 channel frames are 8-bit red first, single channel frames are 16-bit samples holding bit_depth bits.
+    int channels;
+    int stride;
+    int bit_depth;
+
+    const uint8_t *data;
+    //! Keeps a decoded frame alive after the cache lets go of it, empty for frames served from a mapping.
+    std::shared_ptr<const std::vector<uint8_t>> storage;
+};
+
+struct PlaybackStats {
+    size_t cached_frames;
+    int64_t decoded_frames;
+
+    double decode_ms;
+    double average_decode_ms;
+};
+
+//! Reviews a finished capture, either a directory of image_NNNN.tif frames or a SER video. A background thread
+//! decodes the playhead frame and reads ahead in the direction it last moved into an LRU cache. SER frames that are
+//! already in a displayable layout come straight out of a read-only mapping and are only paged in ahead of time.
+class SessionPlayback {
+  public:
+    SessionPlayback();
+    ~SessionPlayback();
+
+    //! A capture directory, any frame inside one, or a .ser file.
+    bool open(const std::string &path);
+    void close();
+
+    bool is_open() const { return frame_total > 0; }
+    int64_t frame_count() const { return frame_total; }
+    const std::string &cfa_pattern() const { return cfa; }
+
+    //! Decoded frames kept in memory and how many frames past the playhead are read ahead, less than frames.
+    void set_cache(const int &frames, const int &prefetch);
+
+    //! Moves the playhead and returns at once, the background thread decodes index first.
+    void seek(const int64_t &index);
+
+    //! The frame if it is decoded, never blocks.
+    bool try_frame(const int64_t &index, PlaybackFrame &frame);
+    //! Decodes on the calling thread when the frame isn't cached.
+    bool frame(const int64_t &index, PlaybackFrame &frame);
+
+    PlaybackStats stats();
+
+  private:
+    std::shared_ptr<const std::vector<uint8_t>> decode(const int64_t &index);
+    bool mapped_frame(const int64_t &index, PlaybackFrame &frame);
+    bool cached_frame(const int64_t &index, PlaybackFrame &frame);
+    void insert(const int64_t &index, std::shared_ptr<const std::vector<uint8_t>> storage);
+
+    void prefetch_loop();
+
+    int64_t frame_total;
+
+    int width;
+    int height;
+    int channels;
+    int bit_depth;
+    std::string cfa;
+
+    //! TIFF sessions, ordered by frame number.
+    std::vector<std::string> files;
+
+    //! SER sessions, direct is set when frames can be shown from the mapping without decoding.
+    int ser_fd;
+    const uint8_t *mapping;
+    size_t mapping_size;
+    SerHeader ser;
+    bool direct;
+
+    std::mutex cache_mutex;
+    std::condition_variable prefetch_cv;
+
+    std::list<int64_t> lru;
+    std::unordered_map<int64_t, std::pair<std::shared_ptr<const std::vector<uint8_t>>, std::list<int64_t>::iterator>>
+        cache;
+    int cache_frames;
+    int prefetch_frames;
+
+    int64_t playhead;
+    int direction;
+    bool playhead_moved;
+    bool stopping;
+
+    int64_t decoded_frames;
+    double decode_ms;
+    double total_decode_ms;
+
+    std::thread worker;
+};
+
+#endif
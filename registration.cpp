@@ -0,0 +1,345 @@
+#include "registration.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+#include "unpack.h"
+
+// Bilinear weights are in 1/16 pixel steps, w00 + w01 + w10 + w11 = 256. Only the whole pixel case has a weight of
+// 256, and that one is a plain copy, so every weight fits in a byte and the sum of four products fits 16 bits.
+static const int subpixel_steps = 16;
+
+static void bilinear_row(uint8_t *dst,
+                         const uint8_t *a,
+                         const uint8_t *b,
+                         const int &bytes,
+                         const int &next,
+                         const uint8_t w[4]) {
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const uint8x8_t w00 = vdup_n_u8(w[0]);
+    const uint8x8_t w01 = vdup_n_u8(w[1]);
+    const uint8x8_t w10 = vdup_n_u8(w[2]);
+    const uint8x8_t w11 = vdup_n_u8(w[3]);
+
+    for(; i + 8 <= bytes; i += 8) {
+        uint16x8_t sum = vmull_u8(vld1_u8(a + i), w00);
+        sum            = vmlal_u8(sum, vld1_u8(a + i + next), w01);
+        sum            = vmlal_u8(sum, vld1_u8(b + i), w10);
+        sum            = vmlal_u8(sum, vld1_u8(b + i + next), w11);
+
+        vst1_u8(dst + i, vrshrn_n_u16(sum, 8));
+    }
+#endif
+
+    for(; i < bytes; i++) {
+        dst[i] = uint8_t((a[i] * w[0] + a[i + next] * w[1] + b[i] * w[2] + b[i + next] * w[3] + 128) >> 8);
+    }
+}
+
+// Shifts one row of samples by whole pixels, replicating the edge pixel where the source runs out
+template <typename T>
+static void shift_row(T *dst, const T *src, const int &width, const int &channels, const int &shift) {
+    const int begin = std::clamp(-shift, 0, width);
+    const int end   = std::clamp(width - shift, begin, width);
+
+    for(int x = 0; x < begin; x++) {
+        memcpy(dst + x * channels, src, channels * sizeof(T));
+    }
+
+    memcpy(dst + begin * channels, src + (begin + shift) * channels, size_t(end - begin) * channels * sizeof(T));
+
+    for(int x = end; x < width; x++) {
+        memcpy(dst + x * channels, src + (width - 1) * channels, channels * sizeof(T));
+    }
+}
+
+Registration::Registration(const int &fft_size) :
+    fft_size(fft_size), fft(fft_size), enabled(false), reset_requested(true), factor(1) {
+    // Hann window keeps the crop edges from correlating with themselves
+    window.resize(size_t(fft_size) * fft_size);
+    for(int y = 0; y < fft_size; y++) {
+        const float wy = 0.5f - 0.5f * std::cos(2.f * float(M_PI) * y / (fft_size - 1));
+        for(int x = 0; x < fft_size; x++) {
+            const float wx                  = 0.5f - 0.5f * std::cos(2.f * float(M_PI) * x / (fft_size - 1));
+            window[size_t(y) * fft_size + x] = wx * wy;
+        }
+    }
+
+    spectrum.resize(size_t(fft_size) * fft_size);
+
+    last.has_reference     = false;
+    last.registered_frames = 0;
+    last.dx                = 0;
+    last.dy                = 0;
+    last.peak              = 0;
+    last.register_ms       = 0;
+}
+
+void Registration::set_enabled(const bool &enabled) {
+    if(enabled && !this->enabled) {
+        reset_requested = true;
+    }
+    this->enabled = enabled;
+}
+
+void Registration::reset() { reset_requested = true; }
+
+bool Registration::apply(const FrameView &view, std::vector<uint8_t> &buffer, FrameView &registered) {
+    if(!enabled) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Packed raw is unpacked once, both the luminance crop and the shift work from it
+    FrameView frame = view;
+    if(view.bit_depth > 8 && view.packed) {
+        unpacked.resize(size_t(view.width) * view.height);
+        unpack_raw(unpacked.data(), view.data, view.width, view.height, view.stride, view.bit_depth, view.packed);
+
+        frame.data   = reinterpret_cast<const uint8_t *>(unpacked.data());
+        frame.size   = unpacked.size() * sizeof(uint16_t);
+        frame.stride = view.width * int(sizeof(uint16_t));
+        frame.packed = false;
+    }
+
+    luminance_spectrum(frame);
+
+    if(reset_requested || reference.size() != spectrum.size()) {
+        reference       = spectrum;
+        reset_requested = false;
+
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        last.has_reference     = true;
+        last.registered_frames = 0;
+        last.dx                = 0;
+        last.dy                = 0;
+        last.peak              = 1;
+
+        return false;
+    }
+
+    float dx, dy, peak;
+    find_peak(dx, dy, peak);
+    dx *= factor;
+    dy *= factor;
+
+    const bool raw         = frame.bit_depth > 8;
+    const int sample_bytes = raw ? 2 : 1;
+    const int row_bytes    = frame.width * frame.channels * sample_bytes;
+
+    buffer.resize(size_t(row_bytes) * frame.height);
+
+    // Raw frames move in whole 2x2 tiles, anything finer would mix colours
+    int ix, iy, fx = 0, fy = 0;
+    if(raw) {
+        ix = 2 * int(std::lround(dx / 2));
+        iy = 2 * int(std::lround(dy / 2));
+    } else {
+        ix = int(std::floor(dx));
+        iy = int(std::floor(dy));
+        fx = int(std::lround((dx - ix) * subpixel_steps));
+        fy = int(std::lround((dy - iy) * subpixel_steps));
+        if(fx == subpixel_steps) {
+            ix++;
+            fx = 0;
+        }
+        if(fy == subpixel_steps) {
+            iy++;
+            fy = 0;
+        }
+    }
+
+    const uint8_t weights[4] = {uint8_t((subpixel_steps - fx) * (subpixel_steps - fy)),
+                                uint8_t(fx * (subpixel_steps - fy)),
+                                uint8_t((subpixel_steps - fx) * fy),
+                                uint8_t(fx * fy)};
+
+    shared_thread_pool().parallel_for(
+        frame.height,
+        [&](const int64_t &begin, const int64_t &end) {
+            // Integer shifted source rows, the bilinear pass reads one extra pixel to the right
+            std::vector<uint8_t> row_a, row_b;
+            if(fx != 0 || fy != 0) {
+                row_a.resize(size_t(frame.width + 1) * frame.channels);
+                row_b.resize(size_t(frame.width + 1) * frame.channels);
+            }
+
+            for(int64_t y = begin; y < end; y++) {
+                const int sy   = std::clamp(int(y) + iy, 0, frame.height - 1);
+                uint8_t *dst   = buffer.data() + y * row_bytes;
+                const auto src = frame.data + size_t(sy) * frame.stride;
+
+                if(raw) {
+                    shift_row(reinterpret_cast<uint16_t *>(dst),
+                              reinterpret_cast<const uint16_t *>(src),
+                              frame.width,
+                              frame.channels,
+                              ix);
+                } else if(fx == 0 && fy == 0) {
+                    shift_row(dst, src, frame.width, frame.channels, ix);
+                } else {
+                    const int sy1 = std::clamp(int(y) + iy + 1, 0, frame.height - 1);
+
+                    shift_row(row_a.data(), src, frame.width, frame.channels, ix);
+                    shift_row(row_b.data(), frame.data + size_t(sy1) * frame.stride, frame.width, frame.channels, ix);
+
+                    // The pixel past the end repeats the last one
+                    memcpy(row_a.data() + row_bytes, row_a.data() + row_bytes - frame.channels, frame.channels);
+                    memcpy(row_b.data() + row_bytes, row_b.data() + row_bytes - frame.channels, frame.channels);
+
+                    bilinear_row(dst, row_a.data(), row_b.data(), row_bytes, frame.channels, weights);
+                }
+            }
+        },
+        std::max(1, (128 << 10) / std::max(row_bytes, 1)));
+
+    registered        = frame;
+    registered.data   = buffer.data();
+    registered.size   = buffer.size();
+    registered.stride = row_bytes;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    last.registered_frames++;
+    last.dx          = dx;
+    last.dy          = dy;
+    last.peak        = peak;
+    last.register_ms = ms;
+
+    return true;
+}
+
+RegistrationStats Registration::stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return last;
+}
+
+void Registration::luminance_spectrum(const FrameView &view) {
+    // The crop covers fft_size x fft_size blocks of factor pixels in the middle of the frame
+    factor = std::max(1, std::min(view.width, view.height) / fft_size);
+    if(view.bit_depth > 8 && factor % 2 == 1 && factor > 1) {
+        factor--;
+    }
+
+    const int span = fft_size * factor;
+    int origin_x   = std::max(0, (view.width - span) / 2) & ~1;
+    int origin_y   = std::max(0, (view.height - span) / 2) & ~1;
+
+    const bool raw    = view.bit_depth > 8;
+    const int colours = std::min(view.channels, 3);
+    const float scale = 1.f / float(factor * factor * colours);
+
+    luminance.resize(size_t(fft_size) * fft_size);
+
+    // Frames smaller than the crop repeat their last column and row
+    const int inside = std::min(span, view.width - origin_x);
+
+    shared_thread_pool().parallel_for(
+        fft_size,
+        [&](const int64_t &begin, const int64_t &end) {
+            // Column sums over the factor rows of a block row, reduced to blocks afterwards
+            std::vector<uint32_t> columns(span);
+
+            for(int64_t by = begin; by < end; by++) {
+                std::fill(columns.begin(), columns.end(), 0);
+
+                for(int y = 0; y < factor; y++) {
+                    const int sy       = std::min(origin_y + int(by) * factor + y, view.height - 1);
+                    const uint8_t *row = view.data + size_t(sy) * view.stride;
+
+                    if(raw) {
+                        const uint16_t *samples = reinterpret_cast<const uint16_t *>(row) + origin_x;
+                        for(int x = 0; x < inside; x++) {
+                            columns[x] += samples[x];
+                        }
+                    } else {
+                        const uint8_t *pixels = row + size_t(origin_x) * view.channels;
+                        for(int x = 0; x < inside; x++) {
+                            uint32_t sum = 0;
+                            for(int c = 0; c < colours; c++) {
+                                sum += pixels[x * view.channels + c];
+                            }
+                            columns[x] += sum;
+                        }
+                    }
+                }
+
+                for(int x = inside; x < span; x++) {
+                    columns[x] = columns[inside - 1];
+                }
+
+                for(int bx = 0; bx < fft_size; bx++) {
+                    uint32_t sum = 0;
+                    for(int x = 0; x < factor; x++) {
+                        sum += columns[bx * factor + x];
+                    }
+                    luminance[size_t(by) * fft_size + bx] = float(sum) * scale;
+                }
+            }
+        });
+
+    double mean = 0;
+    for(auto &value : luminance) {
+        mean += value;
+    }
+    mean /= double(luminance.size());
+
+    for(size_t i = 0; i < luminance.size(); i++) {
+        spectrum[i] = std::complex<float>((luminance[i] - float(mean)) * window[i], 0.f);
+    }
+
+    fft.transform_2d(spectrum.data(), false, scratch);
+}
+
+void Registration::find_peak(float &dx, float &dy, float &peak) {
+    // Normalized cross power spectrum, only the phase difference is left
+    for(size_t i = 0; i < spectrum.size(); i++) {
+        const std::complex<float> cross = spectrum[i] * std::conj(reference[i]);
+        const float magnitude           = std::abs(cross);
+        spectrum[i]                     = magnitude > 1e-12f ? cross / magnitude : std::complex<float>(0.f, 0.f);
+    }
+
+    fft.transform_2d(spectrum.data(), true, scratch);
+
+    size_t best = 0;
+    for(size_t i = 1; i < spectrum.size(); i++) {
+        if(spectrum[i].real() > spectrum[best].real()) {
+            best = i;
+        }
+    }
+
+    const int n  = fft_size;
+    const int px = int(best % n);
+    const int py = int(best / n);
+
+    auto value = [&](const int &x, const int &y) { return spectrum[size_t((y + n) % n) * n + (x + n) % n].real(); };
+
+    // A shift between samples splits the peak over its two neighbours on that axis, the share the larger neighbour
+    // takes is the sub-pixel offset (Foroosh et al. 2002)
+    auto refine = [](const float &left, const float &centre, const float &right) {
+        if(right >= left && right > 0.f) {
+            return right / (right + centre);
+        }
+        if(left > 0.f) {
+            return -left / (left + centre);
+        }
+        return 0.f;
+    };
+
+    peak = value(px, py);
+
+    // The correlation wraps around, the top half of each axis is a negative shift
+    dx = (px > n / 2 ? px - n : px) + refine(value(px - 1, py), peak, value(px + 1, py));
+    dy = (py > n / 2 ? py - n : py) + refine(value(px, py - 1), peak, value(px, py + 1));
+}
@@ -0,0 +1,72 @@
+#ifndef _registration_h_
+#define _registration_h_
+
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fft.h"
+#include "frame_source.h"
+
+struct RegistrationStats {
+    bool has_reference;
+
+    int64_t registered_frames;
+
+    //! Last measured shift of the frame against the reference, in full resolution pixels.
+    float dx;
+    float dy;
+    //! Height of the correlation peak, close to 1 for a clean match and near 0 when nothing lines up.
+    float peak;
+
+    double register_ms;
+};
+
+//! Aligns frames to a reference by translation. The shift is found by phase correlation of a downsampled,
+//! windowed luminance crop, then the frame is resampled. RGB frames move with 1/16 pixel bilinear steps, raw
+//! frames by whole Bayer tiles so the CFA stays intact.
+class Registration {
+  public:
+    //! fft_size is the side of the correlation crop, a power of two.
+    explicit Registration(const int &fft_size = 256);
+
+    void set_enabled(const bool &enabled);
+    bool is_enabled() const { return enabled; }
+
+    //! The next frame becomes the reference.
+    void reset();
+
+    //! Measures the shift of view against the reference and writes the aligned frame into buffer, in the frame's
+    //! format with packed raw coming out unpacked. Returns false and leaves registered alone when disabled or when
+    //! view became the new reference. Not reentrant, frames are expected from one thread.
+    bool apply(const FrameView &view, std::vector<uint8_t> &buffer, FrameView &registered);
+
+    RegistrationStats stats();
+
+  private:
+    //! Fills spectrum with the FFT of the windowed luminance crop.
+    void luminance_spectrum(const FrameView &view);
+    void find_peak(float &dx, float &dy, float &peak);
+
+    int fft_size;
+    FFT fft;
+
+    std::atomic<bool> enabled;
+    std::atomic<bool> reset_requested;
+
+    // Kept between frames so steady state registration doesn't allocate
+    int factor;
+    std::vector<float> window;
+    std::vector<float> luminance;
+    std::vector<std::complex<float>> reference;
+    std::vector<std::complex<float>> spectrum;
+    std::vector<std::complex<float>> scratch;
+    std::vector<uint16_t> unpacked;
+
+    std::mutex stats_mutex;
+    RegistrationStats last;
+};
+
+#endif
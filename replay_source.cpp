@@ -0,0 +1,116 @@
+#include "replay_source.h"
+
+#include <cstdio>
+
+#include "convert.h"
+#include "util.h"
+
+ReplaySource::ReplaySource() : loop(true) {}
+
+ReplaySource::~ReplaySource() { stop_camera(); }
+
+std::vector<std::string> ReplaySource::get_cameras() const {
+    if(path.empty()) {
+        return {};
+    }
+
+    return {path};
+}
+
+bool ReplaySource::connect_camera(const std::string &camera_name) {
+    stop_camera();
+
+    if(!playback.open(camera_name)) {
+        return false;
+    }
+
+    // The first frame sets the stream format, every frame of a capture has the same one
+    PlaybackFrame first;
+    if(!playback.frame(0, first)) {
+        playback.close();
+        return false;
+    }
+
+    path      = camera_name;
+    width     = first.width;
+    height    = first.height;
+    channels  = first.channels;
+    bit_depth = first.channels == 1 ? first.bit_depth : 8;
+    stride    = first.stride;
+    packed    = false;
+    raw_mode  = first.channels == 1;
+
+    if(raw_mode) {
+        cfa_pattern = playback.cfa_pattern();
+        format_name = cfa_pattern == "MONO" ? format("R%i", bit_depth)
+                                            : format("S%s%i", cfa_pattern.c_str(), bit_depth);
+    } else {
+        cfa_pattern = "MONO";
+        pixel_order = first.channels == 4 ? PixelOrder::RGBA8888 : PixelOrder::RGB888;
+        format_name = first.channels == 4 ? "RGBA8888" : "RGB888";
+    }
+
+    connected = true;
+
+    printf("Replaying %s: %lld frames %s %ix%i\n",
+           camera_name.c_str(),
+           (long long)playback.frame_count(),
+           format_name.c_str(),
+           width,
+           height);
+
+    return true;
+}
+
+bool ReplaySource::disconnect_camera() {
+    SoftwareSource::disconnect_camera();
+    playback.close();
+    return true;
+}
+
+bool ReplaySource::configure_camera(const int &format_index, const int &size_index) {
+    if(!connected || format_index != 0 || size_index != 0) {
+        return false;
+    }
+
+    allocate_buffers();
+    return true;
+}
+
+std::vector<std::string> ReplaySource::get_pixel_formats() const {
+    if(!connected) {
+        return {};
+    }
+
+    return {format_name};
+}
+
+std::vector<std::string> ReplaySource::get_pixel_format_sizes(const std::string &format) {
+    if(!connected || format != format_name) {
+        return {};
+    }
+
+    return {::format("%ix%i", width, height)};
+}
+
+bool ReplaySource::render(uint8_t *dst, const int64_t &sequence) {
+    const int64_t count = playback.frame_count();
+    if(count <= 0 || (!loop && sequence >= count)) {
+        return false;
+    }
+
+    const int64_t index = sequence % count;
+
+    PlaybackFrame frame;
+    if(!playback.frame(index, frame)) {
+        return false;
+    }
+
+    // Reading ahead of the frame being replayed keeps decoding off the producer thread
+    playback.seek((index + 1) % count);
+
+    const size_t row_bytes = size_t(width) * (channels == 1 ? sizeof(uint16_t) : channels);
+    copy_rows(dst, stride, frame.data, frame.stride, row_bytes, height);
+
+    return true;
+}
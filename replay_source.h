@@ -0,0 +1,43 @@
+#ifndef _replay_source_h_
+#define _replay_source_h_
+
+#include <string>
+#include <vector>
+
+#include "playback.h"
+#include "software_source.h"
+
+//! Feeds a finished capture back through the pipeline as if it were coming off the sensor, at the configured frame
+//! rate. The capture is the camera name, a directory of image_NNNN.tif frames or a .ser file; frames come out as they
+//! were stored, red first RGB(X) or unpacked 16-bit raw.
+class ReplaySource : public SoftwareSource {
+  public:
+    ReplaySource();
+    ~ReplaySource();
+
+    //! The capture get_cameras offers.
+    void set_path(const std::string &capture_path) { path = capture_path; }
+    //! Starts over from the first frame at the end instead of ending the stream.
+    void set_loop(const bool &enabled) { loop = enabled; }
+
+    std::vector<std::string> get_cameras() const override;
+    bool connect_camera(const std::string &camera_name) override;
+    bool disconnect_camera() override;
+
+    bool configure_camera(const int &format_index, const int &size_index) override;
+
+    std::vector<std::string> get_pixel_formats() const override;
+    std::vector<std::string> get_pixel_format_sizes(const std::string &format) override;
+
+  protected:
+    bool render(uint8_t *dst, const int64_t &sequence) override;
+
+  private:
+    SessionPlayback playback;
+    std::string path;
+    bool loop;
+
+    std::string format_name;
+};
+
+#endif
@@ -0,0 +1,307 @@
+#include "ser.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+//! 0001-01-01 to 1970-01-01 in 100 ns ticks.
+const int64_t unix_epoch_ticks = 621355968000000000LL;
+
+//! Frames behind the newest one whose pages are flushed and dropped from the page cache.
+const int64_t writeback_lag = 4;
+
+bool write_all(const int &fd, const uint8_t *data, size_t bytes, off_t offset) {
+    while(bytes > 0) {
+        const ssize_t written = pwrite(fd, data, bytes, offset);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += written;
+        bytes -= size_t(written);
+        offset += written;
+    }
+
+    return true;
+}
+
+bool read_all(const int &fd, uint8_t *data, size_t bytes, off_t offset) {
+    while(bytes > 0) {
+        const ssize_t read = pread(fd, data, bytes, offset);
+        if(read <= 0) {
+            if(read < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += read;
+        bytes -= size_t(read);
+        offset += read;
+    }
+
+    return true;
+}
+
+template <typename T> void put(uint8_t *header, const size_t &offset, const T &value) {
+    memcpy(header + offset, &value, sizeof(T));
+}
+
+template <typename T> T get(const uint8_t *header, const size_t &offset) {
+    T value;
+    memcpy(&value, header + offset, sizeof(T));
+    return value;
+}
+} // namespace
+
+SerColor ser_color(const std::string &cfa_pattern) {
+    if(cfa_pattern == "RGGB") {
+        return SerColor::BayerRGGB;
+    } else if(cfa_pattern == "GRBG") {
+        return SerColor::BayerGRBG;
+    } else if(cfa_pattern == "GBRG") {
+        return SerColor::BayerGBRG;
+    } else if(cfa_pattern == "BGGR") {
+        return SerColor::BayerBGGR;
+    }
+
+    return SerColor::Mono;
+}
+
+bool parse_ser_header(const uint8_t *data, const size_t &size, SerHeader &header) {
+    if(size < ser_header_size || memcmp(data, "LUCAM-RECORDER", 14) != 0) {
+        return false;
+    }
+
+    // Only the color ids the writer knows, the spec also has CMY patterns nothing here can show
+    const int color = get<int32_t>(data, 18);
+    if(color != 0 && (color < 8 || color > 11) && color != 100 && color != 101) {
+        return false;
+    }
+
+    header.width     = get<int32_t>(data, 26);
+    header.height    = get<int32_t>(data, 30);
+    header.color     = SerColor(color);
+    header.bit_depth = get<int32_t>(data, 34);
+    header.frames    = get<int32_t>(data, 38);
+    header.utc_ticks = get<int64_t>(data, 170);
+
+    return header.width > 0 && header.height > 0 && header.bit_depth >= 1 && header.bit_depth <= 16;
+}
+
+size_t ser_frame_bytes(const SerHeader &header) {
+    const int planes = (header.color == SerColor::RGB || header.color == SerColor::BGR) ? 3 : 1;
+    return size_t(header.width) * header.height * planes * (header.bit_depth > 8 ? 2 : 1);
+}
+
+int64_t ser_ticks(const std::chrono::system_clock::time_point &time) {
+    const auto since_epoch = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch());
+    return unix_epoch_ticks + since_epoch.count() * 10;
+}
+
+SerWriter::SerWriter() :
+    fd(-1), width(0), height(0), color(SerColor::Mono), bit_depth(8), frame_size(0), frame_count(0), failed_frames(0) {
+}
+
+SerWriter::~SerWriter() { close(); }
+
+bool SerWriter::open(const std::string &filename,
+                     const int &width,
+                     const int &height,
+                     const SerColor &color,
+                     const int &bit_depth,
+                     const int &frames_hint) {
+    close();
+
+    this->filename  = filename;
+    this->width     = width;
+    this->height    = height;
+    this->color     = color;
+    this->bit_depth = bit_depth;
+
+    SerHeader header;
+    header.width     = width;
+    header.height    = height;
+    header.color     = color;
+    header.bit_depth = bit_depth;
+    frame_size       = ser_frame_bytes(header);
+
+    // Read back as well as written, close moves frames down over any slot whose write failed
+    fd = ::open(filename.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if(fd < 0) {
+        printf("Unable to open %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    // fallocate rather than posix_fallocate, which falls back to writing zeros on filesystems without extents (FAT)
+    const off_t reserve = off_t(ser_header_size + frame_size * size_t(frames_hint > 0 ? frames_hint : 0));
+    if(reserve > off_t(ser_header_size) && fallocate(fd, 0, 0, reserve) != 0) {
+        printf("Unable to preallocate %s (%s), frames will extend the file\n", filename.c_str(), strerror(errno));
+    }
+
+    frame_count   = 0;
+    failed_frames = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(timestamp_mutex);
+        timestamps.clear();
+        timestamps.reserve(frames_hint > 0 ? frames_hint : 0);
+        written.clear();
+        written.reserve(frames_hint > 0 ? frames_hint : 0);
+    }
+
+    // A header is in place from the start so an interrupted capture is still recognisable
+    if(!write_header(0, ser_ticks(std::chrono::system_clock::now()))) {
+        printf("Unable to write SER header to %s: %s\n", filename.c_str(), strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+bool SerWriter::write_frame(const uint8_t *data, const int64_t &slot, const int64_t &timestamp) {
+    if(fd < 0 || slot < 0) {
+        return false;
+    }
+
+    const off_t offset = off_t(ser_header_size + frame_size * size_t(slot));
+    if(!write_all(fd, data, frame_size, offset)) {
+        failed_frames++;
+        printf("Unable to write SER frame %lld: %s\n", (long long)slot, strerror(errno));
+        return false;
+    }
+
+    // Start writeback now and drop frames that have already reached the disk, a long capture would otherwise fill the
+    // page cache and stall every writer at once when the kernel starts flushing
+    sync_file_range(fd, offset, off_t(frame_size), SYNC_FILE_RANGE_WRITE);
+    if(slot >= writeback_lag) {
+        const off_t old_offset = off_t(ser_header_size + frame_size * size_t(slot - writeback_lag));
+        sync_file_range(fd,
+                        old_offset,
+                        off_t(frame_size),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, old_offset, off_t(frame_size), POSIX_FADV_DONTNEED);
+    }
+
+    // Only frames that made it to the file count, close drops the slots of failed writes
+    frame_count++;
+
+    std::lock_guard<std::mutex> lock(timestamp_mutex);
+    if(size_t(slot) >= timestamps.size()) {
+        timestamps.resize(slot + 1, 0);
+        written.resize(slot + 1, 0);
+    }
+    timestamps[slot] = timestamp;
+    written[slot]    = 1;
+
+    return true;
+}
+
+bool SerWriter::close() {
+    if(fd < 0) {
+        return true;
+    }
+
+    bool success = failed_frames == 0;
+
+    std::lock_guard<std::mutex> lock(timestamp_mutex);
+
+    // A failed write leaves its slot empty, later frames move down over it so the file holds only real frames
+    int64_t frames = 0;
+    std::vector<uint8_t> frame;
+    for(size_t slot = 0; slot < written.size(); slot++) {
+        if(!written[slot]) {
+            continue;
+        }
+
+        if(int64_t(slot) != frames) {
+            frame.resize(frame_size);
+            if(!read_all(fd, frame.data(), frame_size, off_t(ser_header_size + frame_size * slot))
+               || !write_all(fd, frame.data(), frame_size, off_t(ser_header_size + frame_size * size_t(frames)))) {
+                printf("Unable to compact %s: %s\n", filename.c_str(), strerror(errno));
+                success = false;
+                break;
+            }
+        }
+
+        timestamps[frames] = timestamps[slot];
+        frames++;
+    }
+    timestamps.resize(frames);
+
+    off_t end = off_t(ser_header_size + frame_size * size_t(frames));
+
+    // The trailer is all or nothing, readers take its presence to mean every frame has a time
+    bool has_trailer = frames > 0;
+    for(const auto &timestamp : timestamps) {
+        has_trailer = has_trailer && timestamp != 0;
+    }
+
+    if(has_trailer) {
+        const size_t trailer_bytes = timestamps.size() * sizeof(int64_t);
+        if(write_all(fd, reinterpret_cast<const uint8_t *>(timestamps.data()), trailer_bytes, end)) {
+            end += off_t(trailer_bytes);
+        } else {
+            printf("Unable to write SER timestamps to %s: %s\n", filename.c_str(), strerror(errno));
+            success = false;
+        }
+    }
+
+    const int64_t start = !timestamps.empty() && timestamps[0] != 0 ? timestamps[0]
+                                                                     : ser_ticks(std::chrono::system_clock::now());
+    if(!write_header(frames, start)) {
+        printf("Unable to write SER header to %s: %s\n", filename.c_str(), strerror(errno));
+        success = false;
+    }
+
+    // Hands back whatever was preallocated for frames that never came
+    if(ftruncate(fd, end) != 0) {
+        printf("Unable to trim %s: %s\n", filename.c_str(), strerror(errno));
+    }
+
+    if(::close(fd) != 0) {
+        success = false;
+    }
+    fd = -1;
+
+    printf("SER %s: %lld frames%s\n", filename.c_str(), (long long)frames, has_trailer ? " with timestamps" : "");
+
+    return success;
+}
+
+bool SerWriter::write_header(const int64_t &frames, const int64_t &utc_ticks) {
+    uint8_t header[ser_header_size] = {};
+
+    memcpy(header, "LUCAM-RECORDER", 14);
+    put<int32_t>(header, 14, 0);
+    put<int32_t>(header, 18, int32_t(color));
+    // The specification says 1 for little endian data, but the capture programs everyone reads write 0 and readers
+    // follow them
+    put<int32_t>(header, 22, 0);
+    put<int32_t>(header, 26, width);
+    put<int32_t>(header, 30, height);
+    put<int32_t>(header, 34, bit_depth);
+    put<int32_t>(header, 38, int32_t(frames));
+    // Observer, Instrument and Telescope (42-161) are left blank
+
+    // Local time is UTC shifted by the zone offset at the start of the capture
+    const std::time_t seconds = std::time_t((utc_ticks - unix_epoch_ticks) / 10000000);
+    std::tm local;
+    localtime_r(&seconds, &local);
+    put<int64_t>(header, 162, utc_ticks + int64_t(local.tm_gmtoff) * 10000000);
+    put<int64_t>(header, 170, utc_ticks);
+
+    return write_all(fd, header, ser_header_size, 0);
+}
@@ -0,0 +1,91 @@
+#ifndef _ser_h_
+#define _ser_h_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! ColorID values from the SER v3 specification.
+enum class SerColor { Mono = 0, BayerRGGB = 8, BayerGRBG = 9, BayerGBRG = 10, BayerBGGR = 11, RGB = 100, BGR = 101 };
+
+//! Bayer color id for a CFA pattern name (RGGB, BGGR, ...), Mono for anything else.
+SerColor ser_color(const std::string &cfa_pattern);
+
+//! The fixed header of a SER file.
+struct SerHeader {
+    int width;
+    int height;
+    SerColor color;
+    int bit_depth;
+    //! As recorded, an interrupted capture leaves 0 here.
+    int64_t frames;
+    int64_t utc_ticks;
+};
+
+const size_t ser_header_size = 178;
+
+//! Parses the header at the start of data, false if it isn't a SER file this code can read.
+bool parse_ser_header(const uint8_t *data, const size_t &size, SerHeader &header);
+
+//! Bytes per frame, planes times samples times 1 or 2 bytes.
+size_t ser_frame_bytes(const SerHeader &header);
+
+//! SER timestamps count 100 ns ticks from 0001-01-01.
+int64_t ser_ticks(const std::chrono::system_clock::time_point &time);
+
+//! One SER video per capture: a fixed 178 byte header, uncompressed frames back to back and an optional trailer of
+//! per-frame UTC timestamps. write_frame may be called from several writer threads at once, the caller picks each
+//! frame's slot (0, 1, 2, ... in capture order) so the file keeps that order whichever writer gets there first.
+class SerWriter {
+  public:
+    SerWriter();
+    //! Closes the file if it is still open.
+    ~SerWriter();
+
+    //! frames_hint is preallocated on disk, more frames can still be written. Samples wider than 8 bits are stored
+    //! as 16-bit little endian values holding bit_depth significant bits.
+    bool open(const std::string &filename,
+              const int &width,
+              const int &height,
+              const SerColor &color,
+              const int &bit_depth,
+              const int &frames_hint);
+
+    //! data holds frame_bytes() of interleaved samples for frame slot, timestamp is in SER ticks (0 drops the
+    //! trailer).
+    bool write_frame(const uint8_t *data, const int64_t &slot, const int64_t &timestamp);
+
+    //! Moves frames down over slots that were never written, writes the timestamp trailer, patches the frame count
+    //! into the header and trims the preallocation.
+    bool close();
+
+    size_t frame_bytes() const { return frame_size; }
+    //! Frames written successfully so far.
+    int64_t frames() const { return frame_count; }
+
+  private:
+    bool write_header(const int64_t &frames, const int64_t &utc_ticks);
+
+    std::string filename;
+    int fd;
+
+    int width;
+    int height;
+    SerColor color;
+    int bit_depth;
+
+    size_t frame_size;
+
+    std::atomic<int64_t> frame_count;
+    std::atomic<int64_t> failed_frames;
+
+    std::mutex timestamp_mutex;
+    std::vector<int64_t> timestamps;
+    //! Per slot, set once its frame is on disk.
+    std::vector<char> written;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "software_source.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "latency.h"
+#include "trace.h"
+
+namespace {
+void *handle_of(const int &index) { return reinterpret_cast<void *>(intptr_t(index) + 1); }
+
+int index_of(void *handle) { return int(reinterpret_cast<intptr_t>(handle) - 1); }
+} // namespace
+
+SoftwareSource::SoftwareSource() :
+    connected(false), frame_controls{0, ControlValues(), -1}, applies_controls(false), frame_rate(30.0), dropped(0),
+    running(false) {}
+
+SoftwareSource::~SoftwareSource() { stop_camera(); }
+
+bool SoftwareSource::uninitialize() { return disconnect_camera(); }
+
+bool SoftwareSource::disconnect_camera() {
+    stop_camera();
+    connected = false;
+    return true;
+}
+
+void SoftwareSource::allocate_buffers() {
+    stop_camera();
+
+    const int count = std::max(buffer_count, 2);
+    buffers.assign(count, std::vector<uint8_t>(size_t(stride) * height));
+    buffer_sequence.assign(count, -1);
+    buffer_timestamp.assign(count, 0);
+    buffer_controls.assign(count, ControlRequest{0, ControlValues(), -1});
+}
+
+bool SoftwareSource::start_camera() {
+    if(running || buffers.empty()) {
+        return false;
+    }
+
+    // A stream that ended on its own still has its thread to join
+    stop_camera();
+
+    completed.reset(buffers.size());
+    returned.reset(buffers.size());
+    dropped  = 0;
+    sequence = -1;
+
+    running  = true;
+    producer = std::thread(&SoftwareSource::producer_loop, this);
+
+    return true;
+}
+
+bool SoftwareSource::stop_camera() {
+    running = false;
+    if(producer.joinable()) {
+        producer.join();
+    }
+
+    return true;
+}
+
+bool SoftwareSource::acquire_frame(FrameView &view) {
+    int index = -1;
+    if(!completed.pop(index)) {
+        return false;
+    }
+
+    // Only the newest frame is wanted, everything older goes straight back to the producer
+    int newer = -1;
+    while(completed.pop(newer)) {
+        returned.push(index);
+        index = newer;
+    }
+
+    view_buffer(index, view);
+    return true;
+}
+
+bool SoftwareSource::next_frame(FrameView &view) {
+    int index = -1;
+    if(!completed.pop(index)) {
+        return false;
+    }
+
+    view_buffer(index, view);
+    return true;
+}
+
+void SoftwareSource::release_frame(FrameView &view) {
+    if(view.handle == nullptr) {
+        return;
+    }
+
+    returned.push(index_of(view.handle));
+
+    view.data   = nullptr;
+    view.handle = nullptr;
+}
+
+void SoftwareSource::view_buffer(const int &index, FrameView &view) {
+    view.data      = buffers[index].data();
+    view.size      = buffers[index].size();
+    view.width     = width;
+    view.height    = height;
+    view.channels  = channels;
+    view.stride    = stride;
+    view.bit_depth = bit_depth;
+    view.packed    = packed;
+    view.sequence  = buffer_sequence[index];
+    view.timestamp = buffer_timestamp[index];
+    view.handle    = handle_of(index);
+
+    const ControlRequest &controls = buffer_controls[index];
+    view.analogue_gain             = applies_controls ? controls.values.analogue_gain : 0.f;
+    view.exposure_time             = applies_controls ? controls.values.exposure_time : 0;
+    view.control_step              = controls.step;
+}
+
+void SoftwareSource::producer_loop() {
+    set_thread_name("source");
+
+    // Buffers the producer owns, the consumer's queue only ever carries buffers back to it
+    std::vector<int> free_buffers;
+    for(int i = int(buffers.size()) - 1; i >= 0; i--) {
+        free_buffers.push_back(i);
+    }
+
+    auto next_frame_time = std::chrono::steady_clock::now();
+
+    for(int64_t frame = 0; running; frame++) {
+        const double fps = frame_rate;
+        if(fps > 0) {
+            const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1.0 / fps));
+
+            // A producer that fell behind starts pacing again from now rather than bursting to catch up
+            next_frame_time = std::max(next_frame_time + period, std::chrono::steady_clock::now());
+            std::this_thread::sleep_until(next_frame_time);
+        }
+
+        int index = -1;
+        while(returned.pop(index)) {
+            free_buffers.push_back(index);
+        }
+
+        // Paced sources drop the frame like a camera with no buffer queued, unpaced ones wait for the consumer
+        if(free_buffers.empty()) {
+            if(fps > 0) {
+                dropped++;
+            } else {
+                frame--;
+                std::this_thread::yield();
+            }
+            continue;
+        }
+
+        index = free_buffers.back();
+        free_buffers.pop_back();
+
+        // Like a camera request, only a frame that gets a buffer takes the next controls and schedule step
+        frame_controls = controls.next_request();
+
+        bool rendered;
+        {
+            TraceScope trace("render", frame);
+            rendered = render(buffers[index].data(), frame);
+        }
+
+        if(!rendered) {
+            printf("Source finished after %lld frames\n", (long long)frame);
+            break;
+        }
+
+        buffer_sequence[index]  = frame;
+        buffer_timestamp[index] = boottime_ns();
+        buffer_controls[index]  = frame_controls;
+        sequence                = frame;
+
+        if(frame_callback) {
+            FrameView view;
+            view_buffer(index, view);
+            frame_callback(view);
+        }
+
+        if(!completed.push(index)) {
+            free_buffers.push_back(index);
+        }
+    }
+
+    running = false;
+}
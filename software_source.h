@@ -0,0 +1,77 @@
+#ifndef _software_source_h_
+#define _software_source_h_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+#include "spsc_queue.h"
+
+//! Base for sources that make their frames in software. A producer thread renders into a ring of buffer_count
+//! buffers at the configured frame rate and hands them out exactly like the camera: the frame callback sees every
+//! frame, completed buffers queue for acquire/next_frame and a frame is dropped when no buffer is free.
+class SoftwareSource : public FrameSource {
+  public:
+    SoftwareSource();
+    ~SoftwareSource();
+
+    bool initialize() override { return true; }
+    bool uninitialize() override;
+
+    bool disconnect_camera() override;
+
+    bool start_camera() override;
+    bool stop_camera() override;
+
+    bool is_connected() const override { return connected; }
+
+    bool acquire_frame(FrameView &view) override;
+    bool next_frame(FrameView &view) override;
+    void release_frame(FrameView &view) override;
+
+    size_t pending_frames() const override { return completed.size(); }
+
+    //! Frames per second the producer paces itself to, 0 produces frames as fast as they are consumed.
+    void set_frame_rate(const double &fps) { frame_rate = fps; }
+    double get_frame_rate() const { return frame_rate; }
+
+    //! Frames the producer had no free buffer for.
+    int64_t dropped_frames() const { return dropped; }
+
+  protected:
+    //! Sizes the ring for frames of stride * height bytes, called from configure with the source stopped.
+    void allocate_buffers();
+
+    //! Renders frame sequence into dst on the producer thread, returning false ends the stream. Derived classes stop
+    //! the source in their destructor, the producer must not outlive render.
+    virtual bool render(uint8_t *dst, const int64_t &sequence) = 0;
+
+    bool connected;
+
+    //! The frame being rendered's controls, taken from the mailbox (schedule included) just before render.
+    ControlRequest frame_controls;
+    //! Set by sources whose frames follow the controls, only their frames are tagged with gain and exposure.
+    bool applies_controls;
+
+  private:
+    void producer_loop();
+    void view_buffer(const int &index, FrameView &view);
+
+    std::vector<std::vector<uint8_t>> buffers;
+    //! Written by the producer before a buffer is queued.
+    std::vector<int64_t> buffer_sequence;
+    std::vector<int64_t> buffer_timestamp;
+    std::vector<ControlRequest> buffer_controls;
+
+    //! Producer to consumer, and the consumer handing buffers back.
+    SPSCQueue<int> completed;
+    SPSCQueue<int> returned;
+
+    std::atomic<double> frame_rate;
+    std::atomic<int64_t> dropped;
+    std::atomic<bool> running;
+    std::thread producer;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _spsc_queue_h_
+#define _spsc_queue_h_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+//! Bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T> class SPSCQueue {
+  public:
+    explicit SPSCQueue(const size_t &capacity = 0) : mask(0), head(0), tail(0) { reset(capacity); }
+
+    //! Resizes and empties the queue, neither side may be using it while this runs.
+    void reset(const size_t &capacity) {
+        size_t slot_count = 1;
+        while(slot_count < capacity) {
+            slot_count <<= 1;
+        }
+
+        slots.assign(slot_count, T());
+        mask = slot_count - 1;
+
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+    //! Producer side, returns false when the queue is full.
+    bool push(const T &value) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+
+        slots[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    //! Consumer side, returns false when the queue is empty.
+    bool pop(T &value) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        value = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+    size_t capacity() const { return mask + 1; }
+
+  private:
+    std::vector<T> slots;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+#endif
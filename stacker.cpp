@@ -0,0 +1,343 @@
+#include "stacker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "convert.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "unpack.h"
+
+// Frames waiting between the camera thread and the stacking thread, anything beyond this is dropped
+static const int staging_slots = 2;
+
+// mean += (x - mean) * weight, with weight 1/n this is the running mean of n frames
+static void mean_row(float *mean, const float *x, const int &n, const float &weight) {
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t w = vdupq_n_f32(weight);
+    for(; i + 4 <= n; i += 4) {
+        float32x4_t m = vld1q_f32(mean + i);
+        m             = vfmaq_f32(m, vsubq_f32(vld1q_f32(x + i), m), w);
+        vst1q_f32(mean + i, m);
+    }
+#endif
+
+    for(; i < n; i++) {
+        mean[i] += (x[i] - mean[i]) * weight;
+    }
+}
+
+// Welford update of mean and m2 with only the samples inside kappa sigma of the current mean. The first min_frames
+// samples of every pixel are always taken so the variance has something to go on.
+static void sigma_row(float *mean,
+                      float *m2,
+                      float *count,
+                      const float *x,
+                      const int &n,
+                      const float &kappa,
+                      const float &min_frames) {
+    const float kappa2 = kappa * kappa;
+
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t k2      = vdupq_n_f32(kappa2);
+    const float32x4_t minimum = vdupq_n_f32(min_frames);
+    const float32x4_t one     = vdupq_n_f32(1.f);
+    const float32x4_t zero    = vdupq_n_f32(0.f);
+
+    for(; i + 4 <= n; i += 4) {
+        float32x4_t c  = vld1q_f32(count + i);
+        float32x4_t m  = vld1q_f32(mean + i);
+        float32x4_t v  = vld1q_f32(m2 + i);
+        float32x4_t xi = vld1q_f32(x + i);
+
+        float32x4_t d        = vsubq_f32(xi, m);
+        float32x4_t variance = vdivq_f32(v, vmaxq_f32(vsubq_f32(c, one), one));
+
+        uint32x4_t accept = vorrq_u32(vcltq_f32(c, minimum), vcleq_f32(vmulq_f32(d, d), vmulq_f32(k2, variance)));
+
+        c = vaddq_f32(c, vbslq_f32(accept, one, zero));
+        m = vaddq_f32(m, vbslq_f32(accept, vdivq_f32(d, vmaxq_f32(c, one)), zero));
+        v = vaddq_f32(v, vbslq_f32(accept, vmulq_f32(d, vsubq_f32(xi, m)), zero));
+
+        vst1q_f32(count + i, c);
+        vst1q_f32(mean + i, m);
+        vst1q_f32(m2 + i, v);
+    }
+#endif
+
+    for(; i < n; i++) {
+        const float d        = x[i] - mean[i];
+        const float variance = m2[i] / std::max(count[i] - 1.f, 1.f);
+
+        if(count[i] < min_frames || d * d <= kappa2 * variance) {
+            count[i] += 1.f;
+            mean[i] += d / count[i];
+            m2[i] += d * (x[i] - mean[i]);
+        }
+    }
+}
+
+LiveStacker::LiveStacker() :
+    stopping(false), active(false), dropped_frames(0), stack_ms(0), stack_width(0), stack_height(0), stack_channels(0),
+    stack_bit_depth(0), stacked_frames(0), result_frames(0) {
+    settings.mode       = StackMode::Mean;
+    settings.kappa      = 2.5f;
+    settings.min_frames = 5;
+}
+
+LiveStacker::~LiveStacker() { stop(); }
+
+void LiveStacker::start(const StackSettings &settings) {
+    stop();
+
+    {
+        std::lock_guard<std::mutex> lock(stack_mutex);
+        this->settings = settings;
+
+        stack_width     = 0;
+        stack_height    = 0;
+        stack_channels  = 0;
+        stack_bit_depth = 0;
+        stacked_frames  = 0;
+        result_frames   = 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        stopping = false;
+
+        staged_frames.clear();
+        free_frames.resize(staging_slots);
+    }
+
+    dropped_frames = 0;
+    stack_ms       = 0;
+
+    worker = std::thread(&LiveStacker::worker_loop, this);
+    active = true;
+
+    printf("Live stacking started: %s\n", settings.mode == StackMode::Mean ? "mean" : "kappa-sigma");
+}
+
+void LiveStacker::stop() {
+    if(!worker.joinable()) {
+        return;
+    }
+
+    active = false;
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        stopping = true;
+    }
+    frame_cv.notify_all();
+
+    worker.join();
+
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        staged_frames.clear();
+        free_frames.clear();
+    }
+
+    printf("Live stacking stopped: %lld stacked, %lld dropped\n",
+           (long long)stacked_frames,
+           (long long)dropped_frames);
+}
+
+void LiveStacker::process_frame(const FrameView &view) {
+    if(!active) {
+        return;
+    }
+
+    StagedFrame frame;
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        if(free_frames.empty()) {
+            dropped_frames++;
+            return;
+        }
+
+        frame = std::move(free_frames.back());
+        free_frames.pop_back();
+    }
+
+    frame.width     = view.width;
+    frame.height    = view.height;
+    frame.channels  = view.channels;
+    frame.bit_depth = view.bit_depth;
+
+    if(view.bit_depth > 8) {
+        frame.pixels.resize(size_t(view.width) * view.height * sizeof(uint16_t));
+        unpack_raw(reinterpret_cast<uint16_t *>(frame.pixels.data()),
+                   view.data,
+                   view.width,
+                   view.height,
+                   view.stride,
+                   view.bit_depth,
+                   view.packed);
+    } else {
+        const int row_bytes = view.width * view.channels;
+
+        frame.pixels.resize(size_t(row_bytes) * view.height);
+        copy_rows(frame.pixels.data(), row_bytes, view.data, view.stride, row_bytes, view.height);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        staged_frames.push_back(std::move(frame));
+    }
+    frame_cv.notify_one();
+}
+
+bool LiveStacker::get_result(StackImage &image) {
+    std::lock_guard<std::mutex> lock(stack_mutex);
+    if(stacked_frames == 0 || stacked_frames == result_frames) {
+        return false;
+    }
+
+    const int64_t samples  = int64_t(stack_width) * stack_height * stack_channels;
+    const int sample_bytes = stack_bit_depth > 8 ? 2 : 1;
+    const float maximum    = float((1 << stack_bit_depth) - 1);
+
+    image.width     = stack_width;
+    image.height    = stack_height;
+    image.channels  = stack_channels;
+    image.bit_depth = stack_bit_depth;
+    image.frames    = stacked_frames;
+    image.pixels.resize(size_t(samples) * sample_bytes);
+
+    shared_thread_pool().parallel_for(
+        samples,
+        [&](const int64_t &begin, const int64_t &end) {
+            if(sample_bytes == 2) {
+                uint16_t *dst = reinterpret_cast<uint16_t *>(image.pixels.data());
+                for(int64_t i = begin; i < end; i++) {
+                    dst[i] = uint16_t(std::min(std::max(mean[i] + 0.5f, 0.f), maximum));
+                }
+            } else {
+                uint8_t *dst = image.pixels.data();
+                for(int64_t i = begin; i < end; i++) {
+                    dst[i] = uint8_t(std::min(std::max(mean[i] + 0.5f, 0.f), maximum));
+                }
+            }
+        },
+        64 << 10);
+
+    result_frames = stacked_frames;
+
+    return true;
+}
+
+StackStats LiveStacker::stats() {
+    StackStats s;
+    s.active         = active;
+    s.dropped_frames = dropped_frames;
+    s.stack_ms       = stack_ms;
+
+    std::lock_guard<std::mutex> lock(stack_mutex);
+    s.stacked_frames = stacked_frames;
+
+    return s;
+}
+
+void LiveStacker::worker_loop() {
+    set_thread_name("stacker");
+
+    while(true) {
+        StagedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(frame_mutex);
+            frame_cv.wait(lock, [this]() { return stopping || !staged_frames.empty(); });
+
+            if(staged_frames.empty()) {
+                return;
+            }
+
+            frame = std::move(staged_frames.front());
+            staged_frames.pop_front();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        accumulate(frame);
+        stack_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        {
+            std::lock_guard<std::mutex> lock(frame_mutex);
+            free_frames.push_back(std::move(frame));
+        }
+    }
+}
+
+void LiveStacker::accumulate(const StagedFrame &frame) {
+    TraceScope trace("stack");
+
+    std::lock_guard<std::mutex> lock(stack_mutex);
+
+    // A new format restarts the stack
+    if(frame.width != stack_width || frame.height != stack_height || frame.channels != stack_channels
+       || frame.bit_depth != stack_bit_depth) {
+        stack_width     = frame.width;
+        stack_height    = frame.height;
+        stack_channels  = frame.channels;
+        stack_bit_depth = frame.bit_depth;
+        stacked_frames  = 0;
+        result_frames   = 0;
+
+        const size_t samples = size_t(stack_width) * stack_height * stack_channels;
+        mean.assign(samples, 0.f);
+
+        if(settings.mode == StackMode::KappaSigma) {
+            m2.assign(samples, 0.f);
+            count.assign(samples, 0.f);
+        } else {
+            m2.clear();
+            count.clear();
+        }
+    }
+
+    stacked_frames++;
+
+    const int row_samples  = stack_width * stack_channels;
+    const float weight     = 1.f / float(stacked_frames);
+    const float min_frames = float(std::max(settings.min_frames, 1));
+
+    shared_thread_pool().parallel_for(
+        stack_height,
+        [&](const int64_t &begin, const int64_t &end) {
+            std::vector<float> row(row_samples);
+
+            for(int64_t y = begin; y < end; y++) {
+                const size_t offset = size_t(y) * row_samples;
+
+                if(frame.bit_depth > 8) {
+                    const uint16_t *src = reinterpret_cast<const uint16_t *>(frame.pixels.data()) + offset;
+                    std::copy(src, src + row_samples, row.begin());
+                } else {
+                    const uint8_t *src = frame.pixels.data() + offset;
+                    std::copy(src, src + row_samples, row.begin());
+                }
+
+                if(settings.mode == StackMode::KappaSigma) {
+                    sigma_row(mean.data() + offset,
+                              m2.data() + offset,
+                              count.data() + offset,
+                              row.data(),
+                              row_samples,
+                              settings.kappa,
+                              min_frames);
+                } else {
+                    mean_row(mean.data() + offset, row.data(), row_samples, weight);
+                }
+            }
+        },
+        std::max(1, (256 << 10) / std::max(row_samples * int(sizeof(float)), 1)));
+}
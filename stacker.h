@@ -0,0 +1,109 @@
+#ifndef _stacker_h_
+#define _stacker_h_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+
+enum class StackMode { Mean = 0, KappaSigma };
+
+struct StackSettings {
+    StackMode mode;
+
+    //! Samples further than kappa standard deviations from the running mean are rejected.
+    float kappa;
+    //! Frames every sample takes unconditionally before clipping starts.
+    int min_frames;
+};
+
+struct StackStats {
+    bool active;
+
+    int64_t stacked_frames;
+    //! Frames that arrived while both staging slots were still waiting to be stacked.
+    int64_t dropped_frames;
+    double stack_ms;
+};
+
+//! Stacked result in the format of the frames going in, 8-bit interleaved or 16-bit raw samples, rows tightly packed.
+struct StackImage {
+    int width;
+    int height;
+    int channels;
+    int bit_depth;
+
+    int64_t frames;
+    std::vector<uint8_t> pixels;
+};
+
+//! Live stacking into a float accumulator. Memory is a fixed number of floats per sample however many frames are
+//! stacked: the running mean, plus the running variance and accepted count for kappa-sigma.
+class LiveStacker {
+  public:
+    LiveStacker();
+    ~LiveStacker();
+
+    void start(const StackSettings &settings);
+    //! Finishes the frame being stacked and keeps the result around for get_result.
+    void stop();
+
+    bool is_active() const { return active; }
+
+    //! Called from the camera thread, copies the frame into a staging slot and returns.
+    void process_frame(const FrameView &view);
+
+    //! Returns false when nothing was stacked since the last call.
+    bool get_result(StackImage &image);
+
+    StackStats stats();
+
+  private:
+    struct StagedFrame {
+        int width;
+        int height;
+        int channels;
+        int bit_depth;
+
+        //! 8-bit samples, or 16-bit samples for raw frames.
+        std::vector<uint8_t> pixels;
+    };
+
+    void worker_loop();
+    void accumulate(const StagedFrame &frame);
+
+    std::thread worker;
+
+    std::mutex frame_mutex;
+    std::condition_variable frame_cv;
+    std::deque<StagedFrame> staged_frames;
+    std::vector<StagedFrame> free_frames;
+    bool stopping;
+
+    std::atomic<bool> active;
+    std::atomic<int64_t> dropped_frames;
+    std::atomic<double> stack_ms;
+
+    // Guards the accumulator, stacking and get_result both take it
+    std::mutex stack_mutex;
+    StackSettings settings;
+
+    int stack_width;
+    int stack_height;
+    int stack_channels;
+    int stack_bit_depth;
+
+    int64_t stacked_frames;
+    int64_t result_frames;
+
+    std::vector<float> mean;
+    std::vector<float> m2;
+    std::vector<float> count;
+};
+
+#endif
@@ -0,0 +1,360 @@
+#include "stars.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "unpack.h"
+
+// Enough samples for a stable median without sorting the whole region
+static const size_t background_samples = 16384;
+
+// FWHM of a gaussian from its standard deviation
+static const float sigma_to_fwhm = 2.35482f;
+
+static int find_root(std::vector<int> &parents, int label) {
+    while(parents[label] != label) {
+        parents[label] = parents[parents[label]];
+        label          = parents[label];
+    }
+    return label;
+}
+
+static void join(std::vector<int> &parents, const int &a, const int &b) {
+    const int root_a = find_root(parents, a);
+    const int root_b = find_root(parents, b);
+    if(root_a < root_b) {
+        parents[root_b] = root_a;
+    } else if(root_b < root_a) {
+        parents[root_a] = root_b;
+    }
+}
+
+static float median(std::vector<float> &values) {
+    if(values.empty()) {
+        return 0.f;
+    }
+
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+StarDetector::StarDetector() : roi_set(false) {
+    settings.sigma      = 5.f;
+    settings.min_pixels = 3;
+    settings.max_pixels = 2500;
+    settings.max_stars  = 200;
+
+    roi = {0, 0, 0, 0};
+
+    last.sequence    = -1;
+    last.background  = 0;
+    last.noise       = 0;
+    last.median_hfr  = 0;
+    last.median_fwhm = 0;
+    last.detect_ms   = 0;
+}
+
+void StarDetector::set_settings(const StarSettings &settings) {
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    this->settings = settings;
+}
+
+void StarDetector::set_roi(const Roi &roi) {
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    this->roi = roi;
+    roi_set   = roi.width > 0 && roi.height > 0;
+}
+
+void StarDetector::clear_roi() {
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    roi_set = false;
+
+    last.stars.clear();
+    last.median_hfr  = 0;
+    last.median_fwhm = 0;
+}
+
+bool StarDetector::has_roi() {
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    return roi_set;
+}
+
+void StarDetector::process_frame(const FrameView &view) {
+    Roi region;
+    StarSettings current;
+    {
+        std::lock_guard<std::mutex> lock(detector_mutex);
+        if(!roi_set) {
+            return;
+        }
+        region  = roi;
+        current = settings;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Clip to the frame, raw regions start on a Bayer tile
+    region.x      = std::clamp(region.x, 0, view.width);
+    region.y      = std::clamp(region.y, 0, view.height);
+    region.width  = std::min(region.width, view.width - region.x);
+    region.height = std::min(region.height, view.height - region.y);
+    if(view.bit_depth > 8) {
+        region.x &= ~1;
+        region.y &= ~1;
+    }
+
+    const int bin    = extract(view, region);
+    const int width  = region.width / bin;
+    const int height = region.height / bin;
+    if(width < 3 || height < 3) {
+        return;
+    }
+
+    // Background from the median, noise from the median absolute deviation so stars don't inflate either
+    const size_t count = size_t(width) * height;
+    const size_t step  = std::max<size_t>(1, count / background_samples);
+
+    samples.clear();
+    for(size_t i = 0; i < count; i += step) {
+        samples.push_back(image[i]);
+    }
+    const float background = median(samples);
+
+    for(auto &value : samples) {
+        value = std::fabs(value - background);
+    }
+    const float noise = std::max(1.4826f * median(samples), 1e-3f);
+
+    const float threshold = background + current.sigma * noise;
+    measure(width, height, threshold, background);
+
+    // Brightest first, back to frame pixels
+    std::sort(found.begin(), found.end(), [](const Star &a, const Star &b) { return a.flux > b.flux; });
+
+    std::vector<Star> stars;
+    for(auto &star : found) {
+        if(star.pixels < current.min_pixels || star.pixels > current.max_pixels) {
+            continue;
+        }
+
+        Star s = star;
+        s.x    = region.x + (star.x + 0.5f) * bin - 0.5f;
+        s.y    = region.y + (star.y + 0.5f) * bin - 0.5f;
+        s.hfr *= bin;
+        s.fwhm *= bin;
+        stars.push_back(s);
+
+        if(int(stars.size()) >= current.max_stars) {
+            break;
+        }
+    }
+
+    std::vector<float> hfr, fwhm;
+    for(auto &star : stars) {
+        hfr.push_back(star.hfr);
+        fwhm.push_back(star.fwhm);
+    }
+
+    StarResult next;
+    next.sequence    = view.sequence;
+    next.background  = background;
+    next.noise       = noise;
+    next.median_hfr  = median(hfr);
+    next.median_fwhm = median(fwhm);
+    next.stars       = std::move(stars);
+    next.detect_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    if(roi_set) {
+        last = std::move(next);
+    }
+}
+
+StarResult StarDetector::result() {
+    std::lock_guard<std::mutex> lock(detector_mutex);
+    return last;
+}
+
+int StarDetector::extract(const FrameView &view, const Roi &region) {
+    const bool raw    = view.bit_depth > 8;
+    const int bin     = raw ? 2 : 1;
+    const int width   = region.width / bin;
+    const int height  = region.height / bin;
+    const int colours = std::min(view.channels, 3);
+
+    image.resize(size_t(std::max(width, 0)) * std::max(height, 0));
+
+    if(raw) {
+        // Unpacked rows up to the right edge of the region, two at a time for the 2x2 bin
+        const int row_width = region.x + width * 2;
+        unpacked.resize(size_t(row_width) * 2);
+
+        for(int y = 0; y < height; y++) {
+            const int sy = region.y + y * 2;
+            for(int r = 0; r < 2; r++) {
+                unpack_raw_row(unpacked.data() + r * row_width,
+                               view.data + size_t(sy + r) * view.stride,
+                               row_width,
+                               view.bit_depth,
+                               view.packed);
+            }
+
+            const uint16_t *top    = unpacked.data() + region.x;
+            const uint16_t *bottom = unpacked.data() + row_width + region.x;
+            float *dst             = image.data() + size_t(y) * width;
+            for(int x = 0; x < width; x++) {
+                dst[x] = (top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1]) * 0.25f;
+            }
+        }
+    } else {
+        const float scale = 1.f / colours;
+
+        for(int y = 0; y < height; y++) {
+            const uint8_t *src = view.data + size_t(region.y + y) * view.stride + size_t(region.x) * view.channels;
+            float *dst         = image.data() + size_t(y) * width;
+            for(int x = 0; x < width; x++) {
+                int sum = 0;
+                for(int c = 0; c < colours; c++) {
+                    sum += src[x * view.channels + c];
+                }
+                dst[x] = sum * scale;
+            }
+        }
+    }
+
+    return bin;
+}
+
+void StarDetector::measure(const int &width, const int &height, const float &threshold, const float &background) {
+    const size_t count = size_t(width) * height;
+
+    // Two pass 8-connected labelling, label 0 is background
+    labels.assign(count, 0);
+    parents.assign(1, 0);
+
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            const size_t i = size_t(y) * width + x;
+            if(image[i] <= threshold) {
+                continue;
+            }
+
+            int neighbours[4] = {x > 0 ? labels[i - 1] : 0,
+                                 y > 0 && x > 0 ? labels[i - width - 1] : 0,
+                                 y > 0 ? labels[i - width] : 0,
+                                 y > 0 && x + 1 < width ? labels[i - width + 1] : 0};
+
+            int label = 0;
+            for(auto neighbour : neighbours) {
+                if(neighbour != 0 && (label == 0 || neighbour < label)) {
+                    label = neighbour;
+                }
+            }
+
+            if(label == 0) {
+                label = int(parents.size());
+                parents.push_back(label);
+            } else {
+                for(auto neighbour : neighbours) {
+                    if(neighbour != 0 && neighbour != label) {
+                        join(parents, label, neighbour);
+                    }
+                }
+            }
+
+            labels[i] = label;
+        }
+    }
+
+    struct Component {
+        double flux;
+        double sum_x;
+        double sum_y;
+        float peak;
+        int pixels;
+        int min_x, min_y, max_x, max_y;
+    };
+
+    std::vector<Component> components(parents.size(), Component{0, 0, 0, 0, 0, width, height, -1, -1});
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            const size_t i = size_t(y) * width + x;
+            if(labels[i] == 0) {
+                continue;
+            }
+
+            const int root = find_root(parents, labels[i]);
+            labels[i]      = root;
+
+            const float value = image[i] - background;
+
+            auto &c = components[root];
+            c.flux += value;
+            c.sum_x += double(value) * x;
+            c.sum_y += double(value) * y;
+            c.peak = std::max(c.peak, value);
+            c.pixels++;
+            c.min_x = std::min(c.min_x, x);
+            c.min_y = std::min(c.min_y, y);
+            c.max_x = std::max(c.max_x, x);
+            c.max_y = std::max(c.max_y, y);
+        }
+    }
+
+    found.clear();
+    for(size_t label = 1; label < components.size(); label++) {
+        auto &c = components[label];
+        if(c.pixels == 0 || c.flux <= 0) {
+            continue;
+        }
+
+        // Stars cut by the region edge would measure too small
+        if(c.min_x == 0 || c.min_y == 0 || c.max_x == width - 1 || c.max_y == height - 1) {
+            continue;
+        }
+
+        Star star;
+        star.x      = float(c.sum_x / c.flux);
+        star.y      = float(c.sum_y / c.flux);
+        star.flux   = float(c.flux);
+        star.peak   = c.peak;
+        star.pixels = c.pixels;
+
+        // HFR over an aperture around the centroid so the faint wings below the threshold still count
+        const int radius = std::max(c.max_x - c.min_x, c.max_y - c.min_y) + 2;
+        const int x0     = std::max(0, int(star.x) - radius);
+        const int x1     = std::min(width - 1, int(star.x) + radius);
+        const int y0     = std::max(0, int(star.y) - radius);
+        const int y1     = std::min(height - 1, int(star.y) + radius);
+
+        double total = 0, weighted_radius = 0, second_moment = 0;
+        for(int y = y0; y <= y1; y++) {
+            const float *row = image.data() + size_t(y) * width;
+            for(int x = x0; x <= x1; x++) {
+                const float dx = x - star.x;
+                const float dy = y - star.y;
+                const float r2 = dx * dx + dy * dy;
+                if(r2 > float(radius * radius)) {
+                    continue;
+                }
+
+                // Negative residuals are kept so the noise in the wings averages out instead of adding up
+                const float value = row[x] - background;
+                total += value;
+                weighted_radius += value * std::sqrt(r2);
+                second_moment += value * r2;
+            }
+        }
+
+        if(total <= 0) {
+            continue;
+        }
+
+        star.hfr  = float(weighted_radius / total);
+        star.fwhm = sigma_to_fwhm * float(std::sqrt(second_moment / (2.0 * total)));
+
+        found.push_back(star);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef _stars_h_
+#define _stars_h_
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "frame_source.h"
+
+//! Region of interest in frame pixels.
+struct Roi {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+struct Star {
+    //! Sub-pixel centroid in frame pixels.
+    float x;
+    float y;
+
+    //! Background subtracted sum and peak.
+    float flux;
+    float peak;
+
+    float hfr;
+    float fwhm;
+
+    int pixels;
+};
+
+struct StarSettings {
+    //! Detection threshold in noise sigmas above the background.
+    float sigma;
+
+    int min_pixels;
+    int max_pixels;
+    int max_stars;
+};
+
+struct StarResult {
+    int64_t sequence;
+
+    float background;
+    float noise;
+
+    std::vector<Star> stars;
+    float median_hfr;
+    float median_fwhm;
+
+    double detect_ms;
+};
+
+//! Finds stars in a region of interest of each frame and measures their half flux radius and FWHM. Raw frames are
+//! binned 2x2 so every sample mixes a full Bayer tile, results are always in frame pixels.
+class StarDetector {
+  public:
+    StarDetector();
+
+    void set_settings(const StarSettings &settings);
+
+    void set_roi(const Roi &roi);
+    void clear_roi();
+    bool has_roi();
+
+    //! Called from the camera thread, does nothing without a region of interest.
+    void process_frame(const FrameView &view);
+
+    StarResult result();
+
+  private:
+    //! Fills image with the luminance of the region, returns the bin factor.
+    int extract(const FrameView &view, const Roi &roi);
+    void measure(const int &width, const int &height, const float &threshold, const float &background);
+
+    std::mutex detector_mutex;
+    StarSettings settings;
+    bool roi_set;
+    Roi roi;
+    StarResult last;
+
+    // Only touched on the camera thread
+    std::vector<float> image;
+    std::vector<float> samples;
+    std::vector<int> labels;
+    std::vector<int> parents;
+    std::vector<uint16_t> unpacked;
+    std::vector<Star> found;
+};
+
+#endif
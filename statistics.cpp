@@ -0,0 +1,218 @@
+#include "statistics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "thread_pool.h"
+#include "unpack.h"
+
+// MAD to standard deviation for normally distributed noise
+static const float mad_to_sigma = 1.4826f;
+
+static float histogram_median(const std::vector<uint32_t> &histogram, const int64_t &total) {
+    int64_t sum = 0;
+    for(size_t bin = 0; bin < histogram.size(); bin++) {
+        sum += histogram[bin];
+        if(sum * 2 >= total) {
+            return float(bin);
+        }
+    }
+    return 0.f;
+}
+
+// Walks outwards from the median, both sides at a distance d count towards the deviation histogram
+static float histogram_mad(const std::vector<uint32_t> &histogram, const int &median, const int64_t &total) {
+    const int bins = int(histogram.size());
+
+    int64_t sum = histogram[median];
+    for(int d = 1; d < bins; d++) {
+        if(median - d >= 0) {
+            sum += histogram[median - d];
+        }
+        if(median + d < bins) {
+            sum += histogram[median + d];
+        }
+        if(sum * 2 >= total) {
+            return float(d);
+        }
+    }
+    return 0.f;
+}
+
+bool compute_frame_stats(const FrameView &view, const int &step, FrameStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+
+    const bool raw       = view.bit_depth > 8;
+    const int channels   = raw ? 4 : view.channels;
+    const int bins       = 1 << view.bit_depth;
+    const int stride     = std::max(step, 1);
+    const int row_step   = raw ? 2 * stride : stride;
+    const int row_blocks = (view.height + row_step - 1) / row_step;
+
+    if(channels <= 0 || view.width <= 0 || view.height <= 0 || view.bit_depth > 16) {
+        return false;
+    }
+
+    stats.sequence  = view.sequence;
+    stats.channels  = channels;
+    stats.bit_depth = view.bit_depth;
+    stats.channel.resize(channels);
+
+    for(auto &channel : stats.channel) {
+        channel.histogram.assign(bins, 0);
+    }
+
+    std::mutex merge_mutex;
+
+    shared_thread_pool().parallel_for(
+        row_blocks,
+        [&](const int64_t &begin, const int64_t &end) {
+            // Each chunk fills its own histograms, merged once at the end
+            std::vector<uint32_t> local(size_t(channels) * bins, 0);
+            std::vector<uint16_t> unpacked;
+
+            for(int64_t block = begin; block < end; block++) {
+                const int y = int(block) * row_step;
+
+                if(raw) {
+                    for(int r = 0; r < 2 && y + r < view.height; r++) {
+                        const uint8_t *src = view.data + size_t(y + r) * view.stride;
+                        const uint16_t *row;
+                        if(view.packed) {
+                            unpacked.resize(view.width);
+                            unpack_raw_row(unpacked.data(), src, view.width, view.bit_depth, view.packed);
+                            row = unpacked.data();
+                        } else {
+                            row = reinterpret_cast<const uint16_t *>(src);
+                        }
+
+                        uint32_t *site_even = local.data() + size_t(r * 2) * bins;
+                        uint32_t *site_odd  = local.data() + size_t(r * 2 + 1) * bins;
+                        for(int x = 0; x + 1 < view.width; x += 2 * stride) {
+                            site_even[std::min<int>(row[x], bins - 1)]++;
+                            site_odd[std::min<int>(row[x + 1], bins - 1)]++;
+                        }
+                    }
+                } else {
+                    const uint8_t *row = view.data + size_t(y) * view.stride;
+                    const int jump     = stride * channels;
+                    const int bytes    = view.width * channels;
+
+                    for(int c = 0; c < channels; c++) {
+                        uint32_t *histogram = local.data() + size_t(c) * bins;
+                        for(int x = c; x < bytes; x += jump) {
+                            histogram[row[x]]++;
+                        }
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            for(int c = 0; c < channels; c++) {
+                uint32_t *dst       = stats.channel[c].histogram.data();
+                const uint32_t *src = local.data() + size_t(c) * bins;
+                for(int bin = 0; bin < bins; bin++) {
+                    dst[bin] += src[bin];
+                }
+            }
+        },
+        std::max(1, 64 / stride));
+
+    stats.samples = 0;
+    for(auto &channel : stats.channel) {
+        int64_t total = 0;
+        double sum    = 0;
+
+        channel.min = bins - 1;
+        channel.max = 0;
+        for(int bin = 0; bin < bins; bin++) {
+            const uint32_t count = channel.histogram[bin];
+            if(count == 0) {
+                continue;
+            }
+
+            total += count;
+            sum += double(count) * bin;
+            channel.min = std::min<uint32_t>(channel.min, bin);
+            channel.max = std::max<uint32_t>(channel.max, bin);
+        }
+
+        channel.mean         = total > 0 ? sum / total : 0.0;
+        channel.median       = histogram_median(channel.histogram, total);
+        channel.mad          = histogram_mad(channel.histogram, int(channel.median), total);
+        channel.clipped_low  = channel.histogram[0];
+        channel.clipped_high = channel.histogram[bins - 1];
+
+        stats.samples += total;
+    }
+
+    stats.compute_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    return true;
+}
+
+Stretch auto_stretch(const float &median, const float &mad, const float &shadow_sigma, const float &target_background) {
+    Stretch stretch;
+    stretch.shadows = std::clamp(median - shadow_sigma * mad_to_sigma * mad, 0.f, 1.f);
+
+    // The midtones balance that maps the clipped median onto the target, mtf is its own inverse in this form
+    const float x = stretch.shadows < 1.f ? (median - stretch.shadows) / (1.f - stretch.shadows) : 0.f;
+    const float t = target_background;
+    if(x <= 0.f || x >= 1.f) {
+        stretch.midtones = 0.5f;
+    } else {
+        stretch.midtones = std::clamp((t - 1.f) * x / ((2.f * t - 1.f) * x - t), 1e-4f, 1.f - 1e-4f);
+    }
+
+    return stretch;
+}
+
+FrameStatistics::FrameStatistics() : enabled(true), step(2), updated(false) {
+    last.sequence   = -1;
+    last.channels   = 0;
+    last.bit_depth  = 8;
+    last.samples    = 0;
+    last.compute_ms = 0;
+}
+
+void FrameStatistics::set_enabled(const bool &enabled) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    this->enabled = enabled;
+}
+
+void FrameStatistics::set_step(const int &step) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    this->step = std::max(step, 1);
+}
+
+void FrameStatistics::process_frame(const FrameView &view) {
+    int current_step;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        if(!enabled) {
+            return;
+        }
+        current_step = step;
+    }
+
+    if(!compute_frame_stats(view, current_step, working)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    std::swap(last, working);
+    updated = true;
+}
+
+bool FrameStatistics::latest(FrameStats &stats) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if(!updated) {
+        return false;
+    }
+
+    stats   = last;
+    updated = false;
+
+    return true;
+}
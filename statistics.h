@@ -0,0 +1,78 @@
+#ifndef _statistics_h_
+#define _statistics_h_
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "frame_source.h"
+
+struct ChannelStats {
+    //! One bin per sample value, 256 for 8-bit frames and 1 << bit_depth for raw.
+    std::vector<uint32_t> histogram;
+
+    uint32_t min;
+    uint32_t max;
+    double mean;
+    float median;
+    //! Median absolute deviation from the median.
+    float mad;
+
+    //! Samples at 0 and at full scale.
+    int64_t clipped_low;
+    int64_t clipped_high;
+};
+
+struct FrameStats {
+    int64_t sequence;
+
+    //! Interleaved channels for RGB frames, the four sites of the 2x2 Bayer tile in raster order for raw.
+    int channels;
+    int bit_depth;
+    int64_t samples;
+
+    std::vector<ChannelStats> channel;
+
+    double compute_ms;
+};
+
+//! Per-channel histograms and statistics of a frame. Rows are split across the shared thread pool with a histogram
+//! per chunk, step only visits every step-th row and column (every step-th tile for raw).
+bool compute_frame_stats(const FrameView &view, const int &step, FrameStats &stats);
+
+//! Screen transfer stretch for one channel, normalized to [0, 1]: x' = mtf(midtones, (x - shadows) / (1 - shadows)).
+struct Stretch {
+    float shadows;
+    float midtones;
+};
+
+//! Shadows clipped shadow_sigma MADs below the median, midtones chosen so the median lands on target_background.
+Stretch auto_stretch(const float &median, const float &mad, const float &shadow_sigma, const float &target_background);
+
+//! Keeps the statistics of the latest frame from the camera thread for the GUI.
+class FrameStatistics {
+  public:
+    FrameStatistics();
+
+    void set_enabled(const bool &enabled);
+    void set_step(const int &step);
+
+    //! Called from the camera thread.
+    void process_frame(const FrameView &view);
+
+    //! Returns false when nothing new was computed since the last call.
+    bool latest(FrameStats &stats);
+
+  private:
+    std::mutex stats_mutex;
+
+    bool enabled;
+    int step;
+    bool updated;
+    FrameStats last;
+
+    // Only touched on the camera thread
+    FrameStats working;
+};
+
+#endif
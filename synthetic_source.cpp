@@ -0,0 +1,235 @@
+#include "synthetic_source.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "thread_pool.h"
+#include "unpack.h"
+
+namespace {
+const std::vector<std::string> formats
+    = {"XRGB8888", "RGBA8888", "RGB888", "SRGGB10_CSI2P", "SRGGB12_CSI2P", "SRGGB12"};
+const std::vector<std::string> sizes = {"4056x3040", "2028x1520", "1332x990", "640x480"};
+
+const std::vector<std::pair<std::string, PixelOrder>> orders = {{"RGB888", PixelOrder::RGB888},
+                                                                {"BGR888", PixelOrder::BGR888},
+                                                                {"RGBA8888", PixelOrder::RGBA8888},
+                                                                {"BGRA8888", PixelOrder::BGRA8888},
+                                                                {"XRGB8888", PixelOrder::XRGB8888},
+                                                                {"XBGR8888", PixelOrder::XBGR8888}};
+
+// Relative response of red, green and blue, the sky and stars come out slightly warm like an uncorrected sensor
+float channel_response(const char &channel) { return channel == 'R' ? 1.f : (channel == 'G' ? 0.9f : 0.75f); }
+
+int wrap(const int64_t &value, const int &size) { return int(((value % size) + size) % size); }
+} // namespace
+
+SyntheticSettings default_synthetic_settings() {
+    SyntheticSettings settings;
+    settings.width      = 2028;
+    settings.height     = 1520;
+    settings.format     = "XRGB8888";
+    settings.padding    = 0;
+    settings.frame_rate = 30.0;
+    settings.stars      = 400;
+    settings.noise      = 0.01f;
+    settings.background = 0.05f;
+    settings.gradient   = 0.05f;
+    settings.drift_x    = 0.f;
+    settings.drift_y    = 0.f;
+    settings.seed       = 1;
+    return settings;
+}
+
+SyntheticSource::SyntheticSource() : settings(default_synthetic_settings()), response{1.f, 1.f, 1.f, 1.f} {
+    applies_controls = true;
+}
+
+SyntheticSource::~SyntheticSource() { stop_camera(); }
+
+bool SyntheticSource::connect_camera(const std::string &camera_name) {
+    printf("Synthetic source connected (%s)\n", camera_name.c_str());
+    connected = true;
+    return true;
+}
+
+bool SyntheticSource::configure_camera(const int &format_index, const int &size_index) {
+    if(format_index < 0 || format_index >= int(formats.size()) || size_index < 0 || size_index >= int(sizes.size())) {
+        return false;
+    }
+
+    auto next   = settings;
+    next.format = formats[format_index];
+    sscanf(sizes[size_index].c_str(), "%dx%d", &next.width, &next.height);
+
+    return configure(next);
+}
+
+bool SyntheticSource::configure(const SyntheticSettings &next) {
+    if(next.width <= 0 || next.height <= 0) {
+        return false;
+    }
+
+    // Bayer names are S<pattern><bits>, with _CSI2P when the samples are packed
+    char pattern[5] = {};
+    int bits        = 0;
+    const bool raw  = sscanf(next.format.c_str(), "S%4[RGB]%d", pattern, &bits) == 2 && strlen(pattern) == 4;
+
+    auto order = std::find_if(orders.begin(), orders.end(), [&](auto &o) { return o.first == next.format; });
+    if(!raw && order == orders.end()) {
+        printf("Unknown synthetic format %s\n", next.format.c_str());
+        return false;
+    }
+
+    settings = next;
+    width    = settings.width;
+    height   = settings.height;
+    raw_mode = raw;
+
+    if(raw) {
+        channels    = 1;
+        bit_depth   = bits;
+        packed      = settings.format.find("_CSI2P") != std::string::npos;
+        cfa_pattern = pattern;
+        stride      = int(raw_row_bytes(width, bit_depth, packed)) + settings.padding;
+
+        for(int i = 0; i < 4; i++) {
+            response[i] = channel_response(pattern[i]);
+        }
+    } else {
+        pixel_order = order->second;
+        channels    = pixel_traits(pixel_order).bytes;
+        bit_depth   = 8;
+        packed      = false;
+        cfa_pattern = "MONO";
+        stride      = width * channels + settings.padding;
+
+        response[0] = channel_response('R');
+        response[1] = channel_response('G');
+        response[2] = channel_response('B');
+        response[3] = 1.f;
+    }
+
+    set_frame_rate(settings.frame_rate);
+
+    // The field itself is noise free and only drawn once, frames add noise and drift on top
+    std::vector<float> field(size_t(width) * height);
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            field[size_t(y) * width + x]
+                = settings.background + settings.gradient * (0.7f * x / width + 0.3f * y / height);
+        }
+    }
+
+    std::mt19937 rng(settings.seed);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    for(int s = 0; s < settings.stars; s++) {
+        const float cx    = uniform(rng) * width;
+        const float cy    = uniform(rng) * height;
+        const float sigma = 0.8f + uniform(rng) * 1.2f;
+        // Mostly faint stars with a few bright ones, like a real field
+        const float peak = 0.02f + 0.9f * std::pow(uniform(rng), 4.f);
+
+        const int radius = int(std::ceil(sigma * 4));
+        for(int y = std::max(0, int(cy) - radius); y <= std::min(height - 1, int(cy) + radius); y++) {
+            for(int x = std::max(0, int(cx) - radius); x <= std::min(width - 1, int(cx) + radius); x++) {
+                const float r2 = (x + 0.5f - cx) * (x + 0.5f - cx) + (y + 0.5f - cy) * (y + 0.5f - cy);
+                field[size_t(y) * width + x] += peak * std::exp(-r2 / (2 * sigma * sigma));
+            }
+        }
+    }
+
+    sky.resize(field.size());
+    for(size_t i = 0; i < field.size(); i++) {
+        sky[i] = uint16_t(std::clamp(field[i], 0.f, 1.f) * 65535.f + 0.5f);
+    }
+
+    allocate_buffers();
+
+    printf("Synthetic %s %ix%i stride %i, %i stars at %0.1f fps\n",
+           settings.format.c_str(),
+           width,
+           height,
+           stride,
+           settings.stars,
+           settings.frame_rate);
+
+    return true;
+}
+
+std::vector<std::string> SyntheticSource::get_pixel_formats() const { return formats; }
+
+std::vector<std::string> SyntheticSource::get_pixel_format_sizes(const std::string &format) {
+    // Every size is offered in every format, like the camera only for formats it actually has
+    if(std::find(formats.begin(), formats.end(), format) == formats.end()) {
+        return {};
+    }
+
+    return sizes;
+}
+
+bool SyntheticSource::render(uint8_t *dst, const int64_t &sequence) {
+    // Exposure is relative to the default 12 ms, gain scales the read noise with the signal
+    const ControlValues &values = frame_controls.values;
+    const float scale           = values.analogue_gain * float(values.exposure_time) / 12000.f;
+    const float noise           = settings.noise * values.analogue_gain * std::sqrt(6.f);
+
+    int dx = wrap(std::lround(settings.drift_x * sequence), width);
+    int dy = wrap(std::lround(settings.drift_y * sequence), height);
+    if(raw_mode) {
+        dx &= ~1;
+        dy &= ~1;
+    }
+
+    const float full         = float((1 << bit_depth) - 1);
+    const PixelTraits traits = pixel_traits(pixel_order);
+    const int64_t min_rows   = std::max<int64_t>(1, (64 << 10) / std::max(stride, 1));
+
+    shared_thread_pool().parallel_for(
+        height,
+        [&](const int64_t &begin, const int64_t &end) {
+            std::vector<uint16_t> samples(raw_mode ? width : 0);
+
+            for(int64_t y = begin; y < end; y++) {
+                const uint16_t *src = sky.data() + size_t(wrap(y + dy, height)) * width;
+                uint8_t *row        = dst + size_t(y) * stride;
+
+                // xorshift seeded per row and frame, the sum of two uniforms is close enough to gaussian here
+                uint32_t state = uint32_t(settings.seed * 2654435761u) ^ uint32_t(sequence * 40503u + y * 9973u) ^ 1u;
+                auto sample    = [&](const float &signal) {
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    const float u1 = float(state & 0xffff) / 65536.f;
+                    const float u2 = float(state >> 16) / 65536.f;
+                    return std::clamp(signal * scale + (u1 + u2 - 1.f) * noise, 0.f, 1.f) * full + 0.5f;
+                };
+
+                for(int x = 0, sx = dx; x < width; x++, sx = sx + 1 == width ? 0 : sx + 1) {
+                    const float signal = src[sx] / 65535.f;
+
+                    if(raw_mode) {
+                        samples[x] = uint16_t(sample(signal * response[(int(y) & 1) * 2 + (x & 1)]));
+                    } else {
+                        uint8_t *pixel      = row + x * traits.bytes;
+                        pixel[traits.red]   = uint8_t(sample(signal * response[0]));
+                        pixel[traits.green] = uint8_t(sample(signal * response[1]));
+                        pixel[traits.blue]  = uint8_t(sample(signal * response[2]));
+                        if(traits.alpha >= 0) {
+                            pixel[traits.alpha] = 255;
+                        }
+                    }
+                }
+
+                if(raw_mode) {
+                    pack_raw_row(row, samples.data(), width, bit_depth, packed);
+                }
+            }
+        },
+        min_rows);
+
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef _synthetic_source_h_
+#define _synthetic_source_h_
+
+#include <string>
+#include <vector>
+
+#include "software_source.h"
+
+struct SyntheticSettings {
+    int width;
+    int height;
+    //! One of the advertised formats, XRGB8888, RGBA8888, RGB888 or a Bayer format such as SRGGB12_CSI2P.
+    std::string format;
+    //! Bytes added to every row, stands in for the camera's stride alignment.
+    int padding;
+    double frame_rate;
+
+    int stars;
+    //! Fractions of full scale: read noise sigma, sky level and how much the sky rises across the frame.
+    float noise;
+    float background;
+    float gradient;
+    //! Star field drift in pixels per frame, rounded to whole pixels (whole CFA tiles for Bayer formats).
+    float drift_x;
+    float drift_y;
+
+    uint32_t seed;
+};
+
+SyntheticSettings default_synthetic_settings();
+
+//! A virtual camera rendering a star field over a sky gradient with fresh noise every frame, so the whole pipeline
+//! can run and be measured without a sensor. Gain and exposure scale the signal like they would on a camera.
+class SyntheticSource : public SoftwareSource {
+  public:
+    SyntheticSource();
+    ~SyntheticSource();
+
+    std::vector<std::string> get_cameras() const override { return {"Synthetic"}; }
+    bool connect_camera(const std::string &camera_name) override;
+
+    bool configure_camera(const int &format_index, const int &size_index) override;
+    bool configure(const SyntheticSettings &settings);
+
+    std::vector<std::string> get_pixel_formats() const override;
+    std::vector<std::string> get_pixel_format_sizes(const std::string &format) override;
+
+  protected:
+    bool render(uint8_t *dst, const int64_t &sequence) override;
+
+  private:
+    SyntheticSettings settings;
+
+    //! The noise free field at 16-bit full scale, rendered once per configure.
+    std::vector<uint16_t> sky;
+    //! Per channel (or per CFA site, in tile order) response.
+    float response[4];
+};
+
+#endif
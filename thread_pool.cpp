@@ -0,0 +1,140 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "trace.h"
+
+namespace {
+//! Completion of one parallel_for.
+struct Completion {
+    std::atomic<int64_t> remaining;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+} // namespace
+
+ThreadPool::ThreadPool(const int &threads) : stopping(false) {
+    // The thread calling parallel_for takes a share of the work too
+    int count = threads;
+    if(count <= 0) {
+        count = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+    }
+
+    for(int i = 0; i < count; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(task_mutex);
+        stopping = true;
+    }
+    task_cv.notify_all();
+
+    for(auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallel_for(const int64_t &count,
+                              const std::function<void(const int64_t &begin, const int64_t &end)> &fn,
+                              const int64_t &min_chunk) {
+    if(count <= 0) {
+        return;
+    }
+
+    // A chunk per worker plus one for the calling thread
+    int64_t chunks = std::min<int64_t>(size() + 1, (count + min_chunk - 1) / std::max<int64_t>(min_chunk, 1));
+    if(chunks <= 1) {
+        fn(0, count);
+        return;
+    }
+
+    const int64_t chunk_size = (count + chunks - 1) / chunks;
+    chunks                   = (count + chunk_size - 1) / chunk_size;
+
+    // Shared with the tasks, the last one may still be notifying after the caller has seen the count reach zero
+    auto done       = std::make_shared<Completion>();
+    done->remaining = chunks - 1;
+
+    for(int64_t c = 1; c < chunks; c++) {
+        const int64_t begin = c * chunk_size;
+        const int64_t end   = std::min(count, begin + chunk_size);
+
+        // fn outlives the task, the caller doesn't return before every chunk has run
+        submit([&fn, done, begin, end]() {
+            fn(begin, end);
+
+            if(done->remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(done->mutex);
+                done->cv.notify_one();
+            }
+        });
+    }
+
+    fn(0, std::min(count, chunk_size));
+
+    // Help out with queued work rather than blocking, so nested calls from workers can't starve the pool
+    while(done->remaining.load() > 0) {
+        if(run_one()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(done->mutex);
+        done->cv.wait_for(lock, std::chrono::microseconds(200), [&]() { return done->remaining.load() == 0; });
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(task_mutex);
+        tasks.push_back(std::move(task));
+    }
+    task_cv.notify_one();
+}
+
+void ThreadPool::worker_loop() {
+    set_thread_name("pool");
+
+    while(true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(task_mutex);
+            task_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+
+            if(stopping && tasks.empty()) {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+bool ThreadPool::run_one() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(task_mutex);
+        if(tasks.empty()) {
+            return false;
+        }
+
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+
+    task();
+
+    return true;
+}
+
+ThreadPool &shared_thread_pool() {
+    static ThreadPool pool;
+    return pool;
+}
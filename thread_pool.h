@@ -0,0 +1,43 @@
+#ifndef _thread_pool_h_
+#define _thread_pool_h_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+  public:
+    //! 0 threads uses one worker per hardware thread, less the caller's.
+    explicit ThreadPool(const int &threads = 0);
+    ~ThreadPool();
+
+    int size() const { return int(workers.size()); }
+
+    //! Runs fn over [0, count) split into chunks of at least min_chunk, the calling thread helps and returns when all
+    //! chunks are done. Safe to call from inside a pool task.
+    void parallel_for(const int64_t &count,
+                      const std::function<void(const int64_t &begin, const int64_t &end)> &fn,
+                      const int64_t &min_chunk = 1);
+
+    void submit(std::function<void()> task);
+
+  private:
+    void worker_loop();
+    bool run_one();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+
+    std::mutex task_mutex;
+    std::condition_variable task_cv;
+    bool stopping;
+};
+
+//! Process wide pool shared by the pixel kernels.
+ThreadPool &shared_thread_pool();
+
+#endif
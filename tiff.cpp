@@ -1,49 +1,390 @@
 #include "tiff.h"
 
+#include <algorithm>
+#include <atomic>
+
 #include <tiffio.h>
+#include <zlib.h>
+
+#include "thread_pool.h"
+#include "util.h"
+
+TiffSettings default_tiff_settings() {
+    TiffSettings settings;
+    settings.strip_rows = 0;
+    settings.predictor  = TiffPredictor::Horizontal;
+    settings.level      = 3;
+    return settings;
+}
+
+// Differences against the previous pixel's sample, in place, last to first so each step still sees the original
+template<typename T> static void horizontal_difference(T *row, const int &samples, const int &samples_per_pixel) {
+    for(int i = samples - 1; i >= samples_per_pixel; i--) {
+        row[i] = T(row[i] - row[i - samples_per_pixel]);
+    }
+}
+
+// Undoes horizontal_difference, first to last
+template<typename T> static void horizontal_accumulate(T *row, const int &samples, const int &samples_per_pixel) {
+    for(int i = samples_per_pixel; i < samples; i++) {
+        row[i] = T(row[i] + row[i - samples_per_pixel]);
+    }
+}
+
+// Sets the compression tags and writes every strip, compressing them in parallel first. sample_bytes is 1, 2 or 4
+// (float, never predicted).
+static bool write_strips(TIFF *tif,
+                         const uint8_t *data,
+                         const int &width,
+                         const int &height,
+                         const int &samples_per_pixel,
+                         const int &sample_bytes,
+                         const TiffSettings &settings) {
+    const size_t row_bytes = size_t(width) * samples_per_pixel * sample_bytes;
+    const bool predict     = settings.predictor == TiffPredictor::Horizontal && sample_bytes <= 2;
+
+    int rows_per_strip = settings.strip_rows;
+    if(rows_per_strip <= 0) {
+        rows_per_strip = int((256 << 10) / row_bytes);
+    }
+    rows_per_strip = std::clamp(rows_per_strip, 1, std::max(height, 1));
+
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, predict ? PREDICTOR_HORIZONTAL : PREDICTOR_NONE);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+
+    const int strips = (height + rows_per_strip - 1) / rows_per_strip;
+    std::vector<std::vector<uint8_t>> compressed(strips);
+    std::atomic<bool> ok(true);
 
-void write_tiff(const std::string &filename,
+    shared_thread_pool().parallel_for(strips, [&](const int64_t &begin, const int64_t &end) {
+        std::vector<uint8_t> scratch;
+
+        for(int64_t s = begin; s < end; s++) {
+            const int first    = int(s) * rows_per_strip;
+            const int rows     = std::min(rows_per_strip, height - first);
+            const size_t bytes = row_bytes * rows;
+            const uint8_t *src = data + row_bytes * first;
+
+            // The predictor works on a copy, the caller's buffer stays untouched
+            if(predict) {
+                scratch.assign(src, src + bytes);
+                for(int y = 0; y < rows; y++) {
+                    uint8_t *row      = scratch.data() + row_bytes * y;
+                    const int samples = width * samples_per_pixel;
+                    if(sample_bytes == 2) {
+                        horizontal_difference(reinterpret_cast<uint16_t *>(row), samples, samples_per_pixel);
+                    } else {
+                        horizontal_difference(row, samples, samples_per_pixel);
+                    }
+                }
+                src = scratch.data();
+            }
+
+            uLongf size = compressBound(uLong(bytes));
+            compressed[s].resize(size);
+            if(compress2(compressed[s].data(), &size, src, uLong(bytes), std::clamp(settings.level, 1, 9)) != Z_OK) {
+                ok = false;
+                return;
+            }
+            compressed[s].resize(size);
+        }
+    });
+
+    if(!ok) {
+        printf("Unable to compress tiff strips\n");
+        return false;
+    }
+
+    for(int s = 0; s < strips; s++) {
+        if(TIFFWriteRawStrip(tif, uint32_t(s), compressed[s].data(), tmsize_t(compressed[s].size())) == -1) {
+            printf("Unable to write strip for tiff\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool write_tiff(const std::string &filename,
                 const int &width,
                 const int &height,
                 const int &channels,
-                const std::vector<uint8_t> &buffer) {
+                const std::vector<uint8_t> &buffer,
+                const TiffSettings &settings) {
     TIFF *tif = TIFFOpen(filename.c_str(), "w");
     if(!tif) {
         printf("Unable to open tiff file for writing (%s)\n", filename.c_str());
-        return;
+        return false;
     }
 
     TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
     TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
     TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
     TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
     TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, channels);
     TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_BOTLEFT);
     TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_NONE);
 
-    int rows_per_strip = int(65536 / width);
-    if(rows_per_strip == 0) {
-        rows_per_strip = 1;
-    }
-    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
-
     unsigned short extyp = EXTRASAMPLE_ASSOCALPHA;
     TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extyp);
 
-    const uint8_t *ptr = reinterpret_cast<const uint8_t *>(buffer.data());
-    const int jump     = width * channels;
-    for(uint32_t y = 0; y < height; y++) {
-        if(TIFFWriteScanline(tif, (void *)(ptr + y * jump), y, 0) == -1) {
-            TIFFClose(tif);
-            printf("Unable to write scanline for tiff\n");
-            return;
+    if(!write_strips(tif, buffer.data(), width, height, channels, 1, settings)) {
+        TIFFClose(tif);
+        return false;
+    }
+
+    TIFFWriteDirectory(tif);
+
+    TIFFClose(tif);
+
+    return true;
+}
+
+bool write_raw_tiff(const std::string &filename,
+                    const int &width,
+                    const int &height,
+                    const uint16_t *buffer,
+                    const int &bit_depth,
+                    const std::string &cfa_pattern,
+                    const TiffSettings &settings) {
+    TIFF *tif = TIFFOpen(filename.c_str(), "w");
+    if(!tif) {
+        printf("Unable to open tiff file for writing (%s)\n", filename.c_str());
+        return false;
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_BOTLEFT);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_NONE);
+
+    // Samples are stored at their native depth, readers need the depth to scale them
+    auto description = format("CFA=%s BITS=%i", cfa_pattern.c_str(), bit_depth);
+    TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, description.c_str());
+
+    // CFAPattern uses 0 = red, 1 = green, 2 = blue
+    if(cfa_pattern.size() == 4 && cfa_pattern != "MONO") {
+        uint16_t dimensions[2] = {2, 2};
+        uint8_t pattern[4];
+        for(int i = 0; i < 4; i++) {
+            pattern[i] = cfa_pattern[i] == 'R' ? 0 : (cfa_pattern[i] == 'G' ? 1 : 2);
         }
+
+        TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, dimensions);
+        TIFFSetField(tif, TIFFTAG_CFAPATTERN, 4, pattern);
+    }
+
+    if(!write_strips(tif, reinterpret_cast<const uint8_t *>(buffer), width, height, 1, 2, settings)) {
+        TIFFClose(tif);
+        return false;
     }
 
     TIFFWriteDirectory(tif);
 
     TIFFClose(tif);
+
+    return true;
+}
+
+bool write_float_tiff(const std::string &filename,
+                      const int &width,
+                      const int &height,
+                      const int &channels,
+                      const float *buffer,
+                      const TiffSettings &settings) {
+    TIFF *tif = TIFFOpen(filename.c_str(), "w");
+    if(!tif) {
+        printf("Unable to open tiff file for writing (%s)\n", filename.c_str());
+        return false;
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, channels);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_BOTLEFT);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_NONE);
+
+    if(channels > 1) {
+        std::vector<uint16_t> extra(channels - 1, EXTRASAMPLE_UNSPECIFIED);
+        TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, channels - 1, extra.data());
+    }
+
+    if(!write_strips(tif, reinterpret_cast<const uint8_t *>(buffer), width, height, channels, 4, settings)) {
+        TIFFClose(tif);
+        return false;
+    }
+
+    TIFFWriteDirectory(tif);
+
+    TIFFClose(tif);
+
+    return true;
+}
+
+bool read_tiff(const std::string &filename,
+               int &width,
+               int &height,
+               int &channels,
+               int &bit_depth,
+               std::string &cfa_pattern,
+               std::vector<uint8_t> &buffer) {
+    // Files opened read only are memory mapped by libtiff, raw strips are copied straight out of the mapping
+    TIFF *tif = TIFFOpen(filename.c_str(), "r");
+    if(!tif) {
+        printf("Unable to open tiff file for reading (%s)\n", filename.c_str());
+        return false;
+    }
+
+    uint32_t w = 0, h = 0;
+    uint16_t bits = 0, samples = 1, sample_format = SAMPLEFORMAT_UINT, compression = COMPRESSION_NONE;
+    uint16_t predictor = PREDICTOR_NONE, planar = PLANARCONFIG_CONTIG;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sample_format);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PREDICTOR, &predictor);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+    if((bits != 8 && bits != 16) || sample_format != SAMPLEFORMAT_UINT || planar != PLANARCONFIG_CONTIG
+       || TIFFIsTiled(tif)) {
+        printf("Unsupported tiff layout (%s)\n", filename.c_str());
+        TIFFClose(tif);
+        return false;
+    }
+
+    width       = int(w);
+    height      = int(h);
+    channels    = int(samples);
+    bit_depth   = bits;
+    cfa_pattern = "MONO";
+
+    char *description = nullptr;
+    if(TIFFGetField(tif, TIFFTAG_IMAGEDESCRIPTION, &description) && description) {
+        char cfa[8] = {};
+        int depth   = 0;
+        if(sscanf(description, "CFA=%7s BITS=%i", cfa, &depth) == 2) {
+            cfa_pattern = cfa;
+            bit_depth   = depth;
+        }
+    }
+
+    const int sample_bytes = bits / 8;
+    const size_t row_bytes = size_t(width) * channels * sample_bytes;
+    buffer.resize(row_bytes * height);
+
+    uint32_t rows_per_strip = h;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    rows_per_strip = std::clamp<uint32_t>(rows_per_strip, 1, std::max<uint32_t>(h, 1));
+
+    const int strips = int(TIFFNumberOfStrips(tif));
+    bool ok          = true;
+
+    if(compression == COMPRESSION_ADOBE_DEFLATE || compression == COMPRESSION_DEFLATE) {
+        // libtiff decodes one strip at a time, reading the compressed strips and inflating them on the pool is
+        // several times faster for the files write_strips produces
+        std::vector<std::vector<uint8_t>> compressed(strips);
+        for(int s = 0; s < strips && ok; s++) {
+            compressed[s].resize(size_t(TIFFRawStripSize(tif, uint32_t(s))));
+            ok = TIFFReadRawStrip(tif, uint32_t(s), compressed[s].data(), tmsize_t(compressed[s].size())) >= 0;
+        }
+
+        std::atomic<bool> inflated(ok);
+        shared_thread_pool().parallel_for(ok ? strips : 0, [&](const int64_t &begin, const int64_t &end) {
+            for(int64_t s = begin; s < end; s++) {
+                const int first = int(s) * int(rows_per_strip);
+                const int rows  = std::min(int(rows_per_strip), height - first);
+                uint8_t *dst    = buffer.data() + row_bytes * first;
+
+                uLongf size = uLongf(row_bytes * rows);
+                if(uncompress(dst, &size, compressed[s].data(), uLong(compressed[s].size())) != Z_OK
+                   || size != row_bytes * rows) {
+                    inflated = false;
+                    return;
+                }
+
+                if(predictor == PREDICTOR_HORIZONTAL) {
+                    const int samples = width * channels;
+                    for(int y = 0; y < rows; y++) {
+                        uint8_t *row = dst + row_bytes * y;
+                        if(sample_bytes == 2) {
+                            horizontal_accumulate(reinterpret_cast<uint16_t *>(row), samples, channels);
+                        } else {
+                            horizontal_accumulate(row, samples, channels);
+                        }
+                    }
+                }
+            }
+        });
+        ok = inflated;
+    } else {
+        const tmsize_t strip_bytes = tmsize_t(row_bytes * rows_per_strip);
+        for(int s = 0; s < strips && ok; s++) {
+            const size_t offset  = row_bytes * rows_per_strip * s;
+            const tmsize_t bytes = std::min<tmsize_t>(strip_bytes, tmsize_t(buffer.size() - offset));
+
+            ok = TIFFReadEncodedStrip(tif, uint32_t(s), buffer.data() + offset, bytes) != -1;
+        }
+    }
+
+    TIFFClose(tif);
+
+    if(!ok) {
+        printf("Unable to read strips for tiff (%s)\n", filename.c_str());
+    }
+
+    return ok;
+}
+
+bool read_float_tiff(const std::string &filename, int &width, int &height, int &channels, std::vector<float> &buffer) {
+    TIFF *tif = TIFFOpen(filename.c_str(), "r");
+    if(!tif) {
+        printf("Unable to open tiff file for reading (%s)\n", filename.c_str());
+        return false;
+    }
+
+    uint32_t w = 0, h = 0;
+    uint16_t bits = 0, samples = 1, sample_format = SAMPLEFORMAT_UINT;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sample_format);
+
+    if(bits != 32 || sample_format != SAMPLEFORMAT_IEEEFP) {
+        printf("Not a float tiff (%s)\n", filename.c_str());
+        TIFFClose(tif);
+        return false;
+    }
+
+    width    = int(w);
+    height   = int(h);
+    channels = int(samples);
+    buffer.resize(size_t(width) * height * channels);
+
+    const size_t jump = size_t(width) * channels;
+    for(uint32_t y = 0; y < h; y++) {
+        if(TIFFReadScanline(tif, buffer.data() + y * jump, y, 0) == -1) {
+            TIFFClose(tif);
+            printf("Unable to read scanline for tiff\n");
+            return false;
+        }
+    }
+
+    TIFFClose(tif);
+
+    return true;
 }
@@ -1,13 +1,57 @@
 #ifndef _tiff_h_
 #define _tiff_h_
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
-void write_tiff(const std::string &filename,
+enum class TiffPredictor { None = 0, Horizontal };
+
+//! Frames are deflate compressed strip by strip on the shared thread pool and written in order with
+//! TIFFWriteRawStrip, so the files read back with any TIFF reader.
+struct TiffSettings {
+    //! Rows per strip, 0 picks strips of about 256 KB. Smaller strips spread over more cores.
+    int strip_rows;
+    //! Horizontal differencing before compression, ignored for float samples.
+    TiffPredictor predictor;
+    //! zlib level, 1 (fastest) to 9.
+    int level;
+};
+
+TiffSettings default_tiff_settings();
+
+bool write_tiff(const std::string &filename,
                 const int &width,
                 const int &height,
                 const int &channels,
-                const std::vector<uint8_t> &buffer);
+                const std::vector<uint8_t> &buffer,
+                const TiffSettings &settings = default_tiff_settings());
+
+//! Single channel 16-bit raw sensor data, the CFA pattern (RGGB, BGGR, ...) and bit depth are recorded in the file.
+bool write_raw_tiff(const std::string &filename,
+                    const int &width,
+                    const int &height,
+                    const uint16_t *buffer,
+                    const int &bit_depth,
+                    const std::string &cfa_pattern,
+                    const TiffSettings &settings = default_tiff_settings());
+
+//! Interleaved 32-bit float samples, used for calibration masters.
+bool write_float_tiff(const std::string &filename,
+                      const int &width,
+                      const int &height,
+                      const int &channels,
+                      const float *buffer,
+                      const TiffSettings &settings = default_tiff_settings());
+//! 8-bit RGB(X) frames from write_tiff or 16-bit single channel frames from write_raw_tiff, rows packed without
+//! padding. Deflate strips are inflated in parallel, bit_depth and cfa_pattern come from the raw frame description.
+bool read_tiff(const std::string &filename,
+               int &width,
+               int &height,
+               int &channels,
+               int &bit_depth,
+               std::string &cfa_pattern,
+               std::vector<uint8_t> &buffer);
+bool read_float_tiff(const std::string &filename, int &width, int &height, int &channels, std::vector<float> &buffer);
 
 #endif
@@ -0,0 +1,238 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> tracing_enabled(false);
+
+namespace {
+const size_t ring_events = 1 << 15;
+
+struct TraceEvent {
+    const char *name;
+    int64_t sequence;
+    int64_t begin_ns;
+    int64_t end_ns;
+    int tid;
+    bool frame;
+};
+
+//! Written only by the thread holding it, read by write_trace. Buffers outlive their threads and are handed to the
+//! next new thread, events carry their tid so reuse doesn't misattribute them.
+struct TraceBuffer {
+    TraceBuffer() : events(ring_events), head(0), writing(false), first(0), in_use(false) {}
+
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> head;
+    //! Set while an event is being recorded, write_trace waits for it to clear before reading the ring.
+    std::atomic<bool> writing;
+    //! Where the current trace starts, events before it belong to an earlier one.
+    uint64_t first;
+    bool in_use;
+};
+
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> buffers;
+std::map<int, std::string> thread_names;
+
+int current_tid() { return int(syscall(SYS_gettid)); }
+
+std::string thread_name(const int &tid) {
+    char name[16] = {};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    return name[0] != 0 ? std::string(name) : "thread " + std::to_string(tid);
+}
+
+//! Hands the buffer back when its thread exits.
+struct ThreadBuffer {
+    ThreadBuffer() : buffer(nullptr), tid(0) {}
+    ~ThreadBuffer() {
+        if(buffer) {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            buffer->in_use = false;
+        }
+    }
+
+    TraceBuffer *buffer;
+    int tid;
+};
+
+thread_local ThreadBuffer thread_buffer;
+
+TraceBuffer *acquire_buffer() {
+    if(thread_buffer.buffer) {
+        return thread_buffer.buffer;
+    }
+
+    const int tid = current_tid();
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    auto free = std::find_if(buffers.begin(), buffers.end(), [](auto &b) { return !b->in_use; });
+    if(free == buffers.end()) {
+        buffers.push_back(std::make_unique<TraceBuffer>());
+        free = buffers.end() - 1;
+    }
+
+    (*free)->in_use      = true;
+    thread_buffer.buffer = free->get();
+    thread_buffer.tid    = tid;
+
+    thread_names[tid] = thread_name(tid);
+
+    return thread_buffer.buffer;
+}
+
+void record(const char *name,
+            const int64_t &sequence,
+            const int64_t &begin_ns,
+            const int64_t &end_ns,
+            const bool &frame) {
+    TraceBuffer *buffer = acquire_buffer();
+
+    // Claiming the buffer before checking the flag means write_trace, which clears the flag before checking the
+    // claim, either sees this event in flight or this event sees tracing stopped
+    buffer->writing.store(true);
+    if(!tracing_enabled.load()) {
+        buffer->writing.store(false, std::memory_order_release);
+        return;
+    }
+
+    const uint64_t head                = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head % ring_events] = TraceEvent{name, sequence, begin_ns, end_ns, thread_buffer.tid, frame};
+    buffer->head.store(head + 1, std::memory_order_release);
+    buffer->writing.store(false, std::memory_order_release);
+}
+} // namespace
+
+void start_tracing() {
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for(auto &buffer : buffers) {
+            buffer->first = buffer->head.load(std::memory_order_acquire);
+        }
+    }
+
+    tracing_enabled = true;
+    printf("Tracing started\n");
+}
+
+void stop_tracing() { tracing_enabled = false; }
+
+bool write_trace(const std::string &filename) {
+    stop_tracing();
+
+    FILE *file = fopen(filename.c_str(), "w");
+    if(!file) {
+        printf("Unable to write trace (%s)\n", filename.c_str());
+        return false;
+    }
+
+    const int pid = int(getpid());
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,\"args\":{\"name\":\"TeleZero\"}}", pid);
+    for(const auto &itr : thread_names) {
+        fprintf(file,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":\"%s\"}}",
+                pid,
+                itr.first,
+                itr.second.c_str());
+    }
+
+    size_t written = 0;
+    for(const auto &buffer : buffers) {
+        // Scopes that saw tracing on before it stopped finish their event first, none start after
+        while(buffer->writing.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+
+        const uint64_t head  = buffer->head.load(std::memory_order_acquire);
+        const uint64_t begin = std::max(buffer->first, head > ring_events ? head - ring_events : 0);
+
+        for(uint64_t i = begin; i < head; i++) {
+            const TraceEvent &e = buffer->events[i % ring_events];
+
+            const double ts  = e.begin_ns / 1000.0;
+            const double dur = (e.end_ns - e.begin_ns) / 1000.0;
+            if(e.frame) {
+                // Async begin/end pairs keyed by sequence get a track per span name
+                fprintf(file,
+                        ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"b\",\"id\":%lld,\"ts\":%.3f,"
+                        "\"pid\":%i,\"tid\":%i,\"args\":{\"sequence\":%lld}}",
+                        e.name,
+                        (long long)e.sequence,
+                        ts,
+                        pid,
+                        e.tid,
+                        (long long)e.sequence);
+                fprintf(file,
+                        ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"e\",\"id\":%lld,\"ts\":%.3f,"
+                        "\"pid\":%i,\"tid\":%i}",
+                        e.name,
+                        (long long)e.sequence,
+                        ts + dur,
+                        pid,
+                        e.tid);
+            } else {
+                fprintf(file,
+                        ",\n{\"name\":\"%s\",\"cat\":\"pipeline\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%i,\"tid\":%i",
+                        e.name,
+                        ts,
+                        dur,
+                        pid,
+                        e.tid);
+                if(e.sequence >= 0) {
+                    fprintf(file, ",\"args\":{\"sequence\":%lld}", (long long)e.sequence);
+                }
+                fprintf(file, "}");
+            }
+            written++;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    printf("Trace: %zu events from %zu threads written to %s\n", written, thread_names.size(), filename.c_str());
+    return true;
+}
+
+void set_thread_name(const char *name) {
+    pthread_setname_np(pthread_self(), name);
+
+    // A thread that already traced under its old name keeps its tid, only the label changes
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if(thread_buffer.buffer) {
+        thread_names[thread_buffer.tid] = name;
+    }
+}
+
+void trace_event(const char *name, const int64_t &sequence, const int64_t &begin_ns, const int64_t &end_ns) {
+    record(name, sequence, begin_ns, end_ns, false);
+}
+
+void trace_frame(const char *name, const int64_t &sequence, const int64_t &begin_ns, const int64_t &end_ns) {
+    if(tracing_enabled.load(std::memory_order_relaxed)) {
+        record(name, sequence, begin_ns, end_ns, true);
+    }
+}
+
+int64_t trace_now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
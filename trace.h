@@ -0,0 +1,48 @@
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//! Optional frame lifecycle tracing. While tracing, every thread records begin/end events into its own ring buffer
+//! (the newest events per thread are kept), write_trace saves them as Chrome trace event JSON for chrome://tracing
+//! or ui.perfetto.dev. Scopes cost one relaxed load while tracing is off.
+void start_tracing();
+void stop_tracing();
+
+extern std::atomic<bool> tracing_enabled;
+
+//! Stops tracing and writes everything recorded since start_tracing.
+bool write_trace(const std::string &filename);
+
+//! Names the calling thread, for the trace as well as top and gdb. At most 15 characters.
+void set_thread_name(const char *name);
+
+//! Records a span on the calling thread, tagged with the frame sequence when it's known (-1 otherwise). name must be
+//! a string literal, only the pointer is kept.
+void trace_event(const char *name, const int64_t &sequence, const int64_t &begin_ns, const int64_t &end_ns);
+//! A frame's span on its own track, for spans that didn't happen on any thread such as the sensor exposure.
+void trace_frame(const char *name, const int64_t &sequence, const int64_t &begin_ns, const int64_t &end_ns);
+
+//! Now on the trace clock (CLOCK_MONOTONIC) in nanoseconds.
+int64_t trace_now();
+
+class TraceScope {
+  public:
+    explicit TraceScope(const char *name, const int64_t &sequence = -1) :
+        name(name), sequence(sequence), begin(tracing_enabled.load(std::memory_order_relaxed) ? trace_now() : 0) {}
+
+    ~TraceScope() {
+        if(begin != 0 && tracing_enabled.load(std::memory_order_relaxed)) {
+            trace_event(name, sequence, begin, trace_now());
+        }
+    }
+
+  private:
+    const char *name;
+    int64_t sequence;
+    int64_t begin;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include "unpack.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+// CSI-2 packing stores the high 8 bits of each sample in its own byte, followed by a byte (or bytes) holding the low
+// bits of the whole group:
+//   RAW10: 4 samples in 5 bytes, RAW12: 2 samples in 3 bytes, RAW14: 4 samples in 7 bytes
+
+static void unpack_row_10(uint16_t *dst, const uint8_t *src, const int &begin, const int &width) {
+    for(int x = begin; x < width; x++) {
+        const uint8_t *group = src + (x >> 2) * 5;
+        const int i          = x & 3;
+        dst[x]               = uint16_t((group[i] << 2) | ((group[4] >> (i * 2)) & 0x3));
+    }
+}
+
+static void unpack_row_12(uint16_t *dst, const uint8_t *src, const int &begin, const int &width) {
+    for(int x = begin; x < width; x++) {
+        const uint8_t *group = src + (x >> 1) * 3;
+        const int i          = x & 1;
+        dst[x]               = uint16_t((group[i] << 4) | ((group[2] >> (i * 4)) & 0xf));
+    }
+}
+
+static void unpack_row_14(uint16_t *dst, const uint8_t *src, const int &begin, const int &width) {
+    for(int x = begin; x < width; x++) {
+        const uint8_t *group = src + (x >> 2) * 7;
+        const int i          = x & 3;
+
+        // The 24 low bits are spread over the last 3 bytes of the group, 6 per sample
+        const uint32_t low = group[4] | (group[5] << 8) | (group[6] << 16);
+        dst[x]             = uint16_t((group[i] << 6) | ((low >> (i * 6)) & 0x3f));
+    }
+}
+
+#if defined(__ARM_NEON)
+// Each pass loads 16 bytes and unpacks 8 samples, gathering the high and low bytes with a table lookup. Passes stop
+// while there are still 16 readable bytes left in the row and the scalar loop finishes off the tail.
+
+static int unpack_row_10_neon(uint16_t *dst, const uint8_t *src, const int &width, const size_t &row_bytes) {
+    static const uint8_t high_index[8] = {0, 1, 2, 3, 5, 6, 7, 8};
+    static const uint8_t low_index[8]  = {4, 4, 4, 4, 9, 9, 9, 9};
+    static const int16_t low_shift[8]  = {0, -2, -4, -6, 0, -2, -4, -6};
+
+    const uint8x8_t high_lookup = vld1_u8(high_index);
+    const uint8x8_t low_lookup  = vld1_u8(low_index);
+    const int16x8_t shift       = vld1q_s16(low_shift);
+    const uint16x8_t mask       = vdupq_n_u16(0x3);
+
+    int x = 0;
+    for(size_t offset = 0; x + 8 <= width && offset + 16 <= row_bytes; x += 8, offset += 10) {
+        const uint8x16_t bytes = vld1q_u8(src + offset);
+
+        uint16x8_t high = vshll_n_u8(vqtbl1_u8(bytes, high_lookup), 2);
+        uint16x8_t low  = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(bytes, low_lookup)), shift), mask);
+
+        vst1q_u16(dst + x, vorrq_u16(high, low));
+    }
+
+    return x;
+}
+
+static int unpack_row_12_neon(uint16_t *dst, const uint8_t *src, const int &width, const size_t &row_bytes) {
+    static const uint8_t high_index[8] = {0, 1, 3, 4, 6, 7, 9, 10};
+    static const uint8_t low_index[8]  = {2, 2, 5, 5, 8, 8, 11, 11};
+    static const int16_t low_shift[8]  = {0, -4, 0, -4, 0, -4, 0, -4};
+
+    const uint8x8_t high_lookup = vld1_u8(high_index);
+    const uint8x8_t low_lookup  = vld1_u8(low_index);
+    const int16x8_t shift       = vld1q_s16(low_shift);
+    const uint16x8_t mask       = vdupq_n_u16(0xf);
+
+    int x = 0;
+    for(size_t offset = 0; x + 8 <= width && offset + 16 <= row_bytes; x += 8, offset += 12) {
+        const uint8x16_t bytes = vld1q_u8(src + offset);
+
+        uint16x8_t high = vshll_n_u8(vqtbl1_u8(bytes, high_lookup), 4);
+        uint16x8_t low  = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(bytes, low_lookup)), shift), mask);
+
+        vst1q_u16(dst + x, vorrq_u16(high, low));
+    }
+
+    return x;
+}
+
+static int unpack_row_14_neon(uint16_t *dst, const uint8_t *src, const int &width, const size_t &row_bytes) {
+    // The low 6 bits of a sample can straddle two bytes, so each lane gets a 16-bit pair to shift from
+    static const uint8_t high_index[8] = {0, 1, 2, 3, 7, 8, 9, 10};
+    static const uint8_t low_index[8]  = {4, 4, 5, 6, 11, 11, 12, 13};
+    static const uint8_t pair_index[8] = {5, 5, 6, 6, 12, 12, 13, 13};
+    static const int16_t low_shift[8]  = {0, -6, -4, -2, 0, -6, -4, -2};
+
+    const uint8x8_t high_lookup = vld1_u8(high_index);
+    const uint8x8_t low_lookup  = vld1_u8(low_index);
+    const uint8x8_t pair_lookup = vld1_u8(pair_index);
+    const int16x8_t shift       = vld1q_s16(low_shift);
+    const uint16x8_t mask       = vdupq_n_u16(0x3f);
+
+    int x = 0;
+    for(size_t offset = 0; x + 8 <= width && offset + 16 <= row_bytes; x += 8, offset += 14) {
+        const uint8x16_t bytes = vld1q_u8(src + offset);
+
+        uint16x8_t high = vshll_n_u8(vqtbl1_u8(bytes, high_lookup), 6);
+        uint16x8_t pair
+            = vorrq_u16(vmovl_u8(vqtbl1_u8(bytes, low_lookup)), vshll_n_u8(vqtbl1_u8(bytes, pair_lookup), 8));
+        uint16x8_t low = vandq_u16(vshlq_u16(pair, shift), mask);
+
+        vst1q_u16(dst + x, vorrq_u16(high, low));
+    }
+
+    return x;
+}
+#endif
+
+void unpack_raw_row(uint16_t *dst, const uint8_t *src, const int &width, const int &bit_depth, const bool &packed) {
+    if(!packed) {
+        memcpy(dst, src, size_t(width) * sizeof(uint16_t));
+        return;
+    }
+
+#if defined(__ARM_NEON)
+    const size_t row_bytes = raw_row_bytes(width, bit_depth, packed);
+#endif
+
+    int x = 0;
+    switch(bit_depth) {
+        case 10: {
+#if defined(__ARM_NEON)
+            x = unpack_row_10_neon(dst, src, width, row_bytes);
+#endif
+            unpack_row_10(dst, src, x, width);
+        } break;
+
+        case 12: {
+#if defined(__ARM_NEON)
+            x = unpack_row_12_neon(dst, src, width, row_bytes);
+#endif
+            unpack_row_12(dst, src, x, width);
+        } break;
+
+        case 14: {
+#if defined(__ARM_NEON)
+            x = unpack_row_14_neon(dst, src, width, row_bytes);
+#endif
+            unpack_row_14(dst, src, x, width);
+        } break;
+
+        default: {
+            printf("Unsupported packed bit depth %i\n", bit_depth);
+        } break;
+    }
+}
+
+void unpack_raw(uint16_t *dst,
+                const uint8_t *src,
+                const int &width,
+                const int &height,
+                const size_t &src_stride,
+                const int &bit_depth,
+                const bool &packed) {
+    const int64_t min_rows = std::max<int64_t>(1, (128 << 10) / std::max<size_t>(src_stride, 1));
+
+    shared_thread_pool().parallel_for(
+        height,
+        [&](const int64_t &begin, const int64_t &end) {
+            for(int64_t y = begin; y < end; y++) {
+                unpack_raw_row(dst + y * width, src + y * src_stride, width, bit_depth, packed);
+            }
+        },
+        min_rows);
+}
+
+void pack_raw_row(uint8_t *dst, const uint16_t *src, const int &width, const int &bit_depth, const bool &packed) {
+    if(!packed) {
+        memcpy(dst, src, size_t(width) * sizeof(uint16_t));
+        return;
+    }
+
+    if(bit_depth != 10 && bit_depth != 12 && bit_depth != 14) {
+        printf("Unsupported packed bit depth %i\n", bit_depth);
+        return;
+    }
+
+    // High bytes first, then the low bits of the group packed little endian
+    const int low_bits    = bit_depth - 8;
+    const int group       = bit_depth == 12 ? 2 : 4;
+    const int group_bytes = group + (group * low_bits + 7) / 8;
+
+    for(int first = 0; first < width; first += group) {
+        uint8_t *out = dst + (first / group) * group_bytes;
+
+        uint32_t low = 0;
+        for(int i = 0; i < group; i++) {
+            const uint16_t sample = first + i < width ? src[first + i] : 0;
+
+            out[i] = uint8_t(sample >> low_bits);
+            low |= uint32_t(sample & ((1 << low_bits) - 1)) << (i * low_bits);
+        }
+
+        for(int b = group; b < group_bytes; b++) {
+            out[b] = uint8_t(low >> ((b - group) * 8));
+        }
+    }
+}
+
+size_t raw_row_bytes(const int &width, const int &bit_depth, const bool &packed) {
+    if(!packed) {
+        return size_t(width) * sizeof(uint16_t);
+    }
+
+    // Partial groups at the end of a row still take the whole group
+    switch(bit_depth) {
+        case 10: {
+            return size_t((width + 3) / 4) * 5;
+        }
+
+        case 12: {
+            return size_t((width + 1) / 2) * 3;
+        }
+
+        case 14: {
+            return size_t((width + 3) / 4) * 7;
+        }
+    }
+
+    return size_t(width) * ((bit_depth + 7) / 8);
+}
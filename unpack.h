@@ -0,0 +1,26 @@
+#ifndef _unpack_h_
+#define _unpack_h_
+
+#include <cstddef>
+#include <cstdint>
+
+//! Unpacks one row of MIPI CSI-2 packed 10/12/14-bit samples to 16-bit. Samples keep their native range, 16-bit
+//! rows are copied as they are.
+void unpack_raw_row(uint16_t *dst, const uint8_t *src, const int &width, const int &bit_depth, const bool &packed);
+
+//! Unpacks a whole raw frame into a tightly packed 16-bit image, rows are split across the shared thread pool.
+void unpack_raw(uint16_t *dst,
+                const uint8_t *src,
+                const int &width,
+                const int &height,
+                const size_t &src_stride,
+                const int &bit_depth,
+                const bool &packed);
+
+//! The inverse of unpack_raw_row, packs width 16-bit samples into one CSI-2 row (or copies them when not packed).
+void pack_raw_row(uint8_t *dst, const uint16_t *src, const int &width, const int &bit_depth, const bool &packed);
+
+//! Bytes one packed row of width samples takes, before any stride padding.
+size_t raw_row_bytes(const int &width, const int &bit_depth, const bool &packed);
+
+#endif
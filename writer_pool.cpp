@@ -0,0 +1,194 @@
+#include "writer_pool.h"
+
+#include <algorithm>
+
+#include "latency.h"
+#include "trace.h"
+
+WriterPool::WriterPool() :
+    running(false), max_bytes(0), queued_bytes(0), full_policy(QueueFullPolicy::Block), stopping(false), writes_in_flight(0),
+    written_frames(0), dropped_frames(0), failed_frames(0), written_bytes(0) {}
+
+WriterPool::~WriterPool() { stop(); }
+
+bool WriterPool::start(const int &threads, const size_t &max_queue_bytes, const QueueFullPolicy &policy) {
+    if(is_running()) {
+        printf("Writer pool already running\n");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(job_mutex);
+
+    max_bytes   = max_queue_bytes;
+    full_policy = policy;
+    stopping    = false;
+
+    queued_bytes   = 0;
+    written_frames = 0;
+    dropped_frames = 0;
+    failed_frames  = 0;
+    written_bytes  = 0;
+    first_write    = std::chrono::steady_clock::time_point();
+    last_write     = first_write;
+
+    for(int i = 0; i < std::max(threads, 1); i++) {
+        workers.emplace_back(&WriterPool::worker_loop, this);
+    }
+    running = true;
+
+    printf("Writer pool started: %i threads, %zu MB queue\n", std::max(threads, 1), max_bytes >> 20);
+
+    return true;
+}
+
+void WriterPool::stop() {
+    if(!is_running()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        stopping = true;
+    }
+    job_cv.notify_all();
+    space_cv.notify_all();
+
+    for(auto &worker : workers) {
+        worker.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        workers.clear();
+        running = false;
+    }
+    space_cv.notify_all();
+
+    printf("Writer pool stopped: %lld written, %lld dropped, %lld failed\n",
+           (long long)written_frames,
+           (long long)dropped_frames,
+           (long long)failed_frames);
+}
+
+bool WriterPool::submit(WriteJob job, const bool &wait) {
+    const size_t bytes = job.buffer.size();
+
+    std::unique_lock<std::mutex> lock(job_mutex);
+    if(!running || stopping) {
+        dropped_frames++;
+        return false;
+    }
+
+    // A single frame bigger than the whole queue is still let through once the queue is empty
+    auto has_space = [&]() { return jobs.empty() || queued_bytes + bytes <= max_bytes; };
+
+    switch(full_policy) {
+        case QueueFullPolicy::Block: {
+            if(!wait && !has_space()) {
+                dropped_frames++;
+                return false;
+            }
+
+            space_cv.wait(lock, [&]() { return stopping || has_space(); });
+            if(stopping) {
+                dropped_frames++;
+                return false;
+            }
+        } break;
+
+        case QueueFullPolicy::DropOldest: {
+            while(!has_space()) {
+                queued_bytes -= jobs.front().buffer.size();
+                jobs.pop_front();
+                dropped_frames++;
+            }
+        } break;
+
+        case QueueFullPolicy::DropNewest: {
+            if(!has_space()) {
+                dropped_frames++;
+                return false;
+            }
+        } break;
+    }
+
+    queued_bytes += bytes;
+    jobs.push_back(std::move(job));
+    lock.unlock();
+
+    job_cv.notify_one();
+
+    return true;
+}
+
+void WriterPool::flush() {
+    std::unique_lock<std::mutex> lock(job_mutex);
+    space_cv.wait(lock, [this]() { return !running || (jobs.empty() && writes_in_flight == 0); });
+}
+
+WriterStats WriterPool::stats() {
+    std::lock_guard<std::mutex> lock(job_mutex);
+
+    WriterStats s;
+    s.queued_frames  = jobs.size();
+    s.queued_bytes   = queued_bytes;
+    s.written_frames = written_frames;
+    s.dropped_frames = dropped_frames;
+    s.failed_frames  = failed_frames;
+
+    // Over the time writes were happening, the rate holds still once the queue has drained
+    const auto end       = writes_in_flight > 0 ? std::chrono::steady_clock::now() : last_write;
+    const double seconds = std::chrono::duration<double>(end - first_write).count();
+    s.mb_per_second      = written_bytes > 0 && seconds > 0 ? (written_bytes / double(1 << 20)) / seconds : 0;
+
+    return s;
+}
+
+void WriterPool::worker_loop() {
+    set_thread_name("writer");
+
+    while(true) {
+        WriteJob job;
+        {
+            std::unique_lock<std::mutex> lock(job_mutex);
+            job_cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+
+            if(jobs.empty()) {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+
+            queued_bytes -= job.buffer.size();
+            writes_in_flight++;
+        }
+        space_cv.notify_all();
+
+        const auto write_start = std::chrono::steady_clock::now();
+        bool ok;
+        {
+            TraceScope trace("write", job.sequence);
+            ok = job.write(job.buffer);
+        }
+        stage_latency(LatencyStage::CaptureWrite).record_since(write_start);
+
+        {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            writes_in_flight--;
+
+            if(first_write == std::chrono::steady_clock::time_point() || write_start < first_write) {
+                first_write = write_start;
+            }
+            last_write = std::chrono::steady_clock::now();
+
+            if(ok) {
+                written_frames++;
+                written_bytes += job.buffer.size();
+            } else {
+                failed_frames++;
+            }
+        }
+        space_cv.notify_all();
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _writer_pool_h_
+#define _writer_pool_h_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! What submit does when the queued bytes would go over the limit.
+enum class QueueFullPolicy { Block = 0, DropOldest, DropNewest };
+
+struct WriteJob {
+    int64_t sequence;
+    std::vector<uint8_t> buffer;
+
+    //! Runs on a writer thread, returns false if the frame couldn't be stored.
+    std::function<bool(const std::vector<uint8_t> &buffer)> write;
+};
+
+struct WriterStats {
+    size_t queued_frames;
+    size_t queued_bytes;
+
+    int64_t written_frames;
+    int64_t dropped_frames;
+    int64_t failed_frames;
+
+    //! From the first write starting to the last one finishing, idle time before and after doesn't count.
+    double mb_per_second;
+};
+
+//! Background threads draining a byte-bounded queue of frames to storage.
+class WriterPool {
+  public:
+    WriterPool();
+    ~WriterPool();
+
+    bool start(const int &threads, const size_t &max_queue_bytes, const QueueFullPolicy &policy);
+    //! Writes everything still queued, then joins the threads.
+    void stop();
+
+    bool is_running() const { return running; }
+
+    //! Returns false if this job was not queued, older jobs dropped to make room only show up in stats. Without wait
+    //! a full queue under the Block policy rejects the job instead, for callers that must never stall.
+    bool submit(WriteJob job, const bool &wait = true);
+
+    //! Blocks until the queue is empty and no writes are in flight.
+    void flush();
+
+    WriterStats stats();
+
+  private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::deque<WriteJob> jobs;
+
+    std::mutex job_mutex;
+    std::condition_variable job_cv;
+    std::condition_variable space_cv;
+
+    std::atomic<bool> running;
+
+    size_t max_bytes;
+    size_t queued_bytes;
+    QueueFullPolicy full_policy;
+    bool stopping;
+    int writes_in_flight;
+
+    int64_t written_frames;
+    int64_t dropped_frames;
+    int64_t failed_frames;
+    int64_t written_bytes;
+    //! Start of the earliest and end of the latest write, the span mb_per_second is measured over.
+    std::chrono::steady_clock::time_point first_write;
+    std::chrono::steady_clock::time_point last_write;
+};
+
+#endif